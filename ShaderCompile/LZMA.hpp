@@ -24,176 +24,178 @@ namespace LZMA
 	}
 	static ISzAlloc g_Alloc = { SzAlloc, SzFree };
 
-	static inline SRes LzmaEncode( const Byte* inBuffer, size_t inSize, Byte* outBuffer, size_t outSize, size_t* outSizeProcessed )
+	// Compression presets, all of them produce the same format
+	enum class Preset
 	{
-		class CInStreamRam : public ISeqInStream
-		{
-			const Byte* Data;
-			size_t Size;
-			size_t Pos;
+		Fast,
+		Default,
+		Max,
 
-			SRes DoRead( void* buf, size_t* size )
-			{
-				size_t inSize = *size;
-				size_t remain = Size - Pos;
-				if ( inSize > remain )
-					inSize = remain;
+		Count
+	};
 
-				for ( size_t i = 0; i < inSize; ++i )
-					reinterpret_cast<Byte*>( buf )[i] = Data[Pos + i];
+	static inline CLzmaEncProps PresetProps( Preset preset )
+	{
+		CLzmaEncProps props;
+		LzmaEncProps_Init( &props );
+		switch ( preset )
+		{
+		case Preset::Fast:
+			props.level = 1;
+			break;
+		case Preset::Max:
+			// blocks are small, a dictionary much bigger than them only costs memory
+			props.level    = 9;
+			props.fb       = 273;
+			props.dictSize = 1 << 20;
+			break;
+		default:
+			break;
+		}
+		return props;
+	}
 
-				Pos += inSize;
-				*size = inSize;
-				return SZ_OK;
-			}
+	// Encoder state and output buffer are kept between blocks, compressing a block allocates nothing once the buffer is big enough
+	class CEncoder
+	{
+	public:
+		explicit CEncoder( Preset preset = Preset::Default )
+		{
+			m_hEnc = LzmaEnc_Create( &g_Alloc );
+			if ( !m_hEnc )
+				return;
 
-			static SRes StaticRead( void* p, void* buf, size_t* size )
-			{
-				return reinterpret_cast<CInStreamRam*>( p )->DoRead( buf, size );
-			}
+			CLzmaEncProps props = PresetProps( preset );
 
-		public:
-			CInStreamRam( const Byte* data, size_t size )
+			SizeT propsSize = LZMA_PROPS_SIZE;
+			if ( LzmaEnc_SetProps( m_hEnc, &props ) != SZ_OK || LzmaEnc_WriteProperties( m_hEnc, m_properties, &propsSize ) != SZ_OK )
 			{
-				Data = data;
-				Size = size;
-				Pos = 0;
-				Read = StaticRead;
+				LzmaEnc_Destroy( m_hEnc, &g_Alloc, &g_Alloc );
+				m_hEnc = nullptr;
 			}
-		};
+		}
 
-		class COutStreamRam : public ISeqOutStream
+		~CEncoder()
 		{
-			size_t Size;
+			if ( m_hEnc )
+				LzmaEnc_Destroy( m_hEnc, &g_Alloc, &g_Alloc );
+		}
 
-			static size_t StaticWrite( void* p, const void* buf, size_t size )
-			{
-				return reinterpret_cast<COutStreamRam*>( p )->DoWrite( buf, size );
-			}
+		CEncoder( const CEncoder& ) = delete;
+		CEncoder& operator=( const CEncoder& ) = delete;
 
-		public:
-			Byte* Data;
-			size_t Pos;
-			bool Overflow;
+		// Returns our header followed by the compressed bits, the buffer is reused by the next call
+		const uint8_t* Compress( const uint8_t* pInput, size_t inputSize, size_t* pOutputSize )
+		{
+			*pOutputSize = 0;
+			if ( !m_hEnc )
+				return nullptr;
 
-			COutStreamRam( Byte* data, size_t size )
+			// using same work buffer calcs as the SDK 105% + 64K
+			const size_t outSize = inputSize / 20 * 21 + ( 1 << 16 );
+			if ( m_outputCapacity < outSize )
 			{
-				Data = data;
-				Size = size;
-				Pos = 0;
-				Overflow = false;
-				Write = StaticWrite;
+				m_pOutput.reset( new uint8_t[outSize] );
+				m_outputCapacity = outSize;
 			}
 
-			size_t DoWrite( const void* buf, size_t size )
+			// compress straight behind our header, leaving out the room the SDK header used to take
+			SizeT compressedSize = outSize - sizeof( lzma_header_t ) - LZMA_PROPS_SIZE - 8;
+			const SRes result = LzmaEnc_MemEncode( m_hEnc, m_pOutput.get() + sizeof( lzma_header_t ), &compressedSize, pInput, inputSize, 0, nullptr, &g_Alloc, &g_Alloc );
+			if ( result != SZ_OK )
 			{
-				size_t i;
-				for ( i = 0; i < size && Pos < Size; ++i )
-					Data[Pos++] = reinterpret_cast<const Byte*>( buf )[i];
-				if ( i != size )
-					Overflow = true;
-				return i;
+				Assert( result == SZ_OK );
+				return nullptr;
 			}
-		};
-
-		// Based on Encode helper in SDK/LzmaUtil
-		*outSizeProcessed = 0;
 
-		const size_t kMinDestSize = 13;
-		if ( outSize < kMinDestSize )
-			return SZ_ERROR_FAIL;
-
-		CLzmaEncHandle enc;
-		SRes res;
-		CLzmaEncProps props;
+			// construct our header in front of the compressed bits
+			lzma_header_t* pHeader = reinterpret_cast<lzma_header_t*>( m_pOutput.get() );
+			pHeader->id = LZMA_ID;
+			pHeader->actualSize = gsl::narrow<uint32_t>( inputSize );
+			pHeader->lzmaSize = gsl::narrow<uint32_t>( compressedSize );
+			memcpy( pHeader->properties, m_properties, LZMA_PROPS_SIZE );
 
-		enc = LzmaEnc_Create( &g_Alloc );
-		if ( !enc )
-			return SZ_ERROR_FAIL;
+			// final output size is our header plus compressed bits
+			*pOutputSize = sizeof( lzma_header_t ) + compressedSize;
 
-		LzmaEncProps_Init( &props );
-		res = LzmaEnc_SetProps( enc, &props );
+			return m_pOutput.get();
+		}
 
-		if ( res != SZ_OK )
-			return res;
+		// Returns nullptr when the compressed block would not be smaller
+		const uint8_t* OpportunisticCompress( const uint8_t* pInput, size_t inputSize, size_t* pOutputSize )
+		{
+			const uint8_t* pRet = Compress( pInput, inputSize, pOutputSize );
+			if ( *pOutputSize >= inputSize )
+			{
+				// compression got worse or stayed the same
+				return nullptr;
+			}
 
-		COutStreamRam outStream( outBuffer, outSize );
+			return pRet;
+		}
 
-		Byte header[LZMA_PROPS_SIZE + 8];
-		size_t headerSize = LZMA_PROPS_SIZE;
+	private:
+		CLzmaEncHandle m_hEnc;
+		Byte m_properties[LZMA_PROPS_SIZE];
+		std::unique_ptr<uint8_t[]> m_pOutput;
+		size_t m_outputCapacity = 0;
+	};
 
-		res = LzmaEnc_WriteProperties( enc, header, &headerSize );
-		if ( res != SZ_OK )
-			return res;
+	// Cheap guess of the LZMA output size: order-0 entropy of the literals plus a fixed cost for every
+	// match a greedy hash probe finds. Good enough to tell blocks that can't shrink from the ones that can.
+	static inline size_t EstimateCompressedSize( const uint8_t* pInput, size_t inputSize )
+	{
+		static constexpr size_t HASH_BITS = 12;
+		static constexpr size_t MIN_MATCH = 4;
+		static constexpr size_t MATCH_COST = 3; // bytes of a typical short distance match
 
-		// Uncompressed size after properties in header
-		for ( int i = 0; i < 8; i++ )
-			header[headerSize++] = static_cast<Byte>( inSize >> ( 8 * i ) );
+		uint32_t hashTable[1 << HASH_BITS] = {};
+		uint32_t histogram[256] = {};
+		size_t nLiterals = 0;
+		size_t nMatches = 0;
 
-		if ( outStream.DoWrite( header, headerSize ) != headerSize )
-			res = SZ_ERROR_WRITE;
-		else if ( res == SZ_OK )
+		size_t i = 0;
+		while ( i + MIN_MATCH <= inputSize )
 		{
-			CInStreamRam inStream( inBuffer, inSize );
-			res = LzmaEnc_Encode( enc, &outStream, &inStream, nullptr, &g_Alloc, &g_Alloc );
+			uint32_t nPrefix;
+			memcpy( &nPrefix, pInput + i, sizeof( nPrefix ) );
+			uint32_t& nCandidate = hashTable[( nPrefix * 2654435761U ) >> ( 32 - HASH_BITS )];
+			const size_t iCandidate = nCandidate;
+			nCandidate = static_cast<uint32_t>( i + 1 ); // 0 is an empty slot
 
-			if ( outStream.Overflow )
-				res = SZ_ERROR_FAIL;
-			else
-				*outSizeProcessed = outStream.Pos;
-		}
-
-		LzmaEnc_Destroy( enc, &g_Alloc, &g_Alloc );
+			if ( iCandidate && memcmp( pInput + iCandidate - 1, pInput + i, MIN_MATCH ) == 0 )
+			{
+				size_t nLength = MIN_MATCH;
+				while ( i + nLength < inputSize && pInput[iCandidate - 1 + nLength] == pInput[i + nLength] )
+					++nLength;
+				++nMatches;
+				i += nLength;
+				continue;
+			}
 
-		return res;
-	}
+			++histogram[pInput[i++]];
+			++nLiterals;
+		}
+		for ( ; i < inputSize; ++i, ++nLiterals )
+			++histogram[pInput[i]];
 
-	static inline uint8_t* Compress( uint8_t* pInput, size_t inputSize, size_t* pOutputSize )
-	{
-		*pOutputSize = 0;
-
-		// using same work buffer calcs as the SDK 105% + 64K
-		size_t outSize = inputSize / 20 * 21 + ( 1 << 16 );
-		uint8_t* pOutputBuffer = new uint8_t[outSize];
-		if ( !pOutputBuffer )
-			return nullptr;
-
-		// compress, skipping past our header
-		size_t compressedSize;
-		int result = LzmaEncode( pInput, inputSize, pOutputBuffer + sizeof( lzma_header_t ), outSize - sizeof( lzma_header_t ), &compressedSize );
-		if ( result != SZ_OK )
+		double flBits = 0.0;
+		for ( const uint32_t nCount : histogram )
 		{
-			Assert( result == SZ_OK );
-			delete[] pOutputBuffer;
-			return nullptr;
+			if ( nCount )
+				flBits -= nCount * std::log2( static_cast<double>( nCount ) / nLiterals );
 		}
 
-		// construct our header, strip theirs
-		lzma_header_t* pHeader = reinterpret_cast<lzma_header_t*>( pOutputBuffer );
-		pHeader->id = LZMA_ID;
-		pHeader->actualSize = gsl::narrow<uint32_t>( inputSize );
-		pHeader->lzmaSize = gsl::narrow<uint32_t>( compressedSize - 13 );
-		memcpy( pHeader->properties, pOutputBuffer + sizeof( lzma_header_t ), LZMA_PROPS_SIZE );
-
-		// shift the compressed data into place
-		memmove( pOutputBuffer + sizeof( lzma_header_t ), pOutputBuffer + sizeof( lzma_header_t ) + 13, compressedSize - 13 );
-
-		// final output size is our header plus compressed bits
-		*pOutputSize = sizeof( lzma_header_t ) + compressedSize - 13;
-
-		return pOutputBuffer;
+		return sizeof( lzma_header_t ) + static_cast<size_t>( flBits / 8 ) + nMatches * MATCH_COST;
 	}
 
-	static inline uint8_t* OpportunisticCompress( uint8_t* pInput, size_t inputSize, size_t* pOutputSize )
+	// Every thread compresses with its own encoders, created for the presets it actually uses
+	static inline CEncoder& ThreadEncoder( Preset preset = Preset::Default )
 	{
-		uint8_t* pRet = Compress( pInput, inputSize, pOutputSize );
-		if ( *pOutputSize >= inputSize )
-		{
-			// compression got worse or stayed the same
-			delete[] pRet;
-			return nullptr;
-		}
-
-		return pRet;
+		static thread_local std::unique_ptr<CEncoder> s_encoders[static_cast<size_t>( Preset::Count )];
+		std::unique_ptr<CEncoder>& pEncoder = s_encoders[static_cast<size_t>( preset )];
+		if ( !pEncoder )
+			pEncoder = std::make_unique<CEncoder>( preset );
+		return *pEncoder;
 	}
 } // namespace LZMA
\ No newline at end of file
@@ -8,6 +8,7 @@
 // vmpi_bareshell.cpp : Defines the entry point for the console application.
 //
 
+#ifdef _WIN32
 #define WIN32_LEAN_AND_MEAN
 #define NOWINRES
 #define NOSERVICE
@@ -19,21 +20,37 @@
 
 #include "DbgHelp.h"
 #include "d3dcompiler.h"
+#else
+#include <csignal>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+#endif
+#include <array>
 #include <atomic>
+#include <bit>
 #include <chrono>
+#include <cmath>
+#include <condition_variable>
 #include <cstdlib>
+#include <deque>
 #include <future>
 #include <filesystem>
+#include <fstream>
+#include <optional>
+#include <random>
 #include <regex>
 #include <set>
 #include <thread>
-#include <immintrin.h>
 #include <inttypes.h>
 
 #include "basetypes.h"
 #include "cfgprocessor.h"
 #include "cmdsink.h"
+#include "compilecache.h"
 #include "d3dxfxc.h"
+#include "defineanalysis.h"
+#include "digest.hpp"
 #include "shader_vcs_version.h"
 #include "utlbuffer.h"
 #include "utlnodehash.h"
@@ -43,7 +60,6 @@
 #include "gsl/narrow"
 #include "robin_hood.h"
 
-#include "CRC32.hpp"
 #include "movingaverage.hpp"
 #include "termcolors.hpp"
 #include "strmanip.hpp"
@@ -61,7 +77,9 @@ extern "C" {
 
 #include "LZMA.hpp"
 
+#ifdef _WIN32
 #pragma comment( lib, "DbgHelp" )
+#endif
 
 // Type conversions should be controlled by programmer explicitly - shadercompile makes use of 64-bit integer arithmetics
 #pragma warning( error : 4244 )
@@ -93,6 +111,14 @@ static Clock::time_point g_flStartTime;
 static bool g_bVerbose	= false;
 static bool g_bVerbose2 = false;
 static bool g_bFastFail = false;
+static bool g_bLockStats = false;
+static LZMA::Preset g_eCompressPreset = LZMA::Preset::Default;
+static bool g_bCompressAuto = false;
+static double g_flCompressMargin = 0.02; // Blocks not expected to shrink by at least this much are stored raw
+
+// Progress of non-skipped commands over all shaders
+static uint64_t g_nCommandsTotal = 0;
+static std::atomic<uint64_t> g_nCommandsDone = 0;
 
 static constexpr const std::string_view lineRewind = "\033[2K"sv;
 static constexpr const std::string_view endLine = "\r"sv;
@@ -114,64 +140,54 @@ static robin_hood::unordered_node_map<std::string_view, ShaderInfo_t> g_ShaderTo
 
 static void Shader_ParseShaderInfoFromCompileCommands( const CfgProcessor::CfgEntryInfo* pEntry, ShaderInfo_t& shaderInfo );
 
-struct CByteCodeBlock : private std::unique_ptr<uint8_t[]>
+// Bump allocator for the bytecode of one static combo, everything is released at once with the arena
+class CByteCodeArena
 {
-	uint64_t m_nComboID;
-	size_t m_nCodeSize;
-
-	CByteCodeBlock( const void* pByteCode, size_t nCodeSize, uint64_t nComboID ) : std::unique_ptr<uint8_t[]>( new uint8_t[nCodeSize] )
+public:
+	[[nodiscard]] uint8_t* Alloc( size_t nSize )
 	{
-		m_nComboID  = nComboID;
-		m_nCodeSize = nCodeSize;
-		memcpy( get(), pByteCode, nCodeSize );
+		if ( m_nBlockLeft < nSize )
+		{
+			// Blocks grow with the static combo, so that small ones don't waste much
+			m_nBlockSize = std::min( m_nBlockSize * 2, MAX_BLOCK_SIZE );
+			const size_t nAllocSize = std::max( nSize, m_nBlockSize );
+			m_arrBlocks.emplace_back( new uint8_t[nAllocSize] );
+			m_pBlockPos  = m_arrBlocks.back().get();
+			m_nBlockLeft = nAllocSize;
+		}
+
+		uint8_t* pResult = m_pBlockPos;
+		m_pBlockPos += nSize;
+		m_nBlockLeft -= nSize;
+		return pResult;
 	}
 
-	using std::unique_ptr<uint8_t[]>::get;
+private:
+	static constexpr size_t MAX_BLOCK_SIZE = 1024 * 1024;
+
+	std::vector<std::unique_ptr<uint8_t[]>> m_arrBlocks;
+	uint8_t* m_pBlockPos = nullptr;
+	size_t m_nBlockLeft  = 0;
+	size_t m_nBlockSize  = 8 * 1024;
 };
 
 struct CStaticCombo // all the data for one static combo
 {
-	struct PackedCode : private std::unique_ptr<uint8_t[]>
+	// Bytecode of one dynamic combo, empty when the combo was skipped or failed to compile
+	struct DynamicCombo
 	{
-		[[nodiscard]] size_t GetLength() const
-		{
-			if ( uint8_t* pb = get() )
-				return *reinterpret_cast<size_t*>( pb );
-			return 0;
-		}
-
-		[[nodiscard]] uint8_t* GetData() const
-		{
-			if ( uint8_t* pb = get() )
-				return pb + sizeof( size_t );
-			return nullptr;
-		}
-
-		[[nodiscard]] uint8_t* AllocData( size_t len )
-		{
-			reset();
-			if ( len )
-			{
-				reset( new uint8_t[len + sizeof( size_t )] );
-				*reinterpret_cast<size_t*>( get() ) = len;
-			}
-			return GetData();
-		}
-
-		using std::unique_ptr<uint8_t[]>::operator bool;
+		const uint8_t* m_pCode = nullptr;
+		uint32_t m_nCodeSize   = 0;
 	};
+
 	CStaticCombo *m_pNext, *m_pPrev;
 private:
 	uint64_t m_nStaticComboID;
 
-	std::vector<std::unique_ptr<CByteCodeBlock>> m_DynamicCombos;
-
-	PackedCode m_abPackedCode; // Packed code for entire static combo
-
-	static bool CompareDynamicComboIDs( const std::unique_ptr<CByteCodeBlock>& pA, const std::unique_ptr<CByteCodeBlock>& pB )
-	{
-		return pA->m_nComboID < pB->m_nComboID;
-	}
+	std::vector<DynamicCombo> m_DynamicCombos; // Indexed by dynamic combo ID
+	CByteCodeArena m_DynamicCode;
+	size_t m_nDynamicCombos;
+	uint64_t m_nDuplicateOf; // Static combo with the same bytecode, this one isn't packed then
 
 public:
 	[[nodiscard]] uint64_t Key() const
@@ -189,48 +205,87 @@ public:
 		return m_pNext;
 	}
 
-	[[nodiscard]] const PackedCode& Code() const
+	[[nodiscard]] const std::vector<DynamicCombo>& DynamicCombos() const
 	{
-		return m_abPackedCode;
+		return m_DynamicCombos;
 	}
 
-	[[nodiscard]] const std::vector<std::unique_ptr<CByteCodeBlock>>& DynamicCombos() const
+	[[nodiscard]] bool HasDynamicCombos() const
 	{
-		return m_DynamicCombos;
+		return m_nDynamicCombos != 0;
+	}
+
+	[[nodiscard]] bool IsDuplicate() const
+	{
+		return m_nDuplicateOf != NO_DUPLICATE;
+	}
+
+	[[nodiscard]] uint64_t DuplicateOf() const
+	{
+		return m_nDuplicateOf;
+	}
+
+	void SetDuplicateOf( uint64_t nStaticComboID )
+	{
+		m_nDuplicateOf = nStaticComboID;
 	}
 
+	// 128-bit hash of the dynamic combos as they get packed, equal for static combos packing to the same bytes, see CStaticComboIndex
+	[[nodiscard]] Digest_t ContentHash() const
+	{
+		Digest_t hash { m_nDynamicCombos, 0 };
+		for ( size_t nComboID = 0; nComboID < m_DynamicCombos.size(); ++nComboID )
+		{
+			const DynamicCombo& combo = m_DynamicCombos[nComboID];
+			if ( !combo.m_pCode )
+				continue;
+			hash = Digest::Mix( Digest::Mix( hash, { nComboID, combo.m_nCodeSize } ), Digest::Bytes( combo.m_pCode, combo.m_nCodeSize ) );
+		}
+		return hash;
+	}
+
+	static constexpr uint64_t NO_DUPLICATE = ~0ULL;
+
 	CStaticCombo( uint64_t nComboID )
 	{
 		m_nStaticComboID = nComboID;
+		m_nDynamicCombos = 0;
+		m_nDuplicateOf = NO_DUPLICATE;
 		m_pNext = nullptr;
 		m_pPrev = nullptr;
 	}
 
 	~CStaticCombo() = default;
 
-	void AddDynamicCombo( uint64_t nComboID, const void* pComboData, size_t nCodeSize )
+	// The slot table is sized for all dynamic combos of the shader when the first one arrives
+	void AddDynamicCombo( uint64_t nComboID, uint64_t nNumDynamicCombos, const void* pComboData, size_t nCodeSize )
 	{
-		m_DynamicCombos.emplace_back( std::make_unique<CByteCodeBlock>( pComboData, nCodeSize, nComboID ) );
-	}
+		if ( m_DynamicCombos.empty() )
+			m_DynamicCombos.resize( gsl::narrow<size_t>( nNumDynamicCombos ) );
 
-	void SortDynamicCombos()
-	{
-		std::sort( m_DynamicCombos.begin(), m_DynamicCombos.end(), CompareDynamicComboIDs );
+		DynamicCombo& combo = m_DynamicCombos[gsl::narrow<size_t>( nComboID )];
+		Assert( !combo.m_pCode );
+
+		uint8_t* pCode = m_DynamicCode.Alloc( nCodeSize );
+		memcpy( pCode, pComboData, nCodeSize );
+		combo.m_pCode     = pCode;
+		combo.m_nCodeSize = gsl::narrow<uint32_t>( nCodeSize );
+		++m_nDynamicCombos;
 	}
 
-	[[nodiscard]] uint8_t* AllocPackedCodeBlock( size_t nPackedCodeSize )
+	// Frees the slot table and the arena in one go, once the static combo is packed
+	void ReleaseDynamicCombos()
 	{
-		return m_abPackedCode.AllocData( nPackedCodeSize );
+		std::vector<DynamicCombo>().swap( m_DynamicCombos );
+		m_DynamicCode    = {};
+		m_nDynamicCombos = 0;
 	}
 };
 
 using StaticComboNodeHash_t = CUtlNodeHash<CStaticCombo, 7097, uint64_t>;
-using CShaderMap = robin_hood::unordered_map<std::string_view, StaticComboNodeHash_t*>;
-static CShaderMap g_ShaderByteCode;
 
-static CStaticCombo* StaticComboFromDictAdd( std::string_view pszShaderName, uint64_t nStaticComboId )
+static CStaticCombo* StaticComboFromDictAdd( StaticComboNodeHash_t*& rpNodeHash, uint64_t nStaticComboId )
 {
-	StaticComboNodeHash_t* &rpNodeHash = g_ShaderByteCode[pszShaderName];
 	if ( !rpNodeHash )
 		rpNodeHash = new StaticComboNodeHash_t;
 
@@ -245,13 +300,6 @@ static CStaticCombo* StaticComboFromDictAdd( std::string_view pszShaderName, uin
 	return pStaticCombo;
 }
 
-static CStaticCombo* StaticComboFromDict( std::string_view pszShaderName, uint64_t nStaticComboId )
-{
-	if ( StaticComboNodeHash_t* pNodeHash = g_ShaderByteCode[pszShaderName] )
-		return pNodeHash->FindByKey( nStaticComboId );
-	return nullptr;
-}
-
 class CompilerMsgInfo
 {
 public:
@@ -317,9 +365,68 @@ private:
 	std::atomic<mtx_type*> m_pUseMtx;
 };
 
+// Wait and hold times of a group of locks, counted with -lockstats only
+struct LockStats_t
+{
+	std::atomic<uint64_t> m_nTaken { 0 };
+	std::atomic<uint64_t> m_nWaited { 0 };	// Nanoseconds spent getting the lock
+	std::atomic<uint64_t> m_nHeld { 0 };	// Nanoseconds the lock was held
+
+	void Report( std::string_view name )
+	{
+		const uint64_t nTaken = std::max<uint64_t>( m_nTaken.exchange( 0 ), 1 );
+		std::cout << "    "sv << name << ": "sv << nTaken << " taken, waited "sv << clr::blue << m_nWaited.exchange( 0 ) / nTaken << clr::reset << " ns and held "sv
+				  << clr::blue << m_nHeld.exchange( 0 ) / nTaken << clr::reset << " ns on average"sv << std::endl;
+	}
+};
+
+static LockStats_t g_GlobalLockStats;
+static LockStats_t g_DispatchLockStats;
+static LockStats_t g_QueueLockStats;
+
+template <LockStats_t& stats>
+class CTimedMutex
+{
+public:
+	void lock()
+	{
+		if ( !g_bLockStats )
+			return m_Mtx.lock();
+
+		const Clock::time_point waitStart = Clock::now();
+		m_Mtx.lock();
+		m_LockedAt = Clock::now();
+		stats.m_nTaken.fetch_add( 1, std::memory_order_relaxed );
+		stats.m_nWaited.fetch_add( duration_cast<chrono::nanoseconds>( m_LockedAt - waitStart ).count(), std::memory_order_relaxed );
+	}
+
+	bool try_lock()
+	{
+		if ( !m_Mtx.try_lock() )
+			return false;
+		if ( g_bLockStats )
+		{
+			m_LockedAt = Clock::now();
+			stats.m_nTaken.fetch_add( 1, std::memory_order_relaxed );
+		}
+		return true;
+	}
+
+	void unlock()
+	{
+		if ( g_bLockStats )
+			stats.m_nHeld.fetch_add( duration_cast<chrono::nanoseconds>( Clock::now() - m_LockedAt ).count(), std::memory_order_relaxed );
+		m_Mtx.unlock();
+	}
+
+private:
+	std::mutex m_Mtx;
+	Clock::time_point m_LockedAt; // Only touched by the owner
+};
+
 namespace Private
 {
-	static std::mutex g_mtxSyncObjMT;
+	static CTimedMutex<g_GlobalLockStats> g_mtxSyncObjMT;
 	static std::mutex g_mtxSyncObjMT2;
 }; // namespace Private
 
@@ -404,14 +511,168 @@ static bool CompareDupComboIndices( const StaticComboAliasRecord_t& pA, const St
 	return pA.m_nStaticComboID < pB.m_nStaticComboID;
 }
 
-static void FlushCombos( size_t& pnTotalFlushedSize, CUtlBuffer& pDynamicComboBuffer, CUtlBuffer& pBuf )
+// Compresses the blocks of one shader. In auto mode the first blocks are compressed with every preset, the one
+// with the best ratio per CPU second is used for the rest of the shader. CPU cost comes from fixed per preset
+// weights instead of the clock, so the choice only depends on the sampled blocks and never on machine load.
+class CShaderCompressor
+{
+public:
+	static constexpr uint32_t AUTO_SAMPLE_BLOCKS = 4;
+	static constexpr size_t NUM_PRESETS = static_cast<size_t>( LZMA::Preset::Count );
+
+	// Relative encode time per input byte, measured on shader bytecode. Default is slower than max because
+	// its 16MB dictionary is set up again for every block.
+	static constexpr double s_flPresetCost[NUM_PRESETS] = { 1.0, 4.0, 3.5 };
+
+	// Returns nullptr when the block doesn't get smaller, the buffer is reused by the next block on the same thread
+	const uint8_t* Compress( const uint8_t* pInput, size_t nInputSize, size_t* pOutputSize )
+	{
+		m_nBlocks.fetch_add( 1, std::memory_order_relaxed );
+		if ( LZMA::EstimateCompressedSize( pInput, nInputSize ) >= nInputSize * ( 1.0 - g_flCompressMargin ) )
+		{
+			// LZMA isn't going to win, don't bother running it
+			m_nSkipped.fetch_add( 1, std::memory_order_relaxed );
+			*pOutputSize = 0;
+			return nullptr;
+		}
+
+		if ( !g_bCompressAuto )
+			return CompressWith( g_eCompressPreset, pInput, nInputSize, pOutputSize );
+
+		if ( const int iPreset = m_iPreset.load( std::memory_order_acquire ); iPreset >= 0 )
+			return CompressWith( static_cast<LZMA::Preset>( iPreset ), pInput, nInputSize, pOutputSize );
+
+		// Sample every preset, every one has its own buffer so the smallest output stays valid
+		uint64_t arrSampled[NUM_PRESETS];
+		const uint8_t* pBest = nullptr;
+		size_t nBestSize     = 0;
+		for ( size_t i = 0; i < NUM_PRESETS; ++i )
+		{
+			size_t nOutputSize;
+			const uint8_t* pOutput = CompressWith( static_cast<LZMA::Preset>( i ), pInput, nInputSize, &nOutputSize );
+			arrSampled[i] = pOutput ? nOutputSize : nInputSize;
+			if ( pOutput && ( !pBest || nOutputSize < nBestSize ) )
+			{
+				pBest     = pOutput;
+				nBestSize = nOutputSize;
+			}
+		}
+
+		std::lock_guard guard{ m_Mutex };
+		for ( size_t i = 0; i < NUM_PRESETS; ++i )
+			m_arrSampled[i] += arrSampled[i];
+		if ( ++m_nSampled >= AUTO_SAMPLE_BLOCKS && m_iPreset.load( std::memory_order_relaxed ) < 0 )
+		{
+			// Same input for all of them, so the best ratio per second has the smallest output times cost
+			size_t iBest = 0;
+			for ( size_t i = 1; i < NUM_PRESETS; ++i )
+			{
+				if ( m_arrSampled[i] * s_flPresetCost[i] < m_arrSampled[iBest] * s_flPresetCost[iBest] )
+					iBest = i;
+			}
+			m_iPreset.store( static_cast<int>( iBest ), std::memory_order_release );
+		}
+
+		*pOutputSize = nBestSize;
+		return pBest;
+	}
+
+	uint64_t GetBlockCount() const noexcept { return m_nBlocks.load( std::memory_order_relaxed ); }
+	uint64_t GetSkippedCount() const noexcept { return m_nSkipped.load( std::memory_order_relaxed ); }
+
+	void Report( std::string_view szShaderName ) const
+	{
+		std::lock_guard guard{ m_Mutex };
+		if ( !GetBlockCount() )
+			return;
+
+		static constexpr std::string_view s_szPresets[NUM_PRESETS] = { "fast"sv, "default"sv, "max"sv };
+		const int iPreset = g_bCompressAuto ? m_iPreset.load( std::memory_order_relaxed ) : static_cast<int>( g_eCompressPreset );
+		std::cout << clr::green << szShaderName << clr::reset << ": "sv << ( iPreset >= 0 ? s_szPresets[iPreset] : "sampled"sv ) << ", ratio "sv << clr::blue
+				  << static_cast<double>( m_total.m_nInput ) / static_cast<double>( std::max<uint64_t>( m_total.m_nOutput, 1 ) ) << clr::reset << ", "sv
+				  << m_total.m_nTime / 1000000 << " ms, skipped "sv << GetSkippedCount() << " of "sv << GetBlockCount() << " blocks"sv << std::endl;
+	}
+
+private:
+	struct Stats
+	{
+		uint64_t m_nInput  = 0;
+		uint64_t m_nOutput = 0;
+		uint64_t m_nTime   = 0; // nanoseconds spent compressing, only reported
+
+		Stats& operator+=( const Stats& other ) noexcept
+		{
+			m_nInput += other.m_nInput;
+			m_nOutput += other.m_nOutput;
+			m_nTime += other.m_nTime;
+			return *this;
+		}
+	};
+
+	const uint8_t* CompressWith( LZMA::Preset preset, const uint8_t* pInput, size_t nInputSize, size_t* pOutputSize )
+	{
+		const Clock::time_point start = Clock::now();
+		const uint8_t* pOutput = LZMA::ThreadEncoder( preset ).OpportunisticCompress( pInput, nInputSize, pOutputSize );
+		const Stats stats { nInputSize, pOutput ? *pOutputSize : nInputSize, static_cast<uint64_t>( duration_cast<chrono::nanoseconds>( Clock::now() - start ).count() ) };
+
+		std::lock_guard guard{ m_Mutex };
+		m_total += stats;
+		return pOutput;
+	}
+
+	mutable std::mutex	m_Mutex;
+	std::atomic<int>	m_iPreset = -1;		// Picked in auto mode once enough blocks are sampled
+	uint32_t			m_nSampled = 0;
+	uint64_t			m_arrSampled[NUM_PRESETS] = {};	// Output bytes of the sampled blocks with every preset
+	Stats				m_total;
+	std::atomic<uint64_t>	m_nBlocks = 0;
+	std::atomic<uint64_t>	m_nSkipped = 0;	// Blocks stored raw without trying LZMA
+};
+
+// Static combos of one shader by content hash, duplicates are found before anything gets compressed. The hash is
+// 128 bits wide like the compile cache keys, so a hit is taken as equal bytes without keeping them around.
+class CStaticComboIndex
+{
+public:
+	// Returns the static combo first seen with the same content, or the combo itself when it is new
+	uint64_t FindOrAdd( const CStaticCombo& combo )
+	{
+		const Digest_t hash = combo.ContentHash();
+
+		std::lock_guard guard{ m_Mutex };
+		const auto [it, bInserted] = m_Combos.emplace( hash, combo.ComboId() );
+		if ( !bInserted )
+			++m_nDuplicates;
+		return it->second;
+	}
+
+	uint64_t GetDuplicateCount() const
+	{
+		std::lock_guard guard{ m_Mutex };
+		return m_nDuplicates;
+	}
+
+	// Drops the hashes once the shader is packed, the duplicate count stays
+	void Release()
+	{
+		std::lock_guard guard{ m_Mutex };
+		decltype( m_Combos )().swap( m_Combos );
+	}
+
+private:
+	mutable std::mutex m_Mutex;
+	robin_hood::unordered_flat_map<Digest_t, uint64_t, Digest::Hasher> m_Combos;
+	uint64_t m_nDuplicates = 0;
+};
+
+static void FlushCombos( size_t& pnTotalFlushedSize, CUtlBuffer& pDynamicComboBuffer, CUtlBuffer& pBuf, CShaderCompressor& compressor )
 {
 	if ( !pDynamicComboBuffer.TellPut() )
 		// Nothing to do here
 		return;
 
 	size_t nCompressedSize;
-	uint8_t* pCompressedShader = LZMA::OpportunisticCompress( reinterpret_cast<uint8_t*>( pDynamicComboBuffer.Base() ), pDynamicComboBuffer.TellPut(), &nCompressedSize );
+	const uint8_t* pCompressedShader = compressor.Compress( reinterpret_cast<const uint8_t*>( pDynamicComboBuffer.Base() ), pDynamicComboBuffer.TellPut(), &nCompressedSize );
 	// high 2 bits of length =
 	// 00 = bzip2 compressed
 	// 10 = uncompressed
@@ -431,16 +692,15 @@ static void FlushCombos( size_t& pnTotalFlushedSize, CUtlBuffer& pDynamicComboBu
 		const uint32_t lFlagSize = 0x40000000 | gsl::narrow<uint32_t>( nCompressedSize );
 		pBuf.Put( &lFlagSize, sizeof( lFlagSize ) );
 		pBuf.Put( pCompressedShader, gsl::narrow<uint32_t>( nCompressedSize ) );
-		delete[] pCompressedShader;
 		pnTotalFlushedSize += sizeof( lFlagSize ) + nCompressedSize;
 	}
 	pDynamicComboBuffer.Clear(); // start over
 }
 
-static void OutputDynamicCombo( size_t& pnTotalFlushedSize, CUtlBuffer& pDynamicComboBuffer, CUtlBuffer& pBuf, uint64_t nComboID, uint32_t nComboSize, const uint8_t* pComboCode )
+static void OutputDynamicCombo( size_t& pnTotalFlushedSize, CUtlBuffer& pDynamicComboBuffer, CUtlBuffer& pBuf, CShaderCompressor& compressor, uint64_t nComboID, uint32_t nComboSize, const uint8_t* pComboCode )
 {
 	if ( pDynamicComboBuffer.TellPut() + nComboSize + 16 >= MAX_SHADER_UNPACKED_BLOCK_SIZE )
-		FlushCombos( pnTotalFlushedSize, pDynamicComboBuffer, pBuf );
+		FlushCombos( pnTotalFlushedSize, pDynamicComboBuffer, pBuf, compressor );
 
 	pDynamicComboBuffer.PutUnsignedInt( gsl::narrow<uint32_t>( nComboID ) );
 	pDynamicComboBuffer.PutUnsignedInt( nComboSize );
@@ -488,143 +748,158 @@ static fs::path GetVCSFilenames( const ShaderInfo_t& si )
 	return path;
 }
 
-// WriteShaderFiles
-//
-// should be called either on the main thread or
-// on the async writing thread.
-//
-// So the function WriteShaderFiles should not be reentrant, however the
-// data that it uses might be updated by the main thread when built pieces
-// are received from the workers.
-//
-static constexpr uint32_t STATIC_COMBO_HASH_SIZE = 73;
-
-struct StaticComboAuxInfo_t : StaticComboRecord_t
-{
-	uint32_t m_nCRC32; // CRC32 of packed data
-	CStaticCombo* m_pByteCode;
-};
-
-static bool CompareComboIds( const StaticComboAuxInfo_t& pA, const StaticComboAuxInfo_t& pB ) noexcept
+// Streams the packed static combos of one shader to "<name>.vcs.part" in the order they finish, only where each
+// of them went is kept in memory. The engine sizes a static combo by the offset of the next one, so they are copied
+// over to the vcs file in dictionary order once the shader is done. Combos are compiled from the last one down,
+// so they practically never arrive in that order.
+class CVcsWriter
 {
-	return pA.m_nStaticComboID < pB.m_nStaticComboID;
-}
+public:
+	explicit CVcsWriter( fs::path path )
+		: m_Path( std::move( path ) )
+	{
+		m_PartPath = m_Path;
+		m_PartPath += ".part"sv;
+		m_File.open( m_PartPath, std::ios::binary | std::ios::in | std::ios::out | std::ios::trunc );
+	}
 
-static void WriteShaderFiles( std::string_view pShaderName )
-{
-	if ( !g_ShaderWrittenToDisk.emplace( pShaderName ).second )
-		return;
+	~CVcsWriter()
+	{
+		// Never finalized, the shader failed or the build got stopped
+		if ( m_File.is_open() )
+		{
+			m_File.close();
+			std::error_code c;
+			fs::remove( m_PartPath, c );
+		}
+	}
 
-	const bool bShaderFailed                = g_ShaderHadError.contains( pShaderName );
-	const char* const szShaderFileOperation = bShaderFailed ? "Removing failed" : "Writing";
+	CVcsWriter( const CVcsWriter& ) = delete;
+	CVcsWriter& operator=( const CVcsWriter& ) = delete;
 
-	static Clock::time_point lastTime = g_flStartTime;
+	// Called by the zip threads
+	void AddStaticCombo( uint64_t nStaticComboID, const void* pCode, size_t nCodeSize )
+	{
+		constexpr uint32_t endMark = 0xffffffff; // end of dynamic combos
+		const uint64_t nHash = robin_hood::hash_bytes( pCode, nCodeSize );
 
-	//
-	// Progress indication
-	//
-	std::cout << "\r"sv << clr::escaped( lineRewind ) << szShaderFileOperation << " "sv << (bShaderFailed ? clr::red : clr::green) << pShaderName << clr::reset << "..."sv << endLine;
+		std::lock_guard guard{ m_Mutex };
+		m_File.write( static_cast<const char*>( pCode ), nCodeSize );
+		m_File.write( reinterpret_cast<const char*>( &endMark ), sizeof( endMark ) );
+		if ( !m_File )
+		{
+			// The offsets of everything after it would be off, the shader can't be written anymore
+			m_bFailed = true;
+			return;
+		}
+		m_Combos.emplace_back( PackedCombo { nStaticComboID, m_nDataEnd, nCodeSize + sizeof( endMark ), nHash } );
+		m_nDataEnd += nCodeSize + sizeof( endMark );
+	}
 
-	//
-	// Retrieve the data we are going to operate on
-	// from global variables under lock.
-	//
-	StaticComboNodeHash_t* pByteCodeArray;
-	ShaderInfo_t shaderInfo;
+	void AddDuplicate( uint64_t nStaticComboID, uint64_t nDuplicateOf )
 	{
-		std::lock_guard guard{ Threading::g_mtxGlobal };
-		StaticComboNodeHash_t*& rp	= g_ShaderByteCode[pShaderName]; // Get a static combo pointer, reset it as well
-		pByteCodeArray				= rp;
-		rp							= nullptr;
-		shaderInfo					= g_ShaderToShaderInfo[pShaderName];
+		std::lock_guard guard{ m_Mutex };
+		m_Duplicates.emplace_back( StaticComboAliasRecord_t { gsl::narrow<uint32_t>( nStaticComboID ), gsl::narrow<uint32_t>( nDuplicateOf ) } );
 	}
 
-	if ( shaderInfo.m_pShaderName.empty() )
-		return;
+	// Returns false when the part file couldn't be written or read back, no vcs file is left behind then
+	[[nodiscard]] bool Finalize( const ShaderInfo_t& shaderInfo );
 
-	//
-	// Shader vcs file name
-	//
-	auto path = GetVCSFilenames( shaderInfo );
+private:
+	struct PackedCombo
+	{
+		uint64_t m_nStaticComboID;
+		uint64_t m_nOffset; // in the part file
+		uint64_t m_nSize;   // includes the end mark
+		uint64_t m_nHash;   // 64-bit hash of packed data
+	};
 
-	if ( bShaderFailed )
+	bool ReadCombo( const PackedCombo& combo, std::vector<char>& buf )
 	{
-		std::error_code c;
-		fs::remove( path, c );
-		std::cout << "\r"sv << clr::escaped( lineRewind ) << clr::red << pShaderName << clr::reset << " "sv << FormatTimeShort( duration_cast<chrono::seconds>( Clock::now() - lastTime ).count() ) << std::endl;
-		lastTime = Clock::now();
-		return;
+		buf.resize( gsl::narrow<size_t>( combo.m_nSize ) );
+		m_File.seekg( combo.m_nOffset );
+		return !!m_File.read( buf.data(), buf.size() );
 	}
 
-	if ( !pByteCodeArray )
-		return;
-
-	if ( g_bVerbose )
-		std::cout << "\r"sv << std::showbase << pShaderName << ": "sv << clr::green << shaderInfo.m_nTotalShaderCombos << clr::reset << " combos, centroid mask: "sv << clr::green << std::hex << shaderInfo.m_CentroidMask << std::dec << clr::reset << ", numDynamicCombos: "sv << clr::green << shaderInfo.m_nDynamicCombos << clr::reset << std::endl;
+	std::mutex m_Mutex;
+	fs::path m_Path;
+	fs::path m_PartPath;
+	std::fstream m_File;
+	uint64_t m_nDataEnd = 0;
+	std::vector<PackedCombo> m_Combos;
+	std::vector<StaticComboAliasRecord_t> m_Duplicates;
+	bool m_bFailed = false;
+};
 
-	//
-	// Static combo headers
-	//
-	std::vector<StaticComboAuxInfo_t> StaticComboHeaders;
+bool CVcsWriter::Finalize( const ShaderInfo_t& shaderInfo )
+{
+	std::lock_guard guard{ m_Mutex };
+	if ( !m_File.is_open() || m_bFailed )
+		return false;
 
-	StaticComboHeaders.reserve( 1ULL + pByteCodeArray->Count() ); // we know how much ram we need
+	// Duplicates found while packing point at whichever copy got zipped first, the lowest ID of every group keeps the code
+	// so the file doesn't depend on the order combos finished in
+	robin_hood::unordered_flat_map<uint32_t, uint32_t> keptComboIds; // zipped static combo -> lowest ID of its duplicates
+	for ( const StaticComboAliasRecord_t& dup : m_Duplicates )
+	{
+		uint32_t& nKept = keptComboIds.try_emplace( dup.m_nSourceStaticCombo, dup.m_nSourceStaticCombo ).first->second;
+		nKept = std::min( nKept, dup.m_nStaticComboID );
+	}
+	for ( StaticComboAliasRecord_t& dup : m_Duplicates )
+	{
+		const uint32_t nKept = keptComboIds[dup.m_nSourceStaticCombo];
+		dup = StaticComboAliasRecord_t { dup.m_nStaticComboID == nKept ? dup.m_nSourceStaticCombo : dup.m_nStaticComboID, nKept };
+	}
+	for ( PackedCombo& combo : m_Combos )
+	{
+		if ( const auto it = keptComboIds.find( gsl::narrow<uint32_t>( combo.m_nStaticComboID ) ); it != keptComboIds.end() )
+			combo.m_nStaticComboID = it->second;
+	}
 
-	std::vector<size_t> comboIndicesHashedByCRC32[STATIC_COMBO_HASH_SIZE];
-	std::vector<StaticComboAliasRecord_t> duplicateCombos;
+	// now, sort, duplicates of packed data keep the lowest ID too
+	std::sort( m_Combos.begin(), m_Combos.end(), []( const PackedCombo& a, const PackedCombo& b ) noexcept { return a.m_nStaticComboID < b.m_nStaticComboID; } );
 
-	// now, lets fill in our combo headers, sort, and write
-	for ( int nChain = 0; nChain < StaticComboNodeHash_t::NumChains; ++nChain )
+	// see if we have an identical static combo, only an exact hash hit needs a full compare
+	robin_hood::unordered_flat_map<uint64_t, size_t> comboIndicesByHash; // first combo with the packed data of this hash
+	comboIndicesByHash.reserve( m_Combos.size() );
+	std::vector<char> buf, checkBuf;
+	size_t nUnique = 0;
+	for ( const PackedCombo& combo : m_Combos )
 	{
-		for ( CStaticCombo* pStatic = pByteCodeArray->Chain( nChain ).Head(); pStatic; pStatic = pStatic->Next() )
+		const auto [it, bAdded] = comboIndicesByHash.try_emplace( combo.m_nHash, nUnique );
+		if ( !bAdded )
 		{
-			const CStaticCombo::PackedCode& code = pStatic->Code();
-			if ( code.GetLength() )
+			const PackedCombo& check = m_Combos[it->second];
+			if ( check.m_nSize == combo.m_nSize && ReadCombo( check, checkBuf ) && ReadCombo( combo, buf ) && buf == checkBuf )
 			{
-				StaticComboAuxInfo_t hdr {
-					{
-						.m_nStaticComboID = gsl::narrow<uint32_t>( pStatic->ComboId() ),
-						.m_nFileOffset = 0,
-					},
-					CRC32::ProcessSingleBuffer( code.GetData(), code.GetLength() ),
-					pStatic
-				};
-				const uint32_t nHashIdx = hdr.m_nCRC32 % STATIC_COMBO_HASH_SIZE;
-				__assume( 0 <= nHashIdx && nHashIdx < STATIC_COMBO_HASH_SIZE );
-
-				// now, see if we have an identical static combo
-				auto& hash = comboIndicesHashedByCRC32[nHashIdx];
-				bool bIsDuplicate = false;
-				for ( const size_t i : hash )
-				{
-					const StaticComboAuxInfo_t& check = StaticComboHeaders[i];
-					const CStaticCombo::PackedCode& checkCode = check.m_pByteCode->Code();
-					if ( check.m_nCRC32 == hdr.m_nCRC32 && checkCode.GetLength() == code.GetLength() && memcmp( checkCode.GetData(), code.GetData(), checkCode.GetLength() ) == 0 )
-					{
-						// this static combo is the same as another one!!
-						duplicateCombos.emplace_back( StaticComboAliasRecord_t { hdr.m_nStaticComboID, check.m_nStaticComboID } );
-						bIsDuplicate = true;
-						break;
-					}
-				}
-
-				if ( !bIsDuplicate )
-				{
-					StaticComboHeaders.emplace_back( std::move( hdr ) );
-					hash.emplace_back( StaticComboHeaders.size() - 1 );
-				}
+				// this static combo is the same as another one!!
+				m_Duplicates.emplace_back( StaticComboAliasRecord_t { gsl::narrow<uint32_t>( combo.m_nStaticComboID ), gsl::narrow<uint32_t>( check.m_nStaticComboID ) } );
+				continue;
 			}
+			// a real collision, keep the combo as is and let the first one stay indexed
 		}
+		m_Combos[nUnique++] = combo;
 	}
-	// add sentinel key
-	StaticComboHeaders.emplace_back( StaticComboAuxInfo_t { { 0xffffffff, 0 }, 0, nullptr } );
+	m_Combos.resize( nUnique );
 
-	// now, sort. sentinel key will end up at end
-	std::sort( StaticComboHeaders.begin(), StaticComboHeaders.end(), CompareComboIds );
+	// sort duplicate combo records for binary search
+	std::sort( m_Duplicates.begin(), m_Duplicates.end(), CompareDupComboIndices );
 
-	//
-	// Shader file stream buffer
-	//
-	std::ofstream ShaderFile( path, std::ios::binary | std::ios::trunc ); // Streaming buffer for vcs file (since this can blow memory)
+	// Static combo dictionary, sentinel key marks the end of the last one
+	std::vector<StaticComboRecord_t> dictionary;
+	dictionary.reserve( m_Combos.size() + 1 );
+	uint64_t nOffset = sizeof( ShaderHeader_t ) + sizeof( StaticComboRecord_t ) * ( m_Combos.size() + 1 ) + sizeof( uint32_t ) + sizeof( StaticComboAliasRecord_t ) * m_Duplicates.size();
+	for ( const PackedCombo& combo : m_Combos )
+	{
+		dictionary.emplace_back( StaticComboRecord_t { gsl::narrow<uint32_t>( combo.m_nStaticComboID ), gsl::narrow<uint32_t>( nOffset ) } );
+		nOffset += combo.m_nSize;
+	}
+	dictionary.emplace_back( StaticComboRecord_t { 0xffffffff, gsl::narrow<uint32_t>( nOffset ) } );
+
+	// Written next to the vcs file and renamed over it once complete
+	fs::path tmpPath = m_Path;
+	tmpPath += ".tmp"sv;
+	std::ofstream ShaderFile( tmpPath, std::ios::binary | std::ios::trunc );
 
 	// ------ Header --------------
 	const ShaderHeader_t header {
@@ -633,121 +908,198 @@ static void WriteShaderFiles( std::string_view pShaderName )
 		gsl::narrow<int32_t>( shaderInfo.m_nDynamicCombos ),          // this is used
 		0,
 		shaderInfo.m_CentroidMask,
-		gsl::narrow<uint32_t>( StaticComboHeaders.size() ),
+		gsl::narrow<uint32_t>( dictionary.size() ),
 		shaderInfo.m_Crc32
 	};
 	ShaderFile.write( reinterpret_cast<const char*>( &header ), sizeof( header ) );
+	ShaderFile.write( reinterpret_cast<const char*>( dictionary.data() ), sizeof( StaticComboRecord_t ) * dictionary.size() );
 
-	// static combo dictionary
-	const auto nDictionaryOffset = ShaderFile.tellp();
+	const uint32_t dupl = gsl::narrow<uint32_t>( m_Duplicates.size() );
+	ShaderFile.write( reinterpret_cast<const char*>( &dupl ), sizeof( dupl ) );
+	ShaderFile.write( reinterpret_cast<const char*>( m_Duplicates.data() ), sizeof( StaticComboAliasRecord_t ) * m_Duplicates.size() );
 
-	// we will re write this one we know the offsets
-	ShaderFile.write( reinterpret_cast<const char*>( StaticComboHeaders.data() ), sizeof( StaticComboRecord_t ) * StaticComboHeaders.size() ); // dummy write, 8 bytes per static combo
+	// now, copy over all static combos, one at a time, the dictionary counts every one of them
+	bool bSucceeded = !!ShaderFile;
+	for ( const PackedCombo& combo : m_Combos )
+	{
+		if ( !bSucceeded || !ReadCombo( combo, buf ) || !ShaderFile.write( buf.data(), buf.size() ) )
+		{
+			bSucceeded = false;
+			break;
+		}
+	}
+	ShaderFile.close();
+	bSucceeded &= !ShaderFile.fail();
 
-	const uint32_t dupl = gsl::narrow<uint32_t>( duplicateCombos.size() );
-	ShaderFile.write( reinterpret_cast<const char*>( &dupl ), sizeof( dupl ) );
+	m_File.close();
+	std::error_code c;
+	fs::remove( m_PartPath, c );
+	if ( bSucceeded )
+		fs::rename( tmpPath, m_Path, c );
+	if ( !bSucceeded || c )
+	{
+		fs::remove( tmpPath, c );
+		return false;
+	}
+	return true;
+}
 
-	// now, write out all duplicate header records
-	// sort duplicate combo records for binary search
-	std::sort( duplicateCombos.begin(), duplicateCombos.end(), CompareDupComboIndices );
+using CShaderMap = robin_hood::unordered_map<std::string_view, std::unique_ptr<CVcsWriter>>;
+static CShaderMap g_ShaderWriters;
 
-	ShaderFile.write( reinterpret_cast<const char*>( duplicateCombos.data() ), sizeof( StaticComboAliasRecord_t ) * duplicateCombos.size() );
+// Starts the file of a shader with its first packed static combo
+static std::unique_ptr<CVcsWriter> OpenShaderFile( std::string_view pShaderName )
+{
+	ShaderInfo_t shaderInfo;
+	{
+		std::lock_guard guard{ Threading::g_mtxGlobal };
+		const auto it = g_ShaderToShaderInfo.find( pShaderName );
+		if ( it == g_ShaderToShaderInfo.end() || it->second.m_pShaderName.empty() )
+			return nullptr;
+		shaderInfo = it->second;
+	}
 
-	// now, write out all static combos
-	for ( StaticComboRecord_t& SRec : StaticComboHeaders )
+	return std::make_unique<CVcsWriter>( GetVCSFilenames( shaderInfo ) );
+}
+
+// WriteShaderFiles
+//
+// should be called either on the main thread or
+// on the async writing thread.
+//
+// So the function WriteShaderFiles should not be reentrant, however the
+// data that it uses might be updated by the main thread when built pieces
+// are received from the workers.
+//
+static void WriteShaderFiles( std::string_view pShaderName )
+{
+	if ( !g_ShaderWrittenToDisk.emplace( pShaderName ).second )
+		return;
+
+	static Clock::time_point lastTime = g_flStartTime;
+
+	//
+	// Retrieve the data we are going to operate on
+	// from global variables under lock, workers keep compiling other shaders meanwhile.
+	//
+	std::unique_ptr<CVcsWriter> pWriter;
+	ShaderInfo_t shaderInfo;
+	bool bShaderFailed;
 	{
-		SRec.m_nFileOffset = gsl::narrow<uint32_t>( ShaderFile.tellp() );
-		if ( SRec.m_nStaticComboID != 0xffffffff ) // sentinel key?
+		std::lock_guard guard{ Threading::g_mtxGlobal };
+		if ( const auto it = g_ShaderWriters.find( pShaderName ); it != g_ShaderWriters.end() )
 		{
-			CStaticCombo* pStatic = pByteCodeArray->FindByKey( SRec.m_nStaticComboID );
-			Assert( pStatic );
+			pWriter = std::move( it->second );
+			g_ShaderWriters.erase( it );
+		}
+		shaderInfo					= g_ShaderToShaderInfo[pShaderName];
+		bShaderFailed				= g_ShaderHadError.contains( pShaderName );
 
-			// Put the packed chunk of code for this static combo
-			if ( const auto& code = pStatic->Code() )
-				ShaderFile.write( reinterpret_cast<const char*>( code.GetData() ), code.GetLength() );
+		//
+		// Progress indication
+		//
+		const char* const szShaderFileOperation = bShaderFailed ? "Removing failed" : "Writing";
+		std::cout << "\r"sv << clr::escaped( lineRewind ) << szShaderFileOperation << " "sv << (bShaderFailed ? clr::red : clr::green) << pShaderName << clr::reset << "..."sv << endLine;
+	}
 
-			constexpr uint32_t endMark = 0xffffffff; // end of dynamic combos
-			ShaderFile.write( reinterpret_cast<const char*>( &endMark ), sizeof( endMark ) );
+	if ( shaderInfo.m_pShaderName.empty() )
+		return;
+
+	if ( bShaderFailed )
+	{
+		// Drops the part file as well
+		pWriter.reset();
+
+		std::error_code c;
+		fs::remove( GetVCSFilenames( shaderInfo ), c );
+		{
+			std::lock_guard guard{ Threading::g_mtxGlobal };
+			std::cout << "\r"sv << clr::escaped( lineRewind ) << clr::red << pShaderName << clr::reset << " "sv << FormatTimeShort( duration_cast<chrono::seconds>( Clock::now() - lastTime ).count() ) << std::endl;
 		}
+		lastTime = Clock::now();
+		return;
 	}
 
-	//
-	// Re-writing the combo header
-	//
-	ShaderFile.seekp( nDictionaryOffset, std::ios::beg );
+	if ( !pWriter )
+		return;
 
-	// now, rewrite header. data is already byte-swapped appropriately
-	for ( const StaticComboRecord_t& SRec : StaticComboHeaders )
-		ShaderFile.write( reinterpret_cast<const char*>( &SRec ), sizeof( StaticComboRecord_t ) );
+	if ( g_bVerbose )
+		std::cout << "\r"sv << std::showbase << pShaderName << ": "sv << clr::green << shaderInfo.m_nTotalShaderCombos << clr::reset << " combos, centroid mask: "sv << clr::green << std::hex << shaderInfo.m_CentroidMask << std::dec << clr::reset << ", numDynamicCombos: "sv << clr::green << shaderInfo.m_nDynamicCombos << clr::reset << std::endl;
 
-	ShaderFile.close();
+	const Clock::time_point finalizeStart = Clock::now();
+	if ( !pWriter->Finalize( shaderInfo ) )
+	{
+		pWriter.reset();
 
-	// Finalize, free memory
-	delete pByteCodeArray;
+		// A stale file from an earlier build mustn't pass for this one
+		std::error_code c;
+		fs::remove( GetVCSFilenames( shaderInfo ), c );
+		{
+			std::lock_guard guard{ Threading::g_mtxGlobal };
+			g_ShaderHadError.emplace( pShaderName );
+			std::cout << "\r"sv << clr::escaped( lineRewind ) << clr::red << "Failed to write "sv << pShaderName << clr::reset << std::endl;
+		}
+		lastTime = Clock::now();
+		return;
+	}
+	pWriter.reset();
+	const uint64_t nFinalizeMs = duration_cast<chrono::milliseconds>( Clock::now() - finalizeStart ).count();
 
-	std::cout << "\r"sv << clr::escaped( lineRewind ) << clr::green << pShaderName << clr::reset << " "sv << FormatTimeShort( duration_cast<chrono::seconds>( Clock::now() - lastTime ).count() ) << std::endl;
+	{
+		std::lock_guard guard{ Threading::g_mtxGlobal };
+		if ( g_bVerbose )
+			std::cout << "\r"sv << clr::escaped( lineRewind ) << pShaderName << ": vcs file finalized in "sv << clr::blue << nFinalizeMs << clr::reset << " ms"sv << std::endl;
+		std::cout << "\r"sv << clr::escaped( lineRewind ) << clr::green << pShaderName << clr::reset << " "sv << FormatTimeShort( duration_cast<chrono::seconds>( Clock::now() - lastTime ).count() ) << std::endl;
+	}
 	lastTime = Clock::now();
 }
 
 // Assemble a reply package to the master from the compiled bytecode
 // return the length of the package.
-static size_t AssembleWorkerReplyPackage( const CfgProcessor::CfgEntryInfo* pEntry, uint64_t nComboOfEntry, CUtlBuffer& pBuf )
+static size_t AssembleWorkerReplyPackage( const CfgProcessor::CfgEntryInfo* pEntry, CStaticCombo* pStComboRec, CStaticComboIndex& index, CShaderCompressor& compressor, CUtlBuffer& pBuf )
 {
-	CStaticCombo* pStComboRec;
-	StaticComboNodeHash_t* pByteCodeArray;
+	size_t nBytesWritten = 0;
+
+	// Duplicates only remember the static combo they alias, the bytecode gets packed once
+	if ( pStComboRec && pStComboRec->HasDynamicCombos() )
 	{
-		std::lock_guard guard{ Threading::g_mtxGlobal };
-		pStComboRec    = StaticComboFromDict( pEntry->m_szName, nComboOfEntry );
-		pByteCodeArray = g_ShaderByteCode[pEntry->m_szName];
+		if ( const uint64_t nFirst = index.FindOrAdd( *pStComboRec ); nFirst != pStComboRec->ComboId() )
+			pStComboRec->SetDuplicateOf( nFirst );
 	}
 
-	size_t nBytesWritten = 0;
-
-	if ( pStComboRec && !pStComboRec->DynamicCombos().empty() )
+	if ( pStComboRec && pStComboRec->HasDynamicCombos() && !pStComboRec->IsDuplicate() )
 	{
 		CUtlBuffer ubDynamicComboBuffer;
 
-		pStComboRec->SortDynamicCombos();
-		// iterate over all dynamic combos.
-		for ( const auto& combo : pStComboRec->DynamicCombos() )
+		// iterate over all dynamic combos, slots are already in combo ID order
+		const std::vector<CStaticCombo::DynamicCombo>& arrDynamicCombos = pStComboRec->DynamicCombos();
+		for ( size_t nComboID = 0; nComboID < arrDynamicCombos.size(); ++nComboID )
 		{
-			CByteCodeBlock* pCode = combo.get();
-			// check if we have already output an identical combo
-			OutputDynamicCombo( nBytesWritten, ubDynamicComboBuffer, pBuf, pCode->m_nComboID,
-								gsl::narrow<uint32_t>( pCode->m_nCodeSize ), pCode->get() );
+			const CStaticCombo::DynamicCombo& combo = arrDynamicCombos[nComboID];
+			if ( combo.m_pCode )
+				OutputDynamicCombo( nBytesWritten, ubDynamicComboBuffer, pBuf, compressor, nComboID, combo.m_nCodeSize, combo.m_pCode );
 		}
-		FlushCombos( nBytesWritten, ubDynamicComboBuffer, pBuf );
+		FlushCombos( nBytesWritten, ubDynamicComboBuffer, pBuf, compressor );
 	}
 
 	// Time to limit amount of prints
 	static Clock::time_point s_fLastInfoTime;
-	static uint64_t s_nLastEntry = nComboOfEntry;
+	static uint64_t s_nLastDone = 0;
 	static CUtlMovingAverage<uint64_t, 60> s_averageProcess;
-	static std::string_view s_lastShader = pEntry->m_szName;
 	const Clock::time_point fCurTime = Clock::now();
 
 	{
 		std::lock_guard guard{ Threading::g_mtxGlobal };
-		if ( pStComboRec )
-		{
-			CStaticCombo *pCombo = pByteCodeArray->FindByKey( nComboOfEntry );
-			pByteCodeArray->DeleteByKey( nComboOfEntry );
-			delete pCombo;
-		}
 		if ( duration_cast<chrono::seconds>( fCurTime - s_fLastInfoTime ).count() != 0 )
 		{
-			if ( s_lastShader.data() != pEntry->m_szName.data() )
-			{
-				s_averageProcess.Reset();
-				s_lastShader = pEntry->m_szName;
-				s_nLastEntry = nComboOfEntry;
-			}
-
-			s_averageProcess.PushValue( s_nLastEntry - nComboOfEntry );
-			s_nLastEntry = nComboOfEntry;
+			// Counts are exact, skipped combos never show up as remaining work
+			const uint64_t nDone      = g_nCommandsDone;
+			const uint64_t nRemaining = g_nCommandsTotal - std::min( nDone, g_nCommandsTotal );
+			s_averageProcess.PushValue( nDone - s_nLastDone );
+			s_nLastDone = nDone;
 			const auto avg = s_averageProcess.GetAverage();
-			std::cout << "\r"sv << clr::escaped( lineRewind ) << "Compiling "sv << ( g_ShaderHadError.contains( pEntry->m_szName ) ? clr::red : clr::green ) << pEntry->m_szName << clr::reset << " ["sv << clr::blue << PrettyPrint( nComboOfEntry ) << clr::reset << " remaining] "sv
-				<< FormatTimeShort( duration_cast<chrono::seconds>( fCurTime - g_flStartTime ).count() ) << " elapsed ("sv << clr::green2 << avg << clr::reset << " c/s, est. remaining "sv << FormatTimeShort( nComboOfEntry / std::max<uint64_t>( avg, 1 ) ) << ")"sv << endLine;
+			std::cout << "\r"sv << clr::escaped( lineRewind ) << "Compiling "sv << ( g_ShaderHadError.contains( pEntry->m_szName ) ? clr::red : clr::green ) << pEntry->m_szName << clr::reset << " ["sv << clr::blue << PrettyPrint( nRemaining ) << clr::reset << " remaining] "sv
+				<< FormatTimeShort( duration_cast<chrono::seconds>( fCurTime - g_flStartTime ).count() ) << " elapsed ("sv << clr::green2 << avg << clr::reset << " c/s, est. remaining "sv << FormatTimeShort( nRemaining / std::max<uint64_t>( avg, 1 ) ) << ")"sv << endLine;
 			s_fLastInfoTime = fCurTime;
 		}
 	}
@@ -759,95 +1111,434 @@ template <typename TMutexType>
 class CWorkerAccumState
 {
 public:
+	// Shaders being compiled at once, the oldest one has to be written before workers move past the window
+	static constexpr size_t SHADERS_IN_FLIGHT = 8;
+	// Upper bound of the commands a worker claims at once, smaller chunks are claimed as the window drains
+	static constexpr uint64_t MAX_CHUNK_SIZE = 1024;
+
 	explicit CWorkerAccumState( uint32_t iFlags ) noexcept
-		: m_iFirstCommand( 0 ), m_iNextCommand( 0 ), m_iEndCommand( 0 )
-		, m_iLastFinished( 0 ), m_hCombo( nullptr ), m_iFlags( iFlags ) {}
+		: m_nCompileBusy( 0 ), m_nPackBusy( 0 ), m_nPackStalled( 0 ), m_nZipBusy( 0 )
+		, m_iFirstCommand( 0 ), m_iNextCommand( 0 ), m_iEndCommand( 0 ), m_iDispatchEnd( 0 )
+		, m_nQueues( 0 ), m_nCompiling( 0 ), m_nResultsPushed( 0 ), m_nWritten( 0 ), m_hCombo( nullptr ), m_iFlags( iFlags ) {}
+
+	void RangeBegin( gsl::span<const CfgProcessor::CfgEntryInfo> arrEntries );
+
+	~CWorkerAccumState() { StopWorkers(); }
+
+	// Workers live as long as the state, every range wakes them up once.
+	// The packer is one more of them, it owns the bytecode of the range and hands finished static combos to the zip threads.
+	void StartWorkers( uint32_t nThreads, uint32_t nZipThreads )
+	{
+		m_arrQueues = std::make_unique<CWorkerQueue[]>( nThreads );
+		m_nQueues   = nThreads;
+		m_arrWorkers.reserve( nThreads + 1 );
+		for ( uint32_t i = 0; i < nThreads; ++i )
+			m_arrWorkers.emplace_back( DoExecute, this, &m_arrQueues[i] );
+		m_arrWorkers.emplace_back( DoPack, this );
+
+		m_nMaxZipJobs = nZipThreads * ZIP_JOBS_PER_THREAD;
+		m_arrZipThreads.reserve( nZipThreads );
+		for ( uint32_t i = 0; i < nZipThreads; ++i )
+			m_arrZipThreads.emplace_back( DoZip, this );
+	}
+
+	// Writes shaders as they finish while the workers keep compiling the following ones
+	void Run()
+	{
+		const Clock::time_point startTime = Clock::now();
+		{
+			std::lock_guard guard{ m_mtxWorkers };
+			m_nActive = m_arrWorkers.size();
+			++m_nRange;
+		}
+		m_cvRangeBegin.notify_all();
+
+		for ( ;; )
+		{
+			{
+				std::unique_lock guard{ m_mtxWorkers };
+				m_cvRangeEnd.wait( guard, [this] { return !m_nActive || !m_arrFinished.empty(); } );
+				if ( m_arrFinished.empty() )
+					break;
+			}
+
+			WriteFinishedShaders();
+		}
+
+		ReportUtilization( Clock::now() - startTime );
+	}
+
+	void WriteFinishedShaders();
+
+	// Compression ratio and time of every shader, and how many blocks skipped LZMA
+	void ReportCompression() const
+	{
+		uint64_t nBlocks = 0, nSkipped = 0, nDuplicates = 0;
+		for ( size_t i = 0; i < m_arrEntries.size(); ++i )
+		{
+			if ( g_bCompressAuto || g_bVerbose )
+				m_arrCompressors[i].Report( m_arrEntries[i].m_szName );
+			nBlocks += m_arrCompressors[i].GetBlockCount();
+			nSkipped += m_arrCompressors[i].GetSkippedCount();
+			nDuplicates += m_arrComboIndices[i].GetDuplicateCount();
+		}
+		if ( nBlocks )
+			std::cout << "Skipped compressing "sv << nSkipped << " of "sv << nBlocks << " blocks ("sv << nSkipped * 100 / nBlocks << "%) and "sv << nDuplicates << " duplicate static combos"sv << std::endl;
+	}
+
+	void OnProcessST();
+
+	void Stop() noexcept
+	{
+		m_bBreak.store( true, std::memory_order_release );
+
+		// Wake up workers waiting for the window to move
+		{
+			std::lock_guard guard{ m_Mutex };
+		}
+		m_cvWindow.notify_all();
+	}
 
-	void RangeBegin( uint64_t iFirstCommand, uint64_t iEndCommand );
-	void RangeFinished();
+private:
+	// Result of one command, handed from the worker to the packer
+	struct CompileResult
+	{
+		const CfgProcessor::CfgEntryInfo*	m_pEntryInfo;
+		uint64_t							m_iComboIndex;
+		CmdSink::IResponse*					m_pResponse;	// Released by the packer
+	};
+
+	// Results a worker may hand over before it has to wait for the packer
+	static constexpr uint32_t RESULT_RING_SIZE = 256;
+	// Static combos queued for every zip thread before the packer has to wait
+	static constexpr size_t ZIP_JOBS_PER_THREAD = 2;
+
+	// Static combo with all of its dynamic combos done, the record is left alone by the packer until it is zipped
+	struct ZipJob
+	{
+		size_t			m_nEntry;
+		uint64_t		m_nStComboIdx;
+		CStaticCombo*	m_pStComboRec;
+	};
+
+	// Commands a worker owns, the owner takes them from the front while idle workers steal the back half.
+	// Results go to the packer through a single producer ring, so compiling never takes a shared lock.
+	struct alignas( std::hardware_destructive_interference_size ) CWorkerQueue
+	{
+		Threading::CTimedMutex<Threading::g_QueueLockStats>	m_Mutex;
+		uint64_t	m_iNext = 0;
+		uint64_t	m_iEnd  = 0;
+
+		std::array<CompileResult, RESULT_RING_SIZE>									m_arrResults;
+		alignas( std::hardware_destructive_interference_size ) std::atomic<uint32_t>	m_nResultsPut = 0;	// Written by the worker
+		alignas( std::hardware_destructive_interference_size ) std::atomic<uint32_t>	m_nResultsGot = 0;	// Written by the packer
+	};
+
+	// Cache keys a worker built to prefetch the commands it claimed, taken again when they are compiled.
+	// Commands are compiled in order, keys of commands stolen by other workers are skipped.
+	struct PrefetchedKeys
+	{
+		std::vector<uint64_t>		m_arrCommands;
+		std::vector<std::string>	m_arrKeys;
+		size_t						m_nNext = 0;
 
-	void ExecuteCompileCommand( CfgProcessor::ComboHandle hCombo );
-	void HandleCommandResponse( CfgProcessor::ComboHandle hCombo, CmdSink::IResponse* pResponse );
+		const std::string* Find( uint64_t iCommand ) noexcept
+		{
+			while ( m_nNext < m_arrCommands.size() && m_arrCommands[m_nNext] < iCommand )
+				++m_nNext;
+			return m_nNext < m_arrCommands.size() && m_arrCommands[m_nNext] == iCommand ? &m_arrKeys[m_nNext] : nullptr;
+		}
+	};
 
-	void Run( uint32_t i )
+	std::atomic<bool>			m_bBreak;
+	TMutexType					m_Mutex;
+	std::condition_variable_any	m_cvWindow;
+
+	std::vector<std::thread>	m_arrWorkers;
+	std::mutex					m_mtxWorkers;
+	std::condition_variable		m_cvRangeBegin;
+	std::condition_variable		m_cvRangeEnd;
+	uint64_t					m_nRange = 0;		// Ranges handed out so far
+	size_t						m_nActive = 0;		// Workers still busy with the current range
+	bool						m_bQuit = false;
+	std::vector<size_t>			m_arrFinished;		// Entries packed completely, waiting to be written
+
+	std::vector<std::thread>	m_arrZipThreads;
+	std::mutex					m_mtxZip;
+	std::condition_variable		m_cvZipJob;			// Zip threads wait for jobs
+	std::condition_variable		m_cvZipDone;		// Packer waits for room in the queue or for the zip threads to go idle
+	std::deque<ZipJob>			m_arrZipJobs;
+	size_t						m_nMaxZipJobs = 0;
+	size_t						m_nZipRunning = 0;
+	bool						m_bZipQuit = false;
+
+	// Busy time of every stage in nanoseconds, reported after the range to size the thread pools
+	std::atomic<uint64_t>		m_nCompileBusy;
+	std::atomic<uint64_t>		m_nPackBusy;
+	std::atomic<uint64_t>		m_nPackStalled;		// Packer waiting for room in the zip queue
+	std::atomic<uint64_t>		m_nZipBusy;
+
+	void StopWorkers()
 	{
-		m_arrSubProcessInfos.reserve( i );
+		{
+			std::lock_guard guard{ m_mtxWorkers };
+			m_bQuit = true;
+		}
+		m_cvRangeBegin.notify_all();
 
-		std::vector<std::thread> threads;
-		threads.reserve( i );
+		std::for_each( m_arrWorkers.begin(), m_arrWorkers.end(), []( std::thread& t ) { if ( t.joinable() ) t.join(); } );
+		m_arrWorkers.clear();
 
-		while ( i-- > 0 )
 		{
-			++m_nActive;
-			threads.emplace_back( DoExecute, this );
+			std::lock_guard guard{ m_mtxZip };
+			m_bZipQuit = true;
 		}
+		m_cvZipJob.notify_all();
+
+		std::for_each( m_arrZipThreads.begin(), m_arrZipThreads.end(), []( std::thread& t ) { if ( t.joinable() ) t.join(); } );
+		m_arrZipThreads.clear();
+	}
+
+	static void DoExecute( CWorkerAccumState* pThis, CWorkerQueue* pQueue )
+	{
+		uint64_t nRange = 0;
+		for ( ;; )
+		{
+			{
+				std::unique_lock guard{ pThis->m_mtxWorkers };
+				pThis->m_cvRangeBegin.wait( guard, [pThis, nRange] { return pThis->m_bQuit || pThis->m_nRange != nRange; } );
+				if ( pThis->m_bQuit )
+					return;
+				nRange = pThis->m_nRange;
+			}
+
+			while ( pThis->OnProcess( *pQueue ) )
+				continue;
+
+			// Last worker out lets the packer know that no more results are coming
+			if ( pThis->m_nCompiling.fetch_sub( 1, std::memory_order_acq_rel ) == 1 )
+			{
+				pThis->m_nResultsPushed.fetch_add( 1, std::memory_order_release );
+				pThis->m_nResultsPushed.notify_one();
+			}
+
+			std::lock_guard guard{ pThis->m_mtxWorkers };
+			if ( !--pThis->m_nActive )
+				pThis->m_cvRangeEnd.notify_one();
+		}
+	}
+
+	static void DoPack( CWorkerAccumState* pThis )
+	{
+		uint64_t nRange = 0;
+		for ( ;; )
+		{
+			{
+				std::unique_lock guard{ pThis->m_mtxWorkers };
+				pThis->m_cvRangeBegin.wait( guard, [pThis, nRange] { return pThis->m_bQuit || pThis->m_nRange != nRange; } );
+				if ( pThis->m_bQuit )
+					return;
+				nRange = pThis->m_nRange;
+			}
+
+			for ( ;; )
+			{
+				// Everything was pushed before the workers were done, so one more drain after that picks up the rest
+				const uint64_t nPushed  = pThis->m_nResultsPushed.load( std::memory_order_acquire );
+				const bool bCompiling   = pThis->m_nCompiling.load( std::memory_order_acquire ) != 0;
+				const Clock::time_point drainStart = Clock::now();
+				if ( pThis->DrainResults() )
+				{
+					pThis->m_nPackBusy += duration_cast<chrono::nanoseconds>( Clock::now() - drainStart ).count();
+					continue;
+				}
+				if ( !bCompiling )
+					break;
+				pThis->m_nResultsPushed.wait( nPushed, std::memory_order_acquire );
+			}
+
+			// The range is over once the last static combo is zipped
+			{
+				std::unique_lock guard{ pThis->m_mtxZip };
+				pThis->m_cvZipDone.wait( guard, [pThis] { return pThis->m_arrZipJobs.empty() && !pThis->m_nZipRunning; } );
+			}
 
-		constexpr const std::chrono::milliseconds sleepTime{ 250 };
-		while ( m_nActive )
-		{
-			_mm_pause();
-			std::this_thread::sleep_for( sleepTime );
+			std::lock_guard guard{ pThis->m_mtxWorkers };
+			if ( !--pThis->m_nActive )
+				pThis->m_cvRangeEnd.notify_one();
 		}
-
-		std::for_each( threads.begin(), threads.end(), []( std::thread& t ) { if ( t.joinable() ) t.join(); } );
-		m_arrSubProcessInfos.clear();
 	}
 
-	void OnProcessST();
-
-	void Stop() noexcept
+	static void DoZip( CWorkerAccumState* pThis )
 	{
-		m_bBreak.store( true, std::memory_order_release );
-	}
-
-private:
-	std::atomic<bool>			m_bBreak;
-	std::atomic<int>			m_nActive;
-	TMutexType					m_Mutex;
+		for ( ;; )
+		{
+			ZipJob job;
+			{
+				std::unique_lock guard{ pThis->m_mtxZip };
+				pThis->m_cvZipJob.wait( guard, [pThis] { return pThis->m_bZipQuit || !pThis->m_arrZipJobs.empty(); } );
+				if ( pThis->m_arrZipJobs.empty() )
+					return;
+				job = pThis->m_arrZipJobs.front();
+				pThis->m_arrZipJobs.pop_front();
+				++pThis->m_nZipRunning;
+			}
 
-	static void DoExecute( CWorkerAccumState* pThis )
-	{
-		while ( pThis->OnProcess() )
-			continue;
+			const Clock::time_point zipStart = Clock::now();
+			pThis->ZipStaticCombo( job );
+			pThis->m_nZipBusy += duration_cast<chrono::nanoseconds>( Clock::now() - zipStart ).count();
 
-		--pThis->m_nActive;
+			{
+				std::lock_guard guard{ pThis->m_mtxZip };
+				--pThis->m_nZipRunning;
+			}
+			pThis->m_cvZipDone.notify_one();
+		}
 	}
 
-	std::vector<uint64_t>	m_arrSubProcessInfos;
 	uint64_t				m_iFirstCommand;
-	uint64_t				m_iNextCommand;
+	uint64_t				m_iNextCommand;		// First command not claimed by any worker
 	uint64_t				m_iEndCommand;
+	uint64_t				m_iDispatchEnd;		// Commands from here on belong to shaders past the window
 
-	uint64_t				m_iLastFinished;
+	std::unique_ptr<CWorkerQueue[]>	m_arrQueues;
+	size_t							m_nQueues;
+	std::atomic<size_t>				m_nCompiling;		// Workers that may still hand over results
+	std::atomic<uint64_t>			m_nResultsPushed;	// Bumped on every hand over, the packer sleeps on it
+
+	gsl::span<const CfgProcessor::CfgEntryInfo>	m_arrEntries;
+	size_t										m_nWritten;
+
+	// Owned by the packer, or by the only thread in single-threaded mode
+	std::vector<StaticComboNodeHash_t*>	m_arrByteCode;		// Bytecode of every entry until all of it is zipped
+	std::vector<std::vector<uint32_t>>	m_arrDynamicLeft;	// Dynamic combos of every static combo not compiled yet, while the entry is in flight
+	size_t								m_nCounted = 0;		// Entries with their counters set up, by the main thread
+
+	std::unique_ptr<std::atomic<uint64_t>[]>	m_arrStaticLeft;	// Static combos of every entry not zipped yet
+	std::unique_ptr<CShaderCompressor[]>		m_arrCompressors;	// Preset choice and compression stats of every entry
+	std::unique_ptr<CStaticComboIndex[]>		m_arrComboIndices;	// Packed static combos of every entry by content
+	std::vector<std::unique_ptr<CVcsWriter>>	m_arrWriters;		// Opened by the packer with the first static combo, zip threads append to it
 
 	CfgProcessor::ComboHandle m_hCombo;
 
 	const uint32_t			m_iFlags;
 
-	bool OnProcess();
-	void TryToPackageData( uint64_t iCommandNumber );
+	bool OnProcess( CWorkerQueue& queue );
+	bool ClaimCommands( CWorkerQueue& queue );
+	bool StealCommands( CWorkerQueue& queue );
+	void PrefetchCommands( CWorkerQueue& queue, PrefetchedKeys& keys );
+	void ExecuteCompileCommand( CfgProcessor::ComboHandle hCombo, CWorkerQueue* pQueue, const std::string* pCacheKey );
+	void HandleCommandResponse( CfgProcessor::ComboHandle hCombo, CmdSink::IResponse* pResponse, CWorkerQueue* pQueue );
+	void PushResult( CWorkerQueue& queue, const CompileResult& result );
+	bool DrainResults();
+	void OnResult( const CompileResult& result );
+	size_t EntryIndex( const CfgProcessor::CfgEntryInfo* pInfo ) const noexcept;
+	void PackStaticCombo( size_t nEntry, uint64_t nStComboIdx );
+	void ZipStaticCombo( const ZipJob& job );
+	void OnStaticComboPacked( size_t nEntry );
+	void ReportUtilization( Clock::duration wallTime ) const;
+	void CountEntries( size_t nWritten );
+	void UpdateDispatchEnd() noexcept
+	{
+		const size_t nWindowEnd = m_nWritten + SHADERS_IN_FLIGHT;
+		m_iDispatchEnd = nWindowEnd < m_arrEntries.size() ? m_arrEntries[nWindowEnd].m_iCommandStart : m_iEndCommand;
+	}
 };
 
 template <typename TMutexType>
-void CWorkerAccumState<TMutexType>::RangeBegin( uint64_t iFirstCommand, uint64_t iEndCommand )
+void CWorkerAccumState<TMutexType>::RangeBegin( gsl::span<const CfgProcessor::CfgEntryInfo> arrEntries )
 {
-	m_iFirstCommand = iFirstCommand;
-	m_iNextCommand  = iFirstCommand;
-	m_iEndCommand   = iEndCommand;
-	m_iLastFinished = iFirstCommand;
+	m_arrEntries = arrEntries;
+	m_arrByteCode.assign( arrEntries.size(), nullptr );
+	m_arrStaticLeft = std::make_unique<std::atomic<uint64_t>[]>( arrEntries.size() );
+	m_arrCompressors = std::make_unique<CShaderCompressor[]>( arrEntries.size() );
+	m_arrComboIndices = std::make_unique<CStaticComboIndex[]>( arrEntries.size() );
+	m_arrWriters.clear();
+	m_arrWriters.resize( arrEntries.size() );
+	m_arrFinished.clear();
+	m_nWritten = 0;
+	m_arrDynamicLeft.clear();
+	m_arrDynamicLeft.resize( arrEntries.size() );
+	m_nCounted = 0;
+
+	m_iFirstCommand = arrEntries.front().m_iCommandStart;
+	m_iNextCommand  = m_iFirstCommand;
+	m_iEndCommand   = arrEntries.back().m_iCommandEnd;
 	m_hCombo        = nullptr;
-	CfgProcessor::Combo_GetNext( m_iNextCommand, m_hCombo, m_iEndCommand );
+	CountEntries( 0 );
+	UpdateDispatchEnd();
+
+	for ( size_t i = 0; i < m_nQueues; ++i )
+	{
+		m_arrQueues[i].m_iNext = m_iFirstCommand;
+		m_arrQueues[i].m_iEnd  = m_iFirstCommand;
+	}
+	m_nCompiling = m_nQueues;
+
+	m_nCompileBusy = m_nPackBusy = m_nPackStalled = m_nZipBusy = 0;
+}
+
+// Every static combo is packed as soon as its last dynamic combo is done, static combos without any dynamic combo
+// left after skipping are never packed. Counted once a shader enters the window, before its commands are handed out.
+template <typename TMutexType>
+void CWorkerAccumState<TMutexType>::CountEntries( size_t nWritten )
+{
+	const size_t nWindowEnd = std::min( nWritten + SHADERS_IN_FLIGHT, m_arrEntries.size() );
+	for ( ; m_nCounted < nWindowEnd; ++m_nCounted )
+	{
+		const std::vector<uint64_t> arrCounts = CfgProcessor::CountNonSkippedDynamicCombos( m_arrEntries[m_nCounted] );
+		std::vector<uint32_t> arrLeft( arrCounts.size() );
+		uint64_t nStaticUsed = 0;
+		for ( size_t j = 0; j < arrCounts.size(); ++j )
+		{
+			arrLeft[j] = gsl::narrow<uint32_t>( arrCounts[j] );
+			nStaticUsed += arrCounts[j] != 0;
+		}
+
+		m_arrStaticLeft[m_nCounted] = nStaticUsed;
+		if ( nStaticUsed )
+			m_arrDynamicLeft[m_nCounted] = std::move( arrLeft );
+		else
+		{
+			std::lock_guard guard{ m_mtxWorkers };
+			m_arrFinished.emplace_back( m_nCounted );
+		}
+	}
 }
 
 template <typename TMutexType>
-void CWorkerAccumState<TMutexType>::RangeFinished()
+void CWorkerAccumState<TMutexType>::WriteFinishedShaders()
 {
-	// Finish packaging data
-	TryToPackageData( m_iEndCommand - 1 );
+	// Shaders with nothing to compile are finished as they enter the window
+	for ( ;; )
+	{
+		std::vector<size_t> arrFinished;
+		{
+			std::lock_guard guard{ m_mtxWorkers };
+			std::swap( arrFinished, m_arrFinished );
+		}
+
+		if ( arrFinished.empty() )
+			return;
+
+		for ( const size_t nEntry : arrFinished )
+		{
+			if ( !m_bBreak.load( std::memory_order_acquire ) )
+				WriteShaderFiles( m_arrEntries[nEntry].m_szName );
+		}
+
+		CountEntries( m_nWritten + arrFinished.size() );
+		{
+			std::lock_guard guard{ m_Mutex };
+			m_nWritten += arrFinished.size();
+			UpdateDispatchEnd();
+		}
+		m_cvWindow.notify_all();
+	}
 }
 
 template <typename TMutexType>
-void CWorkerAccumState<TMutexType>::ExecuteCompileCommand( CfgProcessor::ComboHandle hCombo )
+void CWorkerAccumState<TMutexType>::ExecuteCompileCommand( CfgProcessor::ComboHandle hCombo, CWorkerQueue* pQueue, const std::string* pCacheKey )
 {
 	CmdSink::IResponse* pResponse = nullptr;
 
@@ -861,15 +1552,31 @@ void CWorkerAccumState<TMutexType>::ExecuteCompileCommand( CfgProcessor::ComboHa
 		}
 	}
 
-	Compiler::ExecuteCommand( Combo_BuildCommand( hCombo ), pResponse, m_iFlags );
+	// Combos of shaders with collapsed defines take the result of the combo compiled in their place
+	if ( const std::optional<uint64_t> iRepresentative = DefineAnalysis::Representative( hCombo ) )
+	{
+		const std::string& aliasKey = CompileCache::BuildAliasKey( *iRepresentative );
+		if ( ( pResponse = CompileCache::Find( aliasKey ) ) == nullptr )
+		{
+			CfgProcessor::ComboHandle hRepresentative = CfgProcessor::Combo_GetCombo( *iRepresentative );
+			Compiler::ExecuteCommand( Combo_BuildCommand( hRepresentative ), pResponse, m_iFlags );
+			Combo_Free( hRepresentative );
+			if ( pResponse )
+				CompileCache::Store( aliasKey, *pResponse );
+		}
+	}
+	else if ( pCacheKey )
+		Compiler::ExecuteCommand( Combo_BuildCommand( hCombo ), pResponse, m_iFlags, *pCacheKey );
+	else
+		Compiler::ExecuteCommand( Combo_BuildCommand( hCombo ), pResponse, m_iFlags );
 
-	HandleCommandResponse( hCombo, pResponse );
+	HandleCommandResponse( hCombo, pResponse, pQueue );
 }
 
 static void StopCommandRange();
 
 template <typename TMutexType>
-void CWorkerAccumState<TMutexType>::HandleCommandResponse( CfgProcessor::ComboHandle hCombo, CmdSink::IResponse* pResponse )
+void CWorkerAccumState<TMutexType>::HandleCommandResponse( CfgProcessor::ComboHandle hCombo, CmdSink::IResponse* pResponse, CWorkerQueue* pQueue )
 {
 	Assert( pResponse );
 
@@ -878,14 +1585,7 @@ void CWorkerAccumState<TMutexType>::HandleCommandResponse( CfgProcessor::ComboHa
 	const uint64_t iComboIndex                   = Combo_GetComboNum( hCombo );
 	const uint64_t iCommandNumber                = Combo_GetCommandNum( hCombo );
 
-	if ( pResponse->Succeeded() )
-	{
-		std::lock_guard guard{ Threading::g_mtxGlobal };
-		const uint64_t nStComboIdx = iComboIndex / pEntryInfo->m_numDynamicCombos;
-		const uint64_t nDyComboIdx = iComboIndex - ( nStComboIdx * pEntryInfo->m_numDynamicCombos );
-		StaticComboFromDictAdd( pEntryInfo->m_szName, nStComboIdx )->AddDynamicCombo( nDyComboIdx, pResponse->GetResultBuffer(), pResponse->GetResultBufferLen() );
-	}
-	else // Tell the master that this shader failed
+	if ( !pResponse->Succeeded() ) // Tell the master that this shader failed
 	{
 		std::lock_guard guard{ Threading::g_mtxGlobal };
 		ShaderHadErrorDispatchInt( pEntryInfo->m_szName );
@@ -910,138 +1610,346 @@ void CWorkerAccumState<TMutexType>::HandleCommandResponse( CfgProcessor::ComboHa
 			StopCommandRange();
 	}
 
-	pResponse->Release();
+	++g_nCommandsDone;
 
-	// Maybe zip things up
-	TryToPackageData( iCommandNumber );
+	// Bytecode is stored and zipped up by the packer
+	const CompileResult result { pEntryInfo, iComboIndex, pResponse };
+	if ( pQueue )
+		PushResult( *pQueue, result );
+	else
+		OnResult( result );
 }
 
 template <typename TMutexType>
-void CWorkerAccumState<TMutexType>::TryToPackageData( uint64_t iCommandNumber )
+void CWorkerAccumState<TMutexType>::PushResult( CWorkerQueue& queue, const CompileResult& result )
 {
-	std::unique_lock guard{ m_Mutex };
+	// Wait for the packer to catch up when the ring is full
+	const uint32_t nPut = queue.m_nResultsPut.load( std::memory_order_relaxed );
+	for ( uint32_t nGot; nPut - ( nGot = queue.m_nResultsGot.load( std::memory_order_acquire ) ) == RESULT_RING_SIZE; )
+		queue.m_nResultsGot.wait( nGot, std::memory_order_acquire );
+
+	queue.m_arrResults[nPut % RESULT_RING_SIZE] = result;
+	queue.m_nResultsPut.store( nPut + 1, std::memory_order_release );
 
-	uint64_t iFinishedByNow = iCommandNumber + 1;
+	m_nResultsPushed.fetch_add( 1, std::memory_order_release );
+	m_nResultsPushed.notify_one();
+}
 
-	// Check if somebody is running an earlier command
-	for ( const auto& iRunningCommand : m_arrSubProcessInfos )
+template <typename TMutexType>
+bool CWorkerAccumState<TMutexType>::DrainResults()
+{
+	bool bDrained = false;
+	for ( size_t i = 0; i < m_nQueues; ++i )
 	{
-		if ( iRunningCommand < iCommandNumber )
+		CWorkerQueue& queue = m_arrQueues[i];
+		const uint32_t nPut = queue.m_nResultsPut.load( std::memory_order_acquire );
+		uint32_t nGot       = queue.m_nResultsGot.load( std::memory_order_relaxed );
+		if ( nGot == nPut )
+			continue;
+
+		for ( ; nGot != nPut; ++nGot )
 		{
-			iFinishedByNow = 0;
-			break;
+			OnResult( queue.m_arrResults[nGot % RESULT_RING_SIZE] );
+			queue.m_nResultsGot.store( nGot + 1, std::memory_order_release );
 		}
+		queue.m_nResultsGot.notify_one();
+		bDrained = true;
 	}
 
-	const uint64_t iLastFinished = m_iLastFinished;
-	if ( iFinishedByNow > m_iLastFinished )
+	return bDrained;
+}
+
+// Runs on the packer, the bytecode maps and counters are not shared with anybody else
+template <typename TMutexType>
+void CWorkerAccumState<TMutexType>::OnResult( const CompileResult& result )
+{
+	const CfgProcessor::CfgEntryInfo* pEntryInfo = result.m_pEntryInfo;
+	const size_t nEntry        = EntryIndex( pEntryInfo );
+	const uint64_t nStComboIdx = result.m_iComboIndex / pEntryInfo->m_numDynamicCombos;
+
+	if ( result.m_pResponse->Succeeded() )
 	{
-		m_iLastFinished = iFinishedByNow;
-		guard.unlock();
+		const uint64_t nDyComboIdx = result.m_iComboIndex - ( nStComboIdx * pEntryInfo->m_numDynamicCombos );
+		StaticComboFromDictAdd( m_arrByteCode[nEntry], nStComboIdx )->AddDynamicCombo( nDyComboIdx, pEntryInfo->m_numDynamicCombos, result.m_pResponse->GetResultBuffer(), result.m_pResponse->GetResultBufferLen() );
 	}
-	else
-		return;
+	result.m_pResponse->Release();
 
-	CfgProcessor::ComboHandle hChBegin = CfgProcessor::Combo_GetCombo( iLastFinished );
-	CfgProcessor::ComboHandle hChEnd   = CfgProcessor::Combo_GetCombo( iFinishedByNow );
+	// Zip the static combo up once all of its dynamic combos are done
+	Assert( nStComboIdx < m_arrDynamicLeft[nEntry].size() );
+	if ( !--m_arrDynamicLeft[nEntry][nStComboIdx] )
+		PackStaticCombo( nEntry, nStComboIdx );
+}
 
-	Assert( hChBegin && hChEnd );
+template <typename TMutexType>
+size_t CWorkerAccumState<TMutexType>::EntryIndex( const CfgProcessor::CfgEntryInfo* pInfo ) const noexcept
+{
+	const auto it = std::lower_bound( m_arrEntries.begin(), m_arrEntries.end(), pInfo->m_iCommandStart,
+		[]( const CfgProcessor::CfgEntryInfo& entry, uint64_t iCommand ) noexcept { return entry.m_iCommandStart < iCommand; } );
+	Assert( it != m_arrEntries.end() && it->m_iCommandStart == pInfo->m_iCommandStart );
 
-	const CfgProcessor::CfgEntryInfo* pInfoBegin = Combo_GetEntryInfo( hChBegin );
-	const CfgProcessor::CfgEntryInfo* pInfoEnd   = Combo_GetEntryInfo( hChEnd );
+	return static_cast<size_t>( std::distance( m_arrEntries.begin(), it ) );
+}
 
-	uint64_t nComboBegin     = Combo_GetComboNum( hChBegin ) / pInfoBegin->m_numDynamicCombos;
-	const uint64_t nComboEnd = Combo_GetComboNum( hChEnd ) / pInfoEnd->m_numDynamicCombos;
+template <typename TMutexType>
+void CWorkerAccumState<TMutexType>::PackStaticCombo( size_t nEntry, uint64_t nStComboIdx )
+{
+	StaticComboNodeHash_t* pByteCodeArray = m_arrByteCode[nEntry];
+	CStaticCombo* pStComboRec             = pByteCodeArray ? pByteCodeArray->FindByKey( nStComboIdx ) : nullptr;
 
-	for ( ; pInfoBegin && ( pInfoBegin->m_iCommandStart < pInfoEnd->m_iCommandStart || nComboBegin > nComboEnd ); )
+	// Every dynamic combo failed, nothing to zip
+	if ( !pStComboRec )
 	{
-		// Zip this combo
-		CUtlBuffer mbPacked;
-		const size_t nPackedLength = AssembleWorkerReplyPackage( pInfoBegin, nComboBegin, mbPacked );
+		OnStaticComboPacked( nEntry );
+		return;
+	}
 
-		if ( nPackedLength )
-		{
-			// Packed buffer
-			uint8_t* pCodeBuffer;
-			{
-				std::lock_guard guard{ Threading::g_mtxGlobal };
-				pCodeBuffer = StaticComboFromDictAdd( pInfoBegin->m_szName, nComboBegin )->AllocPackedCodeBlock( nPackedLength );
-			}
+	// The shader file is started along with its first static combo
+	if ( !m_arrWriters[nEntry] )
+		m_arrWriters[nEntry] = OpenShaderFile( m_arrEntries[nEntry].m_szName );
 
-			if ( pCodeBuffer )
-			{
-				mbPacked.SeekGet( CUtlBuffer::SEEK_HEAD, 0 );
-				mbPacked.Get( pCodeBuffer, gsl::narrow<int>( nPackedLength ) );
-			}
-		}
+	const ZipJob job { nEntry, nStComboIdx, pStComboRec };
+	if ( m_arrZipThreads.empty() )
+	{
+		ZipStaticCombo( job );
+		return;
+	}
 
-		// Next iteration
-		if ( !nComboBegin-- )
+	// Wait for the zip threads when they fall behind, finished bytecode would pile up otherwise
+	{
+		std::unique_lock guard{ m_mtxZip };
+		if ( m_arrZipJobs.size() >= m_nMaxZipJobs )
 		{
-			Combo_Free( hChBegin );
-			if ( ( hChBegin = CfgProcessor::Combo_GetCombo( pInfoBegin->m_iCommandEnd ) ) != nullptr )
-			{
-				pInfoBegin  = Combo_GetEntryInfo( hChBegin );
-				nComboBegin = pInfoBegin->m_numStaticCombos - 1;
-			}
+			const Clock::time_point stallStart = Clock::now();
+			m_cvZipDone.wait( guard, [this] { return m_arrZipJobs.size() < m_nMaxZipJobs; } );
+			m_nPackStalled += duration_cast<chrono::nanoseconds>( Clock::now() - stallStart ).count();
 		}
+		m_arrZipJobs.emplace_back( job );
+	}
+	m_cvZipJob.notify_one();
+}
+
+// Runs on a zip thread, the record belongs to the job until the static combo is counted as packed
+template <typename TMutexType>
+void CWorkerAccumState<TMutexType>::ZipStaticCombo( const ZipJob& job )
+{
+	CUtlBuffer mbPacked;
+	const size_t nPackedLength = AssembleWorkerReplyPackage( &m_arrEntries[job.m_nEntry], job.m_pStComboRec, m_arrComboIndices[job.m_nEntry], m_arrCompressors[job.m_nEntry], mbPacked );
+
+	// Packed buffer goes straight to the shader file, only the record of the static combo stays around
+	job.m_pStComboRec->ReleaseDynamicCombos();
+	if ( CVcsWriter* pWriter = m_arrWriters[job.m_nEntry].get() )
+	{
+		if ( job.m_pStComboRec->IsDuplicate() )
+			pWriter->AddDuplicate( job.m_pStComboRec->ComboId(), job.m_pStComboRec->DuplicateOf() );
+		else if ( nPackedLength )
+			pWriter->AddStaticCombo( job.m_pStComboRec->ComboId(), mbPacked.Base(), nPackedLength );
 	}
 
-	Combo_Free( hChBegin );
-	Combo_Free( hChEnd );
+	OnStaticComboPacked( job.m_nEntry );
 }
 
 template <typename TMutexType>
-bool CWorkerAccumState<TMutexType>::OnProcess()
+void CWorkerAccumState<TMutexType>::OnStaticComboPacked( size_t nEntry )
 {
-	CfgProcessor::ComboHandle hThreadCombo;
-	uint64_t* iCurrentId;
+	if ( m_arrStaticLeft[nEntry].fetch_sub( 1, std::memory_order_acq_rel ) != 1 )
+		return;
+
+	// Hand the shader file over for writing, the packer is done with the entry and so are the zip threads
+	delete std::exchange( m_arrByteCode[nEntry], nullptr );
+	m_arrDynamicLeft[nEntry] = std::vector<uint32_t>();
+	m_arrComboIndices[nEntry].Release();
 	{
-		std::lock_guard guard{ m_Mutex };
-		hThreadCombo = m_hCombo ? Combo_Alloc( m_hCombo ) : nullptr;
-		m_arrSubProcessInfos.resize( m_arrSubProcessInfos.size() + 1 );
-		iCurrentId = &m_arrSubProcessInfos.back();
+		std::lock_guard guard{ Threading::g_mtxGlobal };
+		g_ShaderWriters[m_arrEntries[nEntry].m_szName] = std::move( m_arrWriters[nEntry] );
 	}
 
-	uint64_t iThreadCommand = ~0ULL;
+	{
+		std::lock_guard guard{ m_mtxWorkers };
+		m_arrFinished.emplace_back( nEntry );
+	}
+	m_cvRangeEnd.notify_one();
+}
 
-	for ( ;; )
+template <typename TMutexType>
+void CWorkerAccumState<TMutexType>::ReportUtilization( Clock::duration wallTime ) const
+{
+	const uint64_t nWall = std::max<uint64_t>( duration_cast<chrono::nanoseconds>( wallTime ).count(), 1 );
+	const auto Percent = [nWall]( uint64_t nBusy, size_t nThreads ) { return nBusy * 100 / ( nWall * std::max<size_t>( nThreads, 1 ) ); };
+
+	const uint64_t nPackStalled = m_nPackStalled;
+	std::cout << "\r"sv << clr::escaped( lineRewind ) << "Busy: compile "sv << clr::blue << Percent( m_nCompileBusy, m_nQueues ) << "%"sv << clr::reset << " of "sv << m_nQueues
+			  << " threads, packer "sv << clr::blue << Percent( m_nPackBusy - std::min<uint64_t>( m_nPackBusy, nPackStalled ), 1 ) << "%"sv << clr::reset << " (waited for zip "sv << Percent( nPackStalled, 1 ) << "%)"sv
+			  << ", zip "sv << clr::blue << Percent( m_nZipBusy, m_arrZipThreads.size() ) << "%"sv << clr::reset << " of "sv << m_arrZipThreads.size() << " threads"sv << std::endl;
+
+	if ( g_bLockStats )
+	{
+		std::cout << "Locks:"sv << std::endl;
+		Threading::g_DispatchLockStats.Report( "command dispatch"sv );
+		Threading::g_QueueLockStats.Report( "worker queues"sv );
+		Threading::g_GlobalLockStats.Report( "global"sv );
+	}
+}
+
+template <typename TMutexType>
+bool CWorkerAccumState<TMutexType>::OnProcess( CWorkerQueue& queue )
+{
+	CfgProcessor::ComboHandle hThreadCombo = nullptr;
+	uint64_t iThreadCommand = 0;
+	PrefetchedKeys keys;
+
+	while ( !m_bBreak.load( std::memory_order_acquire ) )
 	{
+		// Enumerate without any lock, the end of the range only moves down when a thief takes the back half
+		uint64_t iRangeEnd;
 		{
-			std::lock_guard guard{ m_Mutex };
-			if ( m_hCombo )
+			std::lock_guard guard{ queue.m_Mutex };
+			if ( !hThreadCombo )
+				iThreadCommand = queue.m_iNext;
+			iRangeEnd = queue.m_iEnd;
+		}
+
+		if ( iThreadCommand < iRangeEnd )
+			Combo_GetNext( iThreadCommand, hThreadCombo, iRangeEnd );
+
+		bool bClaimed = false;
+		{
+			std::lock_guard guard{ queue.m_Mutex };
+			if ( hThreadCombo && iThreadCommand < queue.m_iEnd )
 			{
-				Combo_Assign( hThreadCombo, m_hCombo );
-				*iCurrentId = Combo_GetCommandNum( hThreadCombo );
-				Combo_GetNext( iThreadCommand, m_hCombo, m_iEndCommand );
+				queue.m_iNext = iThreadCommand + 1;
+				bClaimed = true;
 			}
 			else
-			{
-				Combo_Free( hThreadCombo );
-				iThreadCommand = ~0ULL;
-				*iCurrentId = ~0ULL;
-			}
+				queue.m_iNext = queue.m_iEnd;
 		}
 
-		if ( hThreadCombo && !m_bBreak.load( std::memory_order_acquire ) )
-			ExecuteCompileCommand( hThreadCombo );
-		else
+		if ( bClaimed )
+		{
+			const Clock::time_point compileStart = Clock::now();
+			ExecuteCompileCommand( hThreadCombo, &queue, keys.Find( iThreadCommand ) );
+			m_nCompileBusy += duration_cast<chrono::nanoseconds>( Clock::now() - compileStart ).count();
+			continue;
+		}
+
+		Combo_Free( hThreadCombo );
+		if ( !ClaimCommands( queue ) )
 			break;
+		if ( CompileCache::IsRemote() )
+			PrefetchCommands( queue, keys );
 	}
 
 	Combo_Free( hThreadCombo );
 	return false;
 }
 
+// Looks up the whole range in the remote cache at once, the commands find their results waiting instead of asking one at a time
+template <typename TMutexType>
+void CWorkerAccumState<TMutexType>::PrefetchCommands( CWorkerQueue& queue, PrefetchedKeys& keys )
+{
+	uint64_t iCommand, iRangeEnd;
+	{
+		std::lock_guard guard{ queue.m_Mutex };
+		iCommand  = queue.m_iNext;
+		iRangeEnd = queue.m_iEnd;
+	}
+
+	keys.m_arrCommands.clear();
+	keys.m_arrKeys.clear();
+	keys.m_nNext = 0;
+
+	// Combos with collapsed defines never look up a key of their own
+	CfgProcessor::ComboHandle hCombo = nullptr;
+	for ( Combo_GetNext( iCommand, hCombo, iRangeEnd ); hCombo && iCommand < iRangeEnd; Combo_GetNext( iCommand, hCombo, iRangeEnd ) )
+	{
+		if ( DefineAnalysis::Representative( hCombo ) )
+			continue;
+		keys.m_arrCommands.emplace_back( iCommand );
+		keys.m_arrKeys.emplace_back( Compiler::CacheKey( Combo_BuildCommand( hCombo ), m_iFlags ) );
+	}
+	Combo_Free( hCombo );
+
+	CompileCache::Prefetch( keys.m_arrKeys );
+}
+
+// Hands the worker a new range, a chunk of the unclaimed commands or half of the range of another worker
+template <typename TMutexType>
+bool CWorkerAccumState<TMutexType>::ClaimCommands( CWorkerQueue& queue )
+{
+	std::unique_lock guard{ m_Mutex };
+	while ( !m_bBreak.load( std::memory_order_acquire ) )
+	{
+		if ( m_iNextCommand < m_iDispatchEnd )
+		{
+			const uint64_t nChunk = std::clamp<uint64_t>( ( m_iDispatchEnd - m_iNextCommand ) / ( m_nQueues * 4 ), 1, MAX_CHUNK_SIZE );
+
+			std::lock_guard guardQueue{ queue.m_Mutex };
+			queue.m_iNext = m_iNextCommand;
+			queue.m_iEnd  = m_iNextCommand + nChunk;
+			m_iNextCommand += nChunk;
+			return true;
+		}
+
+		if ( StealCommands( queue ) )
+			return true;
+
+		if ( m_iNextCommand >= m_iEndCommand )
+			return false;
+
+		// Next command is past the window, wait for the oldest shader to be written
+		const uint64_t iDispatchEnd = m_iDispatchEnd;
+		m_cvWindow.wait( guard, [this, iDispatchEnd] { return m_iDispatchEnd != iDispatchEnd || m_bBreak.load( std::memory_order_acquire ); } );
+	}
+
+	return false;
+}
+
+// Called under m_Mutex, so only one thief is around at a time
+template <typename TMutexType>
+bool CWorkerAccumState<TMutexType>::StealCommands( CWorkerQueue& queue )
+{
+	CWorkerQueue* pVictim = nullptr;
+	uint64_t nMostLeft    = 1;
+	for ( size_t i = 0; i < m_nQueues; ++i )
+	{
+		CWorkerQueue& other = m_arrQueues[i];
+		if ( &other == &queue )
+			continue;
+
+		std::lock_guard guard{ other.m_Mutex };
+		if ( other.m_iEnd - other.m_iNext > nMostLeft )
+		{
+			nMostLeft = other.m_iEnd - other.m_iNext;
+			pVictim   = &other;
+		}
+	}
+
+	if ( !pVictim )
+		return false;
+
+	std::scoped_lock guard{ pVictim->m_Mutex, queue.m_Mutex };
+	if ( pVictim->m_iEnd - pVictim->m_iNext < 2 )
+		return false;
+
+	const uint64_t iSplit = pVictim->m_iNext + ( pVictim->m_iEnd - pVictim->m_iNext ) / 2;
+	queue.m_iNext         = iSplit;
+	queue.m_iEnd          = pVictim->m_iEnd;
+	pVictim->m_iEnd       = iSplit;
+	return true;
+}
+
 template <typename TMutexType>
 void CWorkerAccumState<TMutexType>::OnProcessST()
 {
+	Combo_GetNext( m_iNextCommand, m_hCombo, m_iEndCommand );
 	while ( m_hCombo && !m_bBreak.load( std::memory_order_acquire ) )
 	{
-		ExecuteCompileCommand( m_hCombo );
+		ExecuteCompileCommand( m_hCombo, nullptr, nullptr );
+		WriteFinishedShaders();
 
 		Combo_GetNext( m_iNextCommand, m_hCombo, m_iEndCommand );
 	}
+
+	Combo_Free( m_hCombo );
 }
 
 //
@@ -1057,7 +1965,7 @@ public:
 	}
 
 public:
-	ProcessCommandRange_Singleton( uint32_t threads, uint32_t flags ) : m_nThreads( threads )
+	ProcessCommandRange_Singleton( uint32_t threads, uint32_t zipThreads, uint32_t flags ) : m_nThreads( threads ), m_nZipThreads( zipThreads )
 	{
 		Assert( !Instance() );
 		Instance() = this;
@@ -1072,7 +1980,8 @@ public:
 	}
 
 public:
-	void ProcessCommandRange( uint64_t shaderStart, uint64_t shaderEnd );
+	// Compiles the entries in order, every shader is written as soon as all of its combos are done
+	void ProcessCommandRange( gsl::span<const CfgProcessor::CfgEntryInfo> arrEntries );
 
 	void Stop();
 	bool Stoped() const { return m_bStopped; }
@@ -1081,7 +1990,7 @@ protected:
 	void Startup( uint32_t flags );
 	void Shutdown();
 
-	using MT = CWorkerAccumState<std::mutex>;
+	using MT = CWorkerAccumState<Threading::CTimedMutex<Threading::g_DispatchLockStats>>;
 	using ST = CWorkerAccumState<Threading::null_mutex>;
 
 	union
@@ -1091,6 +2000,7 @@ protected:
 	};
 
 	const uint32_t m_nThreads;
+	const uint32_t m_nZipThreads;
 	bool m_bStopped = false;
 };
 
@@ -1109,6 +2019,7 @@ void ProcessCommandRange_Singleton::Startup( uint32_t flags )
 		Threading::g_mtxMsgReport.EnableThreadedMode();
 
 		m_MT = new MT( flags );
+		m_MT->StartWorkers( m_nThreads, m_nZipThreads );
 	}
 	else // Otherwise initialize single-threaded mode
 		m_ST = new ST( flags );
@@ -1131,19 +2042,21 @@ void ProcessCommandRange_Singleton::Stop()
 		m_ST->Stop();
 }
 
-void ProcessCommandRange_Singleton::ProcessCommandRange( uint64_t shaderStart, uint64_t shaderEnd )
+void ProcessCommandRange_Singleton::ProcessCommandRange( gsl::span<const CfgProcessor::CfgEntryInfo> arrEntries )
 {
 	if ( m_nThreads > 1 )
 	{
-		m_MT->RangeBegin( shaderStart, shaderEnd );
-		m_MT->Run( m_nThreads );
-		m_MT->RangeFinished();
+		m_MT->RangeBegin( arrEntries );
+		m_MT->Run();
+		m_MT->WriteFinishedShaders();
+		m_MT->ReportCompression();
 	}
 	else
 	{
-		m_ST->RangeBegin( shaderStart, shaderEnd );
+		m_ST->RangeBegin( arrEntries );
 		m_ST->OnProcessST();
-		m_ST->RangeFinished();
+		m_ST->WriteFinishedShaders();
+		m_ST->ReportCompression();
 	}
 }
 
@@ -1214,7 +2127,8 @@ static std::unique_ptr<CfgProcessor::CfgEntryInfo[]> Shared_ParseListOfCompileCo
 	if ( configs.empty() )
 		exit( 0 );
 
-	CfgProcessor::SetupConfiguration( configs, g_pShaderPath, g_bVerbose );
+	if ( !CfgProcessor::SetupConfiguration( configs, g_pShaderPath, g_bVerbose ) )
+		exit( -1 );
 
 	auto arrEntries = CfgProcessor::DescribeConfiguration( bSpewSkips );
 
@@ -1222,8 +2136,9 @@ static std::unique_ptr<CfgProcessor::CfgEntryInfo[]> Shared_ParseListOfCompileCo
 	for ( const CfgProcessor::CfgEntryInfo* pInfo = arrEntries.get(); pInfo && !pInfo->m_szName.empty(); ++pInfo )
 	{
 		numStaticCombos += pInfo->m_numStaticCombos;
-		numCompileCommands = pInfo->m_iCommandEnd;
+		numCompileCommands += pInfo->m_numNonSkippedCombos;
 	}
+	g_nCommandsTotal = numCompileCommands;
 
 	const Clock::time_point tt_end = Clock::now();
 
@@ -1232,42 +2147,34 @@ static std::unique_ptr<CfgProcessor::CfgEntryInfo[]> Shared_ParseListOfCompileCo
 	return arrEntries;
 }
 
-static void CompileShaders( std::unique_ptr<CfgProcessor::CfgEntryInfo[]> arrEntries, uint32_t threads, uint32_t flags )
+static void CompileShaders( std::unique_ptr<CfgProcessor::CfgEntryInfo[]> arrEntries, uint32_t threads, uint32_t zipThreads, uint32_t flags )
 {
-	ProcessCommandRange_Singleton pcr{ threads, flags };
+	ProcessCommandRange_Singleton pcr{ threads, zipThreads, flags };
 
 	//
-	// We will iterate on the cfg entries and process them
+	// Stick the shader info of every entry, shaders are written while later ones are still compiling
 	//
-	for ( const CfgProcessor::CfgEntryInfo* pEntry = arrEntries.get(); pEntry && !pEntry->m_szName.empty(); ++pEntry )
+	size_t nEntries = 0;
+	for ( const CfgProcessor::CfgEntryInfo* pEntry = arrEntries.get(); pEntry && !pEntry->m_szName.empty(); ++pEntry, ++nEntries )
 	{
-		//
-		// Stick the shader info
-		//
 		ShaderInfo_t siLastShaderInfo;
 		memset( &siLastShaderInfo, 0, sizeof( siLastShaderInfo ) );
 
 		Shader_ParseShaderInfoFromCompileCommands( pEntry, siLastShaderInfo );
 
 		g_ShaderToShaderInfo[pEntry->m_szName] = siLastShaderInfo;
-
-		//
-		// Compile stuff
-		//
-		pcr.ProcessCommandRange( pEntry->m_iCommandStart, pEntry->m_iCommandEnd );
-
-		if ( pcr.Stoped() )
-			break;
-
-		//
-		// Now when the whole shader is finished we can write it
-		//
-		WriteShaderFiles( pEntry->m_szName );
 	}
 
+	//
+	// Compile stuff
+	//
+	if ( nEntries )
+		pcr.ProcessCommandRange( { arrEntries.get(), nEntries } );
+
 	std::cout << "\r"sv << clr::escaped( lineRewind ) << endLine;
 }
 
+#ifdef _WIN32
 static LONG WINAPI ExceptionFilter( _EXCEPTION_POINTERS* pExceptionInfo )
 {
 	constexpr const auto iType = static_cast<MINIDUMP_TYPE>( MiniDumpNormal | MiniDumpWithDataSegs | MiniDumpWithIndirectlyReferencedMemory | MiniDumpWithThreadInfo );
@@ -1329,6 +2236,7 @@ static LONG WINAPI ExceptionFilter( _EXCEPTION_POINTERS* pExceptionInfo )
 
 	return EXCEPTION_CONTINUE_SEARCH;
 }
+#endif
 
 static void PrintCompileErrors( bool skipWarnings )
 {
@@ -1408,6 +2316,7 @@ static void PrintCompileErrors( bool skipWarnings )
 }
 
 static bool s_write = true;
+#ifdef _WIN32
 static BOOL WINAPI CtrlHandler( DWORD signal )
 {
 	if ( signal == CTRL_C_EVENT )
@@ -1421,6 +2330,26 @@ static BOOL WINAPI CtrlHandler( DWORD signal )
 
 	return FALSE;
 }
+#else
+// Nothing of the handler is async-signal-safe, SIGINT is blocked in every thread and taken by this one instead,
+// the same as Windows runs the console handler on a thread of its own
+static void CtrlHandler( sigset_t signals )
+{
+	int signal;
+	if ( sigwait( &signals, &signal ) != 0 )
+		return;
+
+	s_write = false;
+	if ( auto inst = ProcessCommandRange_Singleton::Instance() )
+		inst->Stop();
+	PrintCompileErrors( false );
+
+	// Terminate the same way as without the handler
+	std::signal( signal, SIG_DFL );
+	pthread_sigmask( SIG_UNBLOCK, &signals, nullptr );
+	raise( signal );
+}
+#endif
 
 static void WriteStats( bool skipWarnings )
 {
@@ -1445,9 +2374,20 @@ static constexpr const char* const validModels[] =
 	"20b", "30", "40", "41", "50", "51"
 };
 
+static constexpr const char* const validCompress[] =
+{
+	"fast", "default", "max", "auto"
+};
+
+static constexpr const char* const validCompilers[] =
+{
+	"d3dcompile", "external", "mock"
+};
+
 int main( int argc, const char* argv[] )
 {
 	{
+#ifdef _WIN32
 		const HANDLE console = GetStdHandle( STD_OUTPUT_HANDLE );
 		DWORD mode;
 		GetConsoleMode( console, &mode );
@@ -1456,6 +2396,18 @@ int main( int argc, const char* argv[] )
 		else
 			std::cout << clr::nocolorize;
 		SetConsoleCtrlHandler( CtrlHandler, true );
+#else
+		if ( isatty( STDOUT_FILENO ) )
+			std::cout << clr::colorize;
+		else
+			std::cout << clr::nocolorize;
+		// Before any other thread is started, they inherit the mask
+		sigset_t signals;
+		sigemptyset( &signals );
+		sigaddset( &signals, SIGINT );
+		pthread_sigmask( SIG_BLOCK, &signals, nullptr );
+		std::thread( CtrlHandler, signals ).detach();
+#endif
 	}
 
 	bool parseLegacy = false;
@@ -1489,12 +2441,28 @@ int main( int argc, const char* argv[] )
 		cmdLine.add( "", false, 0, 0, "Skip crc check during compilation", "-force", "/force" );
 		cmdLine.add( "", false, 0, 0, "Calculate crc for shader", "-crc", "/crc" );
 		cmdLine.add( "", false, 0, 0, "Generate only header", "-dynamic", "/dynamic" );
+		cmdLine.add( "", false, 0, 0, "Print number of combos left after skips without compiling", "-count", "/count" );
 		cmdLine.add( "", false, 0, 0, "Stop on first error", "-fastfail", "/fastfail" );
 		cmdLine.add( "0", false, 1, 0, "Number of threads used, defaults to core count", "-threads", "/threads" );
+		cmdLine.add( "0", false, 1, 0, "Number of threads compressing finished combos, defaults to the number of threads used", "-compressthreads", "/compressthreads" );
+		cmdLine.add( "2", false, 1, 0, "Store blocks raw without running LZMA when they are not expected to shrink by at least this many percent", "-compressmargin", "/compressmargin" );
+		cmdLine.add( "", false, 1, 0, "Directory keeping compiled combos between runs, unchanged combos are not compiled again", "-cache", "/cache" );
+		cmdLine.add( "4096", false, 1, 0, "Size in MB the compile cache is trimmed to by evicting the least recently used combos", "-cachesize", "/cachesize" );
+		cmdLine.add( "", false, 1, 0, "Shared compile cache server as host[:port], combos found there are kept in the local cache, see -cache", "-remotecache", "/remotecache" );
+		cmdLine.add( "", false, 0, 0, "Compile every combo even when another one has the same preprocessed source", "-nodedup", "/nodedup" );
+		cmdLine.add( "", false, 0, 0, "Report define values that can't change the preprocessed source of a shader, also works with -count", "-analyze", "/analyze" );
+		cmdLine.add( "", false, 0, 0, "Compile combos whose define values can't change the preprocessed source as the combo they match, see -analyze", "-collapse", "/collapse" );
+		cmdLine.add( "d3dcompile", false, 1, 0, "Compiler backend: d3dcompile (Windows only), external runs -compilercmd for every combo, mock makes up bytecode without compiling", "-compiler", "/compiler", new ez::ezOptionValidator{ ez::ezOptionValidator::T, ez::ezOptionValidator::IN, validCompilers, std::size( validCompilers ), false } );
+		cmdLine.add( "", false, 1, 0, "Command line of the external compiler, {file} {entry} {target} {defines} {flags} and {out} are replaced by the source, entry point, shader model, fxc style defines and flags and the file the bytecode has to be written to", "-compilercmd", "/compilercmd" );
+		cmdLine.add( "1000", false, 1, 0, "Average microseconds a mock compile takes", "-mocklatency", "/mocklatency" );
+		cmdLine.add( "4096", false, 1, 0, "Average size in bytes of mock bytecode", "-mocksize", "/mocksize" );
+		cmdLine.add( "50", false, 1, 0, "Percent mock compile times and sizes vary around the average", "-mockspread", "/mockspread" );
+		cmdLine.add( "default", false, 1, 0, "Compression preset: fast, default, max or auto, which samples the first blocks of every shader and keeps the best ratio per CPU time", "-compress", "/compress", new ez::ezOptionValidator{ ez::ezOptionValidator::T, ez::ezOptionValidator::IN, validCompress, std::size( validCompress ), false } );
 		cmdLine.add( "", false, 0, 0, "Shows help", "-help", "-h", "/help", "/h" );
 
 		cmdLine.add( "", false, 0, 0, "Verbose file cache and final shader info", "-verbose", "/verbose" );
 		cmdLine.add( "", false, 0, 0, "Verbose compile commands", "-verbose2", "/verbose2" );
+		cmdLine.add( "", false, 0, 0, "Reports how long compile threads waited for and held the shared locks", "-lockstats", "/lockstats" );
 		cmdLine.add( "", false, 0, 0, "Enables preprocessor debug printing", "-verbose_preprocessor" );
 
 		cmdLine.add( "", false, 0, 0, "Skips shader validation", "/Vd", "-no-validation" );
@@ -1511,10 +2479,16 @@ int main( int argc, const char* argv[] )
 
 	if ( cmdLine.isSet( "-help" ) )
 	{
+#ifdef _WIN32
 		CONSOLE_SCREEN_BUFFER_INFO csbi;
 		GetConsoleScreenBufferInfo( GetStdHandle( STD_OUTPUT_HANDLE ), &csbi );
+		const int width = csbi.srWindow.Right - csbi.srWindow.Left + 1;
+#else
+		winsize ws {};
+		const int width = ioctl( STDOUT_FILENO, TIOCGWINSZ, &ws ) == 0 && ws.ws_col ? ws.ws_col : 80;
+#endif
 		std::string usage;
-		cmdLine.getUsageDescriptions( usage, csbi.srWindow.Right - csbi.srWindow.Left + 1, ez::ezOptionParser::ALIGN );
+		cmdLine.getUsageDescriptions( usage, width, ez::ezOptionParser::ALIGN );
 		std::cout << cmdLine.overview << "\n\n"
 				  << "Usage: "sv << cmdLine.syntax << "\n\n"sv
 				  << clr::green << clr::bold << "OPTIONS:\n"sv
@@ -1711,19 +2685,147 @@ int main( int argc, const char* argv[] )
 		return failed ? -1 : 0;
 	}
 
+	if ( cmdLine.isSet( "-count" ) )
+	{
+		bool failed = false;
+		const auto root = g_pShaderPath.string();
+		std::vector<CfgProcessor::ShaderConfig> configs;
+		for ( const auto& file : files )
+		{
+			CfgProcessor::ShaderConfig conf;
+			if ( !Parser::ParseFile( g_pShaderPath / file.name, root, file.target, file.version, conf ) )
+			{
+				std::cout << clr::red << "Failed to parse "sv << file.name << clr::reset << std::endl;
+				failed = true;
+				continue;
+			}
+			conf.name = Parser::ConstructName( file.name, file.target, file.version );
+			conf.target = file.target;
+			conf.version = file.version;
+			configs.emplace_back( std::move( conf ) );
+		}
+
+		if ( configs.empty() )
+			return failed ? -1 : 0;
+
+		failed |= !CfgProcessor::SetupConfiguration( configs, g_pShaderPath, false );
+		const auto arrEntries = CfgProcessor::DescribeConfiguration( false );
+
+		uint64_t numCombos = 0, numNonSkipped = 0;
+		for ( const CfgProcessor::CfgEntryInfo* pInfo = arrEntries.get(); pInfo && !pInfo->m_szName.empty(); ++pInfo )
+		{
+			const std::vector<uint64_t> arrCounts = CfgProcessor::CountNonSkippedDynamicCombos( *pInfo );
+			const uint64_t numStaticUsed = std::count_if( arrCounts.cbegin(), arrCounts.cend(), []( uint64_t n ) { return n != 0; } );
+			std::cout << clr::green << pInfo->m_szName << clr::reset << ": "sv << clr::blue << PrettyPrint( pInfo->m_numNonSkippedCombos ) << clr::reset << " of "sv << PrettyPrint( pInfo->m_numCombos )
+					  << " combos, "sv << clr::blue << PrettyPrint( numStaticUsed ) << clr::reset << " of "sv << PrettyPrint( pInfo->m_numStaticCombos ) << " static combos"sv << std::endl;
+			numCombos += pInfo->m_numCombos;
+			numNonSkipped += pInfo->m_numNonSkippedCombos;
+		}
+		std::cout << "Total: "sv << clr::green << PrettyPrint( numNonSkipped ) << clr::reset << " of "sv << PrettyPrint( numCombos ) << " combos"sv << std::endl;
+
+		if ( cmdLine.isSet( "-analyze" ) )
+			DefineAnalysis::Analyze( arrEntries.get(), std::thread::hardware_concurrency(), true, false );
+
+		return failed ? -1 : 0;
+	}
+
 	g_bVerbose = cmdLine.isSet( "-verbose" );
 	g_bVerbose2 = cmdLine.isSet( "-verbose2" );
+	g_bLockStats = cmdLine.isSet( "-lockstats" );
 	g_bFastFail = cmdLine.isSet( "-fastfail" );
 
+	{
+		std::string compiler = "d3dcompile";
+		if ( !parseLegacy )
+			cmdLine.get( "-compiler" )->getString( compiler );
+
+		std::unique_ptr<Compiler::IBackend> pBackend;
+		if ( compiler == "external"sv )
+		{
+			std::string commandLine;
+			cmdLine.get( "-compilercmd" )->getString( commandLine );
+			if ( !( pBackend = Compiler::CreateExternalCompiler( commandLine, g_pShaderPath ) ) )
+			{
+				std::cout << clr::red << clr::bold << "ERROR: -compilercmd needs at least {file} and {out}"sv << clr::reset << std::endl;
+				return -1;
+			}
+		}
+		else if ( compiler == "mock"sv )
+		{
+			unsigned long latency = 1000, size = 4096, spread = 50;
+			cmdLine.get( "-mocklatency" )->getULong( latency );
+			cmdLine.get( "-mocksize" )->getULong( size );
+			cmdLine.get( "-mockspread" )->getULong( spread );
+			pBackend = Compiler::CreateMockCompiler( { gsl::narrow_cast<uint32_t>( latency ), gsl::narrow_cast<uint32_t>( size ), gsl::narrow_cast<uint32_t>( spread ) } );
+		}
+		else if ( !( pBackend = Compiler::CreateD3DCompiler() ) )
+		{
+			std::cout << clr::red << clr::bold << "ERROR: D3DCompile is only available on Windows, pick another backend with -compiler"sv << clr::reset << std::endl;
+			return -1;
+		}
+		Compiler::SetBackend( std::move( pBackend ) );
+	}
+
+	if ( !parseLegacy )
+	{
+		std::string compress;
+		cmdLine.get( "-compress" )->getString( compress );
+		g_bCompressAuto = compress == "auto"sv;
+		if ( compress == "fast"sv )
+			g_eCompressPreset = LZMA::Preset::Fast;
+		else if ( compress == "max"sv )
+			g_eCompressPreset = LZMA::Preset::Max;
+
+		unsigned long margin = 2;
+		cmdLine.get( "-compressmargin" )->getULong( margin );
+		g_flCompressMargin = std::min( margin, 100UL ) / 100.0;
+
+		CompileCache::SetDedup( !cmdLine.isSet( "-nodedup" ) );
+
+		// The remote cache reads through a local one, a temporary one unless told otherwise
+		if ( cmdLine.isSet( "-cache" ) || cmdLine.isSet( "-remotecache" ) )
+		{
+			std::string cacheDir;
+			if ( cmdLine.isSet( "-cache" ) )
+				cmdLine.get( "-cache" )->getString( cacheDir );
+			else
+			{
+				std::error_code c;
+				cacheDir = ( fs::temp_directory_path( c ) / "ShaderCompileCache"sv ).string();
+			}
+			unsigned long cacheSize = 4096;
+			cmdLine.get( "-cachesize" )->getULong( cacheSize );
+			CompileCache::Init( cacheDir, static_cast<uint64_t>( cacheSize ) << 20 );
+		}
+		if ( cmdLine.isSet( "-remotecache" ) )
+		{
+			std::string remote;
+			cmdLine.get( "-remotecache" )->getString( remote );
+			CompileCache::InitRemote( remote );
+		}
+	}
+
+#ifdef _WIN32
 	// Setting up the minidump handlers
 	SetUnhandledExceptionFilter( ExceptionFilter );
 	SetThreadExecutionState( ES_CONTINUOUS | ES_SYSTEM_REQUIRED );
+#endif
 
 	auto entries = Shared_ParseListOfCompileCommands( std::move( files ), cmdLine.isSet( "-force" ), cmdLine.isSet( "-verbose_preprocessor" ), isCSGO );
 
 	unsigned long threads = 0;
 	cmdLine.get( "-threads" )->getULong( threads );
-	CompileShaders( std::move( entries ), threads ? threads : std::thread::hardware_concurrency(), flags );
+	if ( !threads )
+		threads = std::thread::hardware_concurrency();
+	unsigned long zipThreads = 0;
+	if ( !parseLegacy )
+	{
+		cmdLine.get( "-compressthreads" )->getULong( zipThreads );
+		if ( cmdLine.isSet( "-analyze" ) || cmdLine.isSet( "-collapse" ) )
+			DefineAnalysis::Analyze( entries.get(), threads, cmdLine.isSet( "-analyze" ), cmdLine.isSet( "-collapse" ) );
+	}
+	CompileShaders( std::move( entries ), threads, zipThreads ? zipThreads : threads, flags );
+	CompileCache::Shutdown();
 
 	WriteStats( parseLegacy );
 
@@ -1745,7 +2847,9 @@ int main( int argc, const char* argv[] )
 		}
 	}
 
+#ifdef _WIN32
 	SetThreadExecutionState( ES_CONTINUOUS );
+#endif
 
 	return gsl::narrow_cast<int>( g_ShaderHadError.size() );
 }
\ No newline at end of file
@@ -20,4 +20,16 @@
 #endif
 #define _strupr_s strupr
 #define _strdup strdup
+#define _stricmp strcasecmp
+
+#include <cctype>
+#include <cstring>
+#include <strings.h>
+
+inline char* strupr( char* str )
+{
+	for ( char* p = str; *p; ++p )
+		*p = static_cast<char>( toupper( static_cast<unsigned char>( *p ) ) );
+	return str;
+}
 #endif
\ No newline at end of file
@@ -0,0 +1,179 @@
+#pragma once
+
+// Wire format of the remote compile cache, shared by the client and the reference server.
+// A connection carries any number of requests, all integers are little endian:
+//   'G' u32 count, count * u64 hash    -> count * ( u32 size, size bytes ), size is 0 when the server doesn't have it
+//   'P' u64 hash, u32 size, size bytes -> no reply
+// Replies come in request order, so a client can keep sending without waiting for them.
+// Values are opaque to the server, the client verifies what it gets back.
+
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#pragma comment( lib, "ws2_32" )
+#else
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+namespace CacheProtocol
+{
+	static constexpr uint16_t DEFAULT_PORT	= 27450;
+	static constexpr uint8_t OP_GET			= 'G';
+	static constexpr uint8_t OP_PUT			= 'P';
+	static constexpr uint32_t MAX_BATCH		= 4096;		// Hashes in one lookup
+	static constexpr uint32_t MAX_VALUE		= 64 << 20;	// Bytes in one value
+
+#ifdef _WIN32
+	using Socket = SOCKET;
+	static constexpr Socket INVALID = INVALID_SOCKET;
+	static constexpr int SEND_FLAGS = 0;
+
+	static inline bool Startup()
+	{
+		WSADATA wsaData;
+		return WSAStartup( MAKEWORD( 2, 2 ), &wsaData ) == 0;
+	}
+	static inline void CloseSocket( Socket s ) { closesocket( s ); }
+	static inline void ShutdownSocket( Socket s ) { shutdown( s, SD_BOTH ); }
+	static inline void SetBlocking( Socket s, bool bBlocking )
+	{
+		u_long nNonBlocking = !bBlocking;
+		ioctlsocket( s, FIONBIO, &nNonBlocking );
+	}
+	static inline void SetTimeout( Socket s, uint32_t nMs )
+	{
+		const DWORD nTimeout = nMs;
+		setsockopt( s, SOL_SOCKET, SO_RCVTIMEO, reinterpret_cast<const char*>( &nTimeout ), sizeof( nTimeout ) );
+		setsockopt( s, SOL_SOCKET, SO_SNDTIMEO, reinterpret_cast<const char*>( &nTimeout ), sizeof( nTimeout ) );
+	}
+	static inline bool WaitWritable( Socket s, uint32_t nMs )
+	{
+		WSAPOLLFD pfd { s, POLLOUT, 0 };
+		return WSAPoll( &pfd, 1, static_cast<INT>( nMs ) ) == 1;
+	}
+	using PollFd = WSAPOLLFD;
+	static inline int Poll( PollFd* pFds, size_t nFds, int nMs ) { return WSAPoll( pFds, static_cast<ULONG>( nFds ), nMs ); }
+#else
+	using Socket = int;
+	static constexpr Socket INVALID = -1;
+	static constexpr int SEND_FLAGS = MSG_NOSIGNAL;
+
+	static inline bool Startup() { return true; }
+	static inline void CloseSocket( Socket s ) { close( s ); }
+	static inline void ShutdownSocket( Socket s ) { shutdown( s, SHUT_RDWR ); }
+	static inline void SetBlocking( Socket s, bool bBlocking )
+	{
+		const int nFlags = fcntl( s, F_GETFL, 0 );
+		fcntl( s, F_SETFL, bBlocking ? nFlags & ~O_NONBLOCK : nFlags | O_NONBLOCK );
+	}
+	static inline void SetTimeout( Socket s, uint32_t nMs )
+	{
+		const timeval timeout { static_cast<time_t>( nMs / 1000 ), static_cast<suseconds_t>( nMs % 1000 * 1000 ) };
+		setsockopt( s, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof( timeout ) );
+		setsockopt( s, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof( timeout ) );
+	}
+	static inline bool WaitWritable( Socket s, uint32_t nMs )
+	{
+		pollfd pfd { s, POLLOUT, 0 };
+		return poll( &pfd, 1, static_cast<int>( nMs ) ) == 1;
+	}
+	using PollFd = pollfd;
+	static inline int Poll( PollFd* pFds, size_t nFds, int nMs ) { return poll( pFds, static_cast<nfds_t>( nFds ), nMs ); }
+#endif
+
+	// Small requests go out right away, replies are waited on by the other side
+	static inline void SetNoDelay( Socket s )
+	{
+		const int nNoDelay = 1;
+		setsockopt( s, IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<const char*>( &nNoDelay ), sizeof( nNoDelay ) );
+	}
+
+	static inline bool SendAll( Socket s, const void* pData, size_t nSize )
+	{
+		const char* p = static_cast<const char*>( pData );
+		while ( nSize )
+		{
+			const int nSent = send( s, p, static_cast<int>( std::min<size_t>( nSize, 1 << 30 ) ), SEND_FLAGS );
+			if ( nSent <= 0 )
+				return false;
+			p += nSent;
+			nSize -= nSent;
+		}
+		return true;
+	}
+
+	static inline bool RecvAll( Socket s, void* pData, size_t nSize )
+	{
+		char* p = static_cast<char*>( pData );
+		while ( nSize )
+		{
+			const int nGot = recv( s, p, static_cast<int>( std::min<size_t>( nSize, 1 << 30 ) ), 0 );
+			if ( nGot <= 0 )
+				return false;
+			p += nGot;
+			nSize -= nGot;
+		}
+		return true;
+	}
+
+	// Splits "host:port", the port is optional
+	static inline void ParseAddress( const std::string& address, std::string& host, uint16_t& nPort )
+	{
+		const size_t nColon = address.rfind( ':' );
+		host  = address.substr( 0, nColon );
+		nPort = nColon == std::string::npos ? DEFAULT_PORT : static_cast<uint16_t>( std::stoul( address.substr( nColon + 1 ) ) );
+	}
+
+	// Gives up after nTimeoutMs per address instead of the long system timeout, an unreachable server must not stall the build
+	static inline Socket Connect( const std::string& host, uint16_t nPort, uint32_t nTimeoutMs )
+	{
+		addrinfo hints {};
+		hints.ai_family   = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		hints.ai_protocol = IPPROTO_TCP;
+		addrinfo* pResult = nullptr;
+		if ( getaddrinfo( host.c_str(), std::to_string( nPort ).c_str(), &hints, &pResult ) != 0 )
+			return INVALID;
+
+		Socket s = INVALID;
+		for ( const addrinfo* pAddr = pResult; pAddr && s == INVALID; pAddr = pAddr->ai_next )
+		{
+			s = socket( pAddr->ai_family, pAddr->ai_socktype, pAddr->ai_protocol );
+			if ( s == INVALID )
+				continue;
+
+			SetBlocking( s, false );
+			const bool bConnected = connect( s, pAddr->ai_addr, static_cast<int>( pAddr->ai_addrlen ) ) == 0 || WaitWritable( s, nTimeoutMs );
+			int nError = 0;
+			socklen_t nErrorSize = sizeof( nError );
+			if ( !bConnected || getsockopt( s, SOL_SOCKET, SO_ERROR, reinterpret_cast<char*>( &nError ), &nErrorSize ) != 0 || nError )
+			{
+				CloseSocket( s );
+				s = INVALID;
+				continue;
+			}
+			SetBlocking( s, true );
+			SetNoDelay( s );
+		}
+
+		freeaddrinfo( pResult );
+		return s;
+	}
+} // namespace CacheProtocol
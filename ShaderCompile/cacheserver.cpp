@@ -0,0 +1,293 @@
+// Reference server of the remote compile cache, see cacheprotocol.hpp.
+// Keeps every value as a file below one directory, like the local cache of the compiler does.
+// Usage: ShaderCompileCacheServer <directory> [port]
+
+#include "cacheprotocol.hpp"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace std::literals;
+namespace fs = std::filesystem;
+
+static constexpr size_t SEND_CHUNK_SIZE    = 1 << 20; // Replies of a lookup go out in pieces of about this size
+static constexpr uint32_t NUM_WORKERS       = 64;     // Connections served at once, idle ones only wait in the poll loop
+static constexpr uint32_t IO_TIMEOUT_MS     = 30000;  // A client stuck halfway through a request frees its worker after this
+
+static fs::path s_Dir;
+static uint32_t s_nInstance = 0;
+static std::atomic<uint32_t> s_nTmp;
+
+static std::mutex s_Mutex;
+static std::condition_variable s_cvReady;
+static std::deque<CacheProtocol::Socket> s_Ready;     // Connections with a request waiting, for the workers
+static std::vector<CacheProtocol::Socket> s_Returned; // Served connections going back to the poll loop
+static CacheProtocol::Socket s_WakeSend = CacheProtocol::INVALID; // Tells the poll loop about returned connections
+static CacheProtocol::Socket s_WakeRecv = CacheProtocol::INVALID;
+
+static fs::path ValuePath( uint64_t nHash )
+{
+	char szName[17];
+	snprintf( szName, sizeof( szName ), "%016llx", static_cast<unsigned long long>( nHash ) );
+	return s_Dir / std::string_view( szName, 2 ) / szName;
+}
+
+static void ReadValue( uint64_t nHash, std::vector<char>& reply )
+{
+	const size_t nSizeAt = reply.size();
+	uint32_t nSize       = 0;
+	reply.resize( nSizeAt + sizeof( nSize ) );
+
+	if ( std::ifstream file{ ValuePath( nHash ), std::ios::binary | std::ios::ate } )
+	{
+		const std::streamoff nFileSize = file.tellg();
+		if ( nFileSize > 0 && nFileSize <= CacheProtocol::MAX_VALUE )
+		{
+			reply.resize( nSizeAt + sizeof( nSize ) + nFileSize );
+			file.seekg( 0, std::ios::beg );
+			if ( file.read( reply.data() + nSizeAt + sizeof( nSize ), nFileSize ) )
+				nSize = static_cast<uint32_t>( nFileSize );
+			else
+				reply.resize( nSizeAt + sizeof( nSize ) );
+		}
+	}
+
+	memcpy( reply.data() + nSizeAt, &nSize, sizeof( nSize ) );
+}
+
+// Written under a name of its own first, readers never see a partial value
+static void WriteValue( uint64_t nHash, const std::vector<char>& value )
+{
+	const fs::path path = ValuePath( nHash );
+	fs::path tmpPath    = path;
+	tmpPath += "."s + std::to_string( s_nInstance ) + "_"s + std::to_string( s_nTmp++ ) + ".tmp"s;
+
+	std::error_code c;
+	fs::create_directories( path.parent_path(), c );
+	{
+		std::ofstream file( tmpPath, std::ios::binary | std::ios::trunc );
+		if ( !file.write( value.data(), value.size() ) )
+		{
+			file.close();
+			fs::remove( tmpPath, c );
+			return;
+		}
+	}
+
+	fs::rename( tmpPath, path, c );
+	if ( c )
+		fs::remove( tmpPath, c );
+}
+
+static bool HasInput( CacheProtocol::Socket s )
+{
+	CacheProtocol::PollFd pfd { s, POLLIN, 0 };
+	return CacheProtocol::Poll( &pfd, 1, 0 ) == 1;
+}
+
+// Serves requests as long as the client keeps sending them, false once the connection is done
+static bool ServeRequests( CacheProtocol::Socket s, std::vector<uint64_t>& hashes, std::vector<char>& buffer )
+{
+	do
+	{
+		uint8_t nOp;
+		if ( !CacheProtocol::RecvAll( s, &nOp, sizeof( nOp ) ) )
+			return false;
+
+		if ( nOp == CacheProtocol::OP_GET )
+		{
+			uint32_t nCount;
+			if ( !CacheProtocol::RecvAll( s, &nCount, sizeof( nCount ) ) || nCount > CacheProtocol::MAX_BATCH )
+				return false;
+			hashes.resize( nCount );
+			if ( !CacheProtocol::RecvAll( s, hashes.data(), nCount * sizeof( uint64_t ) ) )
+				return false;
+
+			// Sent as they are read, a batch of big values is never held at once
+			buffer.clear();
+			for ( size_t i = 0; i < hashes.size(); ++i )
+			{
+				ReadValue( hashes[i], buffer );
+				if ( buffer.size() >= SEND_CHUNK_SIZE || i + 1 == hashes.size() )
+				{
+					if ( !CacheProtocol::SendAll( s, buffer.data(), buffer.size() ) )
+						return false;
+					buffer.clear();
+				}
+			}
+		}
+		else if ( nOp == CacheProtocol::OP_PUT )
+		{
+			uint64_t nHash;
+			uint32_t nSize;
+			if ( !CacheProtocol::RecvAll( s, &nHash, sizeof( nHash ) ) || !CacheProtocol::RecvAll( s, &nSize, sizeof( nSize ) ) || nSize > CacheProtocol::MAX_VALUE )
+				return false;
+			buffer.resize( nSize );
+			if ( !CacheProtocol::RecvAll( s, buffer.data(), nSize ) )
+				return false;
+			if ( nSize )
+				WriteValue( nHash, buffer );
+		}
+		else
+			return false;
+	} while ( HasInput( s ) );
+	return true;
+}
+
+static void DoWork()
+{
+	std::vector<uint64_t> hashes;
+	std::vector<char> buffer;
+	for ( ;; )
+	{
+		CacheProtocol::Socket s;
+		{
+			std::unique_lock guard{ s_Mutex };
+			s_cvReady.wait( guard, [] { return !s_Ready.empty(); } );
+			s = s_Ready.front();
+			s_Ready.pop_front();
+		}
+
+		if ( !ServeRequests( s, hashes, buffer ) )
+		{
+			CacheProtocol::CloseSocket( s );
+			continue;
+		}
+
+		std::lock_guard guard{ s_Mutex };
+		s_Returned.emplace_back( s );
+		const char chWake = 0;
+		CacheProtocol::SendAll( s_WakeSend, &chWake, sizeof( chWake ) );
+	}
+}
+
+static CacheProtocol::Socket Listen( uint32_t nAddress, uint16_t nPort )
+{
+	const CacheProtocol::Socket listener = socket( AF_INET, SOCK_STREAM, IPPROTO_TCP );
+	if ( listener == CacheProtocol::INVALID )
+		return listener;
+	const int nReuse = 1;
+	setsockopt( listener, SOL_SOCKET, SO_REUSEADDR, reinterpret_cast<const char*>( &nReuse ), sizeof( nReuse ) );
+
+	sockaddr_in addr {};
+	addr.sin_family      = AF_INET;
+	addr.sin_addr.s_addr = htonl( nAddress );
+	addr.sin_port        = htons( nPort );
+	if ( bind( listener, reinterpret_cast<const sockaddr*>( &addr ), sizeof( addr ) ) != 0 || listen( listener, SOMAXCONN ) != 0 )
+	{
+		CacheProtocol::CloseSocket( listener );
+		return CacheProtocol::INVALID;
+	}
+	return listener;
+}
+
+// Loopback connection whose only job is waking up the poll loop, sockets are all it can wait for everywhere
+static bool CreateWakeSockets()
+{
+	const CacheProtocol::Socket listener = Listen( INADDR_LOOPBACK, 0 );
+	sockaddr_in addr {};
+	socklen_t nAddrSize = sizeof( addr );
+	if ( listener == CacheProtocol::INVALID || getsockname( listener, reinterpret_cast<sockaddr*>( &addr ), &nAddrSize ) != 0 )
+		return false;
+
+	s_WakeSend = CacheProtocol::Connect( "127.0.0.1", ntohs( addr.sin_port ), 2000 );
+	s_WakeRecv = s_WakeSend != CacheProtocol::INVALID ? accept( listener, nullptr, nullptr ) : CacheProtocol::INVALID;
+	CacheProtocol::CloseSocket( listener );
+	return s_WakeRecv != CacheProtocol::INVALID;
+}
+
+int main( int argc, const char* argv[] )
+{
+	if ( argc < 2 )
+	{
+		std::cout << "Usage: "sv << argv[0] << " <directory> [port]"sv << std::endl;
+		return 1;
+	}
+
+	s_Dir       = argv[1];
+	s_nInstance = std::random_device {}();
+	const uint16_t nPort = argc > 2 ? static_cast<uint16_t>( std::stoul( argv[2] ) ) : CacheProtocol::DEFAULT_PORT;
+
+	std::error_code c;
+	fs::create_directories( s_Dir, c );
+	if ( c )
+	{
+		std::cout << "Can't create "sv << s_Dir << ": "sv << c.message() << std::endl;
+		return 1;
+	}
+
+	if ( !CacheProtocol::Startup() )
+		return 1;
+
+	const CacheProtocol::Socket listener = Listen( INADDR_ANY, nPort );
+	if ( listener == CacheProtocol::INVALID )
+	{
+		std::cout << "Can't listen on port "sv << nPort << std::endl;
+		return 1;
+	}
+	if ( !CreateWakeSockets() )
+	{
+		std::cout << "Can't create the loopback connection of the poll loop"sv << std::endl;
+		return 1;
+	}
+
+	for ( uint32_t i = 0; i < NUM_WORKERS; ++i )
+		std::thread( DoWork ).detach();
+
+	// Idle connections wait here, one with a request goes to a worker until the client stops sending
+	std::vector<CacheProtocol::PollFd> arrFds { { listener, POLLIN, 0 }, { s_WakeRecv, POLLIN, 0 } };
+	std::cout << "Serving "sv << s_Dir << " on port "sv << nPort << std::endl;
+	for ( ;; )
+	{
+		if ( CacheProtocol::Poll( arrFds.data(), arrFds.size(), -1 ) <= 0 )
+			continue;
+
+		bool bReady = false;
+		for ( size_t i = arrFds.size() - 1; i >= 2; --i )
+		{
+			if ( !arrFds[i].revents )
+				continue;
+			{
+				std::lock_guard guard{ s_Mutex };
+				s_Ready.emplace_back( arrFds[i].fd );
+			}
+			arrFds[i] = arrFds.back();
+			arrFds.pop_back();
+			bReady = true;
+		}
+		if ( bReady )
+			s_cvReady.notify_all();
+
+		if ( arrFds[1].revents )
+		{
+			char chWake[256];
+			recv( s_WakeRecv, chWake, sizeof( chWake ), 0 );
+
+			std::lock_guard guard{ s_Mutex };
+			for ( const CacheProtocol::Socket s : s_Returned )
+				arrFds.emplace_back( CacheProtocol::PollFd { s, POLLIN, 0 } );
+			s_Returned.clear();
+		}
+
+		if ( arrFds[0].revents )
+		{
+			const CacheProtocol::Socket client = accept( listener, nullptr, nullptr );
+			if ( client != CacheProtocol::INVALID )
+			{
+				CacheProtocol::SetNoDelay( client );
+				CacheProtocol::SetTimeout( client, IO_TIMEOUT_MS );
+				arrFds.emplace_back( CacheProtocol::PollFd { client, POLLIN, 0 } );
+			}
+		}
+	}
+}
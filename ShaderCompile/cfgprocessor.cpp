@@ -15,6 +15,7 @@
 
 #include "cfgprocessor.h"
 #include "d3dxfxc.h"
+#include "exprprogram.h"
 
 #include "utlbuffer.h"
 #include <algorithm>
@@ -22,7 +23,6 @@
 #include <cstdarg>
 #include <ctime>
 #include <filesystem>
-#include <map>
 #include <numeric>
 #include <set>
 #include <string>
@@ -58,6 +58,9 @@ public:
 	explicit Define( const std::string& szName, int min, int max, bool bStatic )
 		: m_sName( szName ), m_min( min ), m_max( max ), m_bStatic( bStatic )
 	{
+		m_arrValues.reserve( static_cast<size_t>( max - min ) + 1 );
+		for ( int i = min; i <= max; ++i )
+			m_arrValues.emplace_back( std::to_string( i ) );
 	}
 
 public:
@@ -65,9 +68,12 @@ public:
 	[[nodiscard]] int Min() const noexcept { return m_min; }
 	[[nodiscard]] int Max() const noexcept { return m_max; }
 	[[nodiscard]] bool IsStatic() const noexcept { return m_bStatic; }
+	// Text of a value, used for the compile command defines
+	[[nodiscard]] const std::string& ValueName( int nValue ) const noexcept { return m_arrValues[nValue - m_min]; }
 
 protected:
 	std::string m_sName;
+	std::vector<std::string> m_arrValues;
 	int m_min, m_max;
 	bool m_bStatic;
 };
@@ -87,6 +93,21 @@ public:
 	virtual int GetVariableSlot( const std::string& szVariableName ) const noexcept	= 0;
 };
 
+// Context over raw slot values, names are looked up in the owning context
+class CSlotValuesContext : public IEvaluationContext
+{
+public:
+	CSlotValuesContext( const IEvaluationContext* pNames, const int* pnValues ) noexcept : m_pNames( pNames ), m_pnValues( pnValues ) {}
+
+	int GetVariableValue( int nSlot ) const noexcept override { return m_pnValues[nSlot]; }
+	const std::string& GetVariableName( int nSlot ) const noexcept override { return m_pNames->GetVariableName( nSlot ); }
+	int GetVariableSlot( const std::string& szVariableName ) const noexcept override { return m_pNames->GetVariableSlot( szVariableName ); }
+
+private:
+	const IEvaluationContext* m_pNames;
+	const int* m_pnValues;
+};
+
 class IExpression
 {
 public:
@@ -95,12 +116,19 @@ public:
 	virtual void Print( const IEvaluationContext* pCtx ) const										= 0;
 	virtual std::string Build( const std::string& pPrefix, const IEvaluationContext* pCtx ) const	= 0;
 	virtual bool IsValid() const																	= 0;
+	virtual void Emit( CExprProgram& program ) const												= 0;
+	// Evaluation stack slots the emitted program needs
+	virtual int Depth() const noexcept { return 1; }
+
+	// Splits the expression into terms joined by top-level ||
+	virtual void Disjuncts( std::vector<const IExpression*>& arrOut ) const { arrOut.emplace_back( this ); }
 };
 
 #define EVAL int Evaluate( [[maybe_unused]] const IEvaluationContext* pCtx ) const noexcept override
 #define PRNT void Print( [[maybe_unused]] const IEvaluationContext* pCtx ) const override
 #define BUILD std::string Build( [[maybe_unused]] const std::string& pPrefix, [[maybe_unused]] const IEvaluationContext* pCtx ) const override
 #define CHECK bool IsValid() const override
+#define EMIT void Emit( CExprProgram& program ) const override
 
 class CExprConstant : public IExpression
 {
@@ -119,6 +147,10 @@ public:
 	{
 		return true;
 	}
+	EMIT
+	{
+		program.EmitConst( m_value );
+	}
 
 private:
 	int m_value;
@@ -147,6 +179,10 @@ public:
 	{
 		return m_nSlot >= 0;
 	}
+	EMIT
+	{
+		program.EmitVar( m_nSlot );
+	}
 
 private:
 	int m_nSlot;
@@ -156,6 +192,7 @@ class CExprUnary : public IExpression
 {
 public:
 	CExprUnary( IExpression* x ) : m_x( x ) {}
+	int Depth() const noexcept override { return m_x->Depth(); }
 
 protected:
 	IExpression* m_x;
@@ -187,6 +224,11 @@ BEGIN_EXPR_UNARY( CExprUnary_Negate )
 	{
 		return m_x->IsValid();
 	}
+	EMIT
+	{
+		m_x->Emit( program );
+		program.EmitOp( CExprProgram::Op::Not );
+	}
 END_EXPR_UNARY()
 
 class CExprBinary : public IExpression
@@ -203,7 +245,31 @@ public:
 	{
 		return m_x->IsValid() && m_y->IsValid();
 	}
+	// Comparisons, the deeper operand goes first so nesting on either side costs at most one more slot
+	int Depth() const noexcept override
+	{
+		const int nX = m_x->Depth();
+		const int nY = m_y->Depth();
+		return std::max( nX, nY ) + ( nX == nY );
+	}
+
 protected:
+	void EmitOperands( CExprProgram& program, CExprProgram::Op op, CExprProgram::Op opSwapped ) const
+	{
+		if ( m_y->Depth() > m_x->Depth() )
+		{
+			m_y->Emit( program );
+			m_x->Emit( program );
+			program.EmitOp( opSwapped );
+		}
+		else
+		{
+			m_x->Emit( program );
+			m_y->Emit( program );
+			program.EmitOp( op );
+		}
+	}
+
 	IExpression* m_x;
 	IExpression* m_y;
 };
@@ -234,6 +300,18 @@ BEGIN_EXPR_BINARY( CExprBinary_And )
 	{
 		return "( " + m_x->Build( pPrefix, pCtx ) + " && " + m_y->Build( pPrefix, pCtx ) + " )";
 	}
+	EMIT
+	{
+		m_x->Emit( program );
+		const size_t nJump = program.EmitJump( CExprProgram::Op::JumpIfFalse );
+		m_y->Emit( program );
+		program.EmitOp( CExprProgram::Op::Bool );
+		program.PatchJump( nJump );
+	}
+	int Depth() const noexcept override
+	{
+		return std::max( m_x->Depth(), m_y->Depth() );
+	}
 	EXPR_BINARY_PRIORITY( 1 );
 END_EXPR_BINARY()
 
@@ -254,6 +332,23 @@ BEGIN_EXPR_BINARY( CExprBinary_Or )
 	{
 		return "( " + m_x->Build( pPrefix, pCtx ) + " || " + m_y->Build( pPrefix, pCtx ) + " )";
 	}
+	EMIT
+	{
+		m_x->Emit( program );
+		const size_t nJump = program.EmitJump( CExprProgram::Op::JumpIfTrue );
+		m_y->Emit( program );
+		program.EmitOp( CExprProgram::Op::Bool );
+		program.PatchJump( nJump );
+	}
+	int Depth() const noexcept override
+	{
+		return std::max( m_x->Depth(), m_y->Depth() );
+	}
+	void Disjuncts( std::vector<const IExpression*>& arrOut ) const override
+	{
+		m_x->Disjuncts( arrOut );
+		m_y->Disjuncts( arrOut );
+	}
 	EXPR_BINARY_PRIORITY( 2 );
 END_EXPR_BINARY()
 
@@ -274,6 +369,10 @@ BEGIN_EXPR_BINARY( CExprBinary_Eq )
 	{
 		return "( " + m_x->Build( pPrefix, pCtx ) + " == " + m_y->Build( pPrefix, pCtx ) + " )";
 	}
+	EMIT
+	{
+		EmitOperands( program, CExprProgram::Op::Eq, CExprProgram::Op::Eq );
+	}
 	EXPR_BINARY_PRIORITY( 0 );
 END_EXPR_BINARY()
 
@@ -294,6 +393,10 @@ BEGIN_EXPR_BINARY( CExprBinary_Neq )
 	{
 		return "( " + m_x->Build( pPrefix, pCtx ) + " != " + m_y->Build( pPrefix, pCtx ) + " )";
 	}
+	EMIT
+	{
+		EmitOperands( program, CExprProgram::Op::Neq, CExprProgram::Op::Neq );
+	}
 	EXPR_BINARY_PRIORITY( 0 );
 END_EXPR_BINARY()
 
@@ -314,6 +417,10 @@ BEGIN_EXPR_BINARY( CExprBinary_G )
 	{
 		return "( " + m_x->Build( pPrefix, pCtx ) + " > " + m_y->Build( pPrefix, pCtx ) + " )";
 	}
+	EMIT
+	{
+		EmitOperands( program, CExprProgram::Op::G, CExprProgram::Op::L );
+	}
 	EXPR_BINARY_PRIORITY( 0 );
 END_EXPR_BINARY()
 
@@ -334,6 +441,10 @@ BEGIN_EXPR_BINARY( CExprBinary_Ge )
 	{
 		return "( " + m_x->Build( pPrefix, pCtx ) + " >= " + m_y->Build( pPrefix, pCtx ) + " )";
 	}
+	EMIT
+	{
+		EmitOperands( program, CExprProgram::Op::Ge, CExprProgram::Op::Le );
+	}
 	EXPR_BINARY_PRIORITY( 0 );
 END_EXPR_BINARY()
 
@@ -354,6 +465,10 @@ BEGIN_EXPR_BINARY( CExprBinary_L )
 	{
 		return "( " + m_x->Build( pPrefix, pCtx ) + " < " + m_y->Build( pPrefix, pCtx ) + " )";
 	}
+	EMIT
+	{
+		EmitOperands( program, CExprProgram::Op::L, CExprProgram::Op::G );
+	}
 	EXPR_BINARY_PRIORITY( 0 );
 END_EXPR_BINARY()
 
@@ -374,6 +489,10 @@ BEGIN_EXPR_BINARY( CExprBinary_Le )
 	{
 		return "( " + m_x->Build( pPrefix, pCtx ) + " <= " + m_y->Build( pPrefix, pCtx ) + " )";
 	}
+	EMIT
+	{
+		EmitOperands( program, CExprProgram::Op::Le, CExprProgram::Op::Ge );
+	}
 	EXPR_BINARY_PRIORITY( 0 );
 END_EXPR_BINARY()
 
@@ -410,6 +529,56 @@ public:
 	{
 		return m_pRoot && m_pRoot != m_pDefFalse && m_pRoot->IsValid();
 	}
+	EMIT
+	{
+		if ( m_pRoot )
+			m_pRoot->Emit( program );
+		else
+			program.EmitConst( 0 );
+	}
+	int Depth() const noexcept override
+	{
+		return m_pRoot ? m_pRoot->Depth() : 1;
+	}
+
+	void Disjuncts( std::vector<const IExpression*>& arrOut ) const override
+	{
+		if ( m_pRoot )
+			m_pRoot->Disjuncts( arrOut );
+	}
+
+	// Evaluates the compiled program over raw slot values, the tree is only walked if the program could not be built
+	[[nodiscard]] int Evaluate( const int* pnValues ) const noexcept
+	{
+		if ( m_program.IsValid() )
+			return m_program.Evaluate( pnValues );
+
+		const CSlotValuesContext ctx( m_pContext, pnValues );
+		return Evaluate( &ctx );
+	}
+
+	// Groups the top-level || terms by the lowest slot they read. Terms of level N only depend
+	// on slots N and above, so they can reject a whole block of combos of the lower slots at once.
+	void BuildPrefixPrograms( size_t nSlots );
+	[[nodiscard]] bool CanPrune() const noexcept { return !m_arrPrefixPrograms.empty(); }
+	[[nodiscard]] int EvaluatePrefix( size_t nLevel, const int* pnValues ) const noexcept
+	{
+		const CExprProgram& program = m_arrPrefixPrograms[nLevel];
+		return program.Size() ? program.Evaluate( pnValues ) : 0;
+	}
+	[[nodiscard]] bool HasPrefix( size_t nLevel ) const noexcept { return m_arrPrefixPrograms[nLevel].Size() != 0; }
+	[[nodiscard]] bool EvaluatePrefixBatch( size_t nLevel, const int* pnLanes, uint32_t& rnMask ) const noexcept
+	{
+		return m_arrPrefixPrograms[nLevel].EvaluateBatch( pnLanes, rnMask );
+	}
+
+	// Top-level || term together with the slots it reads, combo counting works on these
+	struct Term
+	{
+		CExprProgram m_program;
+		std::vector<int> m_arrSlots;
+	};
+	[[nodiscard]] const std::vector<Term>& Terms() const noexcept { return m_arrTerms; }
 
 protected:
 	IExpression* ParseTopLevel( char*& szExpression );
@@ -426,6 +595,9 @@ protected:
 	std::vector<std::unique_ptr<IExpression>> m_arrAllExpressions;
 	IExpression* m_pRoot;
 	IEvaluationContext* m_pContext;
+	CExprProgram m_program;
+	std::vector<CExprProgram> m_arrPrefixPrograms; // Last one holds terms without variables
+	std::vector<Term> m_arrTerms;
 
 	IExpression* m_pDefFalse;
 };
@@ -442,6 +614,7 @@ protected:
 #undef PRNT
 #undef BUILD
 #undef CHECK
+#undef EMIT
 
 void CComplexExpression::Parse( std::string szExpression )
 {
@@ -456,6 +629,8 @@ void CComplexExpression::Parse( std::string szExpression )
 
 	if ( szParse != szExpectEnd )
 		m_pRoot = m_pDefFalse;
+
+	Emit( m_program );
 }
 
 IExpression* CComplexExpression::ParseTopLevel( char* &szExpression )
@@ -635,6 +810,65 @@ void CComplexExpression::Clear() noexcept
 {
 	m_arrAllExpressions.clear();
 	m_pRoot = nullptr;
+	m_program.Clear();
+	m_arrPrefixPrograms.clear();
+	m_arrTerms.clear();
+}
+
+void CComplexExpression::BuildPrefixPrograms( size_t nSlots )
+{
+	m_arrPrefixPrograms.clear();
+	m_arrTerms.clear();
+	if ( !m_program.IsValid() )
+		return;
+
+	std::vector<const IExpression*> arrDisjuncts;
+	Disjuncts( arrDisjuncts );
+
+	std::vector<std::vector<const IExpression*>> arrLevels( nSlots + 1 );
+	for ( const IExpression* pTerm : arrDisjuncts )
+	{
+		Term& term = m_arrTerms.emplace_back();
+		pTerm->Emit( term.m_program );
+		term.m_arrSlots = term.m_program.Slots();
+		arrLevels[term.m_arrSlots.empty() ? nSlots : std::min( static_cast<size_t>( term.m_arrSlots.front() ), nSlots )].emplace_back( pTerm );
+	}
+
+	m_arrPrefixPrograms.resize( nSlots + 1 );
+	for ( size_t nLevel = 0; nLevel <= nSlots; ++nLevel )
+	{
+		const std::vector<const IExpression*>& arrTerms = arrLevels[nLevel];
+		CExprProgram& program = m_arrPrefixPrograms[nLevel];
+
+		std::vector<size_t> arrJumps;
+		for ( size_t i = 0; i < arrTerms.size(); ++i )
+		{
+			arrTerms[i]->Emit( program );
+			if ( i + 1 < arrTerms.size() )
+				arrJumps.emplace_back( program.EmitJump( CExprProgram::Op::JumpIfTrue ) );
+			else
+				program.EmitOp( CExprProgram::Op::Bool );
+		}
+		for ( const size_t nJump : arrJumps )
+			program.PatchJump( nJump );
+
+		if ( program.Size() && !program.IsValid() )
+		{
+			m_arrPrefixPrograms.clear();
+			m_arrTerms.clear();
+			return;
+		}
+	}
+
+	for ( const Term& term : m_arrTerms )
+	{
+		if ( !term.m_program.IsValid() )
+		{
+			m_arrPrefixPrograms.clear();
+			m_arrTerms.clear();
+			return;
+		}
+	}
 }
 
 //////////////////////////////////////////////////////////////////////////
@@ -648,7 +882,7 @@ class ComboGenerator : public IEvaluationContext
 public:
 	ComboGenerator() = default;
 	ComboGenerator( const ComboGenerator& ) = default;
-	ComboGenerator( ComboGenerator&& old ) noexcept : m_arrDefines( std::move( old.m_arrDefines ) ), m_mapDefines( std::move( old.m_mapDefines ) ), m_arrVarSlots( std::move( old.m_arrVarSlots ) ) {}
+	ComboGenerator( ComboGenerator&& old ) noexcept : m_arrDefines( std::move( old.m_arrDefines ) ), m_mapDefines( std::move( old.m_mapDefines ) ), m_arrVarSlots( std::move( old.m_arrVarSlots ) ), m_arrStrides( std::move( old.m_arrStrides ) ) {}
 
 	void AddDefine( const Define& df );
 	[[nodiscard]] const Define* GetDefinesBase() const noexcept { return m_arrDefines.data(); }
@@ -657,6 +891,8 @@ public:
 
 	[[nodiscard]] uint64_t NumCombos() const noexcept;
 	[[nodiscard]] uint64_t NumCombos( bool bStaticCombos ) const noexcept;
+	// Number of combos between two changes of the define in this slot
+	[[nodiscard]] uint64_t Stride( size_t nSlot ) const noexcept { return m_arrStrides[nSlot]; }
 
 	// IEvaluationContext
 public:
@@ -674,6 +910,7 @@ protected:
 	std::vector<Define> m_arrDefines;
 	robin_hood::unordered_node_map<std::string, int> m_mapDefines;
 	std::vector<int> m_arrVarSlots;
+	std::vector<uint64_t> m_arrStrides{ 1 };
 };
 
 void ComboGenerator::AddDefine( const Define& df )
@@ -681,6 +918,7 @@ void ComboGenerator::AddDefine( const Define& df )
 	m_mapDefines.emplace( df.Name(), gsl::narrow<int>( m_arrDefines.size() ) );
 	m_arrDefines.emplace_back( df );
 	m_arrVarSlots.emplace_back( 1 );
+	m_arrStrides.emplace_back( m_arrStrides.back() * ( static_cast<uint64_t>( df.Max() ) - df.Min() + 1ULL ) );
 }
 
 uint64_t ComboGenerator::NumCombos() const noexcept
@@ -702,7 +940,7 @@ namespace ConfigurationProcessing
 class CfgEntry
 {
 public:
-	CfgEntry() noexcept : m_szName( "" ), m_szShaderSrc( "" ), m_pCg( nullptr ), m_pExpr( nullptr )
+	CfgEntry() noexcept : m_szName( "" ), m_szShaderSrc( "" ), m_szShaderModelDefine( "" ), m_pCg( nullptr ), m_pExpr( nullptr )
 	{
 		memset( &m_eiInfo, 0, sizeof( m_eiInfo ) );
 	}
@@ -711,6 +949,7 @@ public:
 
 	std::string_view m_szName;
 	std::string_view m_szShaderSrc;
+	std::string_view m_szShaderModelDefine; // SHADER_MODEL_* define of the version
 	std::unique_ptr<ComboGenerator> m_pCg;
 	std::unique_ptr<CComplexExpression> m_pExpr;
 
@@ -720,178 +959,532 @@ public:
 static robin_hood::unordered_node_set<std::string> s_strPool;
 static std::multiset<CfgEntry> s_setEntries;
 
-class ComboHandleImpl : public IEvaluationContext
+// Plain data so that handles are copied with a memcpy and recycled through ComboHandlePool
+class ComboHandleImpl
 {
 public:
+	static constexpr size_t MAX_DEFINES = 64;
+
 	uint64_t m_iTotalCommand;
 	uint64_t m_iComboNumber;
 	uint64_t m_numCombos;
 	const CfgEntry* m_pEntry;
 
 public:
-	ComboHandleImpl() noexcept : m_iTotalCommand( 0 ), m_iComboNumber( 0 ), m_numCombos( 0 ), m_pEntry( nullptr ) {}
+	ComboHandleImpl() noexcept : m_iTotalCommand( 0 ), m_iComboNumber( 0 ), m_numCombos( 0 ), m_pEntry( nullptr ), m_nSlots( 0 ), m_nStaleLevel( 0 ), m_iBatchFirst( 0 ), m_nBatchSize( 0 ), m_nBatchMask( 0 ) {}
 	ComboHandleImpl( const ComboHandleImpl& ) = default;
 
-	// IEvaluationContext
 private:
-	std::vector<int> m_arrVarSlots;
+	int m_arrVarSlots[MAX_DEFINES];
+	size_t m_nSlots;
+	size_t m_nStaleLevel; // Highest skip level not yet evaluated for the current define values
+	uint64_t m_iBatchFirst; // Combo number of the first lane of the cached batch
+	uint32_t m_nBatchSize;	// Combos covered by the cached batch
+	uint32_t m_nBatchMask;	// Level 0 skip results of the cached batch
 
-public:
-	int GetVariableValue( int nSlot ) const noexcept override { return m_arrVarSlots[nSlot]; }
-	const std::string& GetVariableName( int nSlot ) const noexcept override { return m_pEntry->m_pCg->GetVariableName( nSlot ); }
-	int GetVariableSlot( const std::string& szVariableName ) const noexcept override { return m_pEntry->m_pCg->GetVariableSlot( szVariableName ); }
+	size_t StepDefine( size_t nSlot ) noexcept;
+	bool IsSkippedAtLevel0() noexcept;
 
 	// External implementation
 public:
-	bool Initialize( uint64_t iTotalCommand, const CfgEntry* pEntry );
-	bool AdvanceCommands( uint64_t& riAdvanceMore ) noexcept;
+	bool Initialize( uint64_t iTotalCommand );
+	void Initialize( const CfgEntry* pEntry, uint64_t iEntryStart, uint64_t iTotalCommand );
 	bool NextNotSkipped( uint64_t iTotalCommand ) noexcept;
-	bool IsSkipped() const noexcept { return m_pEntry->m_pExpr->Evaluate( this ) != 0; }
-	CfgProcessor::ComboBuildCommand BuildCommand() const;
+	bool IsSkipped() const noexcept { return m_pEntry->m_pExpr->Evaluate( m_arrVarSlots ) != 0; }
+	void BuildCommand( CfgProcessor::ComboBuildCommand& command ) const;
 	void FormatCommandHumanReadable( gsl::span<char> pchBuffer ) const;
 };
+static_assert( std::is_trivially_copyable_v<ComboHandleImpl> );
+
+// Recycles freed handles on the thread freeing them, handles are handed back and forth
+// between the worker threads so the cache is bounded instead of balanced.
+class ComboHandlePool
+{
+public:
+	static constexpr size_t MAX_CACHED = 256;
+
+	ComboHandlePool() { m_arrFree.reserve( MAX_CACHED ); }
+	~ComboHandlePool()
+	{
+		for ( ComboHandleImpl* pHandle : m_arrFree )
+			delete pHandle;
+	}
+
+	ComboHandleImpl* Alloc()
+	{
+		if ( m_arrFree.empty() )
+			return new ComboHandleImpl;
+
+		ComboHandleImpl* pHandle = m_arrFree.back();
+		m_arrFree.pop_back();
+		return pHandle;
+	}
+
+	void Free( ComboHandleImpl* pHandle ) noexcept
+	{
+		if ( !pHandle )
+			return;
+		if ( m_arrFree.size() < MAX_CACHED )
+			m_arrFree.emplace_back( pHandle );
+		else
+			delete pHandle;
+	}
+
+private:
+	std::vector<ComboHandleImpl*> m_arrFree;
+};
+
+static thread_local ComboHandlePool s_tlHandlePool;
 
-static std::map<uint64_t, ComboHandleImpl> s_mapComboCommands;
+// First command of every entry in command order, ending with the terminator entry
+static std::vector<uint64_t> s_arrEntryStarts;
+static std::vector<const CfgEntry*> s_arrEntries;
 
-bool ComboHandleImpl::Initialize( uint64_t iTotalCommand, const CfgEntry* pEntry )
+bool ComboHandleImpl::Initialize( uint64_t iTotalCommand )
 {
+	// Find the entry owning the command
+	const auto itStart = std::upper_bound( s_arrEntryStarts.cbegin(), s_arrEntryStarts.cend(), iTotalCommand );
+	if ( s_arrEntryStarts.cbegin() == itStart )
+		return false;
+
+	const size_t nEntry = static_cast<size_t>( std::distance( s_arrEntryStarts.cbegin(), itStart ) ) - 1;
+	Initialize( s_arrEntries[nEntry], s_arrEntryStarts[nEntry], iTotalCommand );
+	return true;
+}
+
+void ComboHandleImpl::Initialize( const CfgEntry* pEntry, uint64_t iEntryStart, uint64_t iTotalCommand )
+{
+	m_pEntry = pEntry;
+
+	if ( !m_pEntry->m_pCg )
+	{
+		// Terminator has no combos
+		m_iTotalCommand = iEntryStart;
+		m_iComboNumber  = 0;
+		m_numCombos     = 0;
+		m_nStaleLevel   = 0;
+		m_nBatchSize    = 0;
+		m_nSlots        = 0;
+		return;
+	}
+
 	m_iTotalCommand = iTotalCommand;
-	m_pEntry        = pEntry;
-	m_numCombos     = m_pEntry->m_pCg->NumCombos();
+	m_numCombos     = m_pEntry->m_eiInfo.m_numCombos;
+	m_iComboNumber  = m_numCombos - 1 - ( iTotalCommand - iEntryStart );
 
 	// Defines
 	const Define* const pDefVars    = m_pEntry->m_pCg->GetDefinesBase();
 	const Define* const pDefVarsEnd = m_pEntry->m_pCg->GetDefinesEnd();
 
-	// Set all the variables to max values
-	for ( const Define* pSetDef = pDefVars; pSetDef < pDefVarsEnd; ++pSetDef )
-		m_arrVarSlots.emplace_back( pSetDef->Max() );
+	// Combo number is a mixed-radix number with the first define as the lowest digit
+	m_nSlots = m_pEntry->m_pCg->DefineCount();
+	Assert( m_nSlots <= MAX_DEFINES );
+	uint64_t iDigits = m_iComboNumber;
+	int* pSetValues  = m_arrVarSlots;
+	for ( const Define* pSetDef = pDefVars; pSetDef < pDefVarsEnd; ++pSetDef, ++pSetValues )
+	{
+		const uint64_t iInterval = static_cast<uint64_t>( pSetDef->Max() - pSetDef->Min() ) + 1;
+		*pSetValues = pSetDef->Min() + static_cast<int>( iDigits % iInterval );
+		iDigits /= iInterval;
+	}
 
-	m_iComboNumber = m_numCombos - 1;
-	return true;
+	// Nothing is known about the skip terms at an arbitrary position
+	m_nStaleLevel = m_nSlots;
+	m_nBatchSize  = 0;
 }
 
-bool ComboHandleImpl::AdvanceCommands( uint64_t& riAdvanceMore ) noexcept
+// Decrements the define in the slot, carrying into the outer defines.
+// Returns the outermost slot that changed.
+size_t ComboHandleImpl::StepDefine( size_t nSlot ) noexcept
 {
-	if ( !riAdvanceMore )
-		return true;
+	int* const pnValues          = m_arrVarSlots;
+	const Define* const pDefVars = m_pEntry->m_pCg->GetDefinesBase();
 
-	// Get the pointers
-	int* const pnValues    = m_arrVarSlots.data();
-	int* const pnValuesEnd = pnValues + m_arrVarSlots.size();
-	int* pSetValues;
+	for ( ; nSlot < m_nSlots; ++nSlot )
+	{
+		if ( --pnValues[nSlot] >= pDefVars[nSlot].Min() )
+			break;
 
-	// Defines
-	const Define* const pDefVars = m_pEntry->m_pCg->GetDefinesBase();
-	const Define* pSetDef;
+		pnValues[nSlot] = pDefVars[nSlot].Max();
+	}
+
+	Assert( nSlot < m_nSlots );
+	return nSlot;
+}
+
+bool ComboHandleImpl::NextNotSkipped( uint64_t iTotalCommand ) noexcept
+{
+	const int* const pnValues             = m_arrVarSlots;
+	const ComboGenerator* const pCg       = m_pEntry->m_pCg.get();
+	const Define* const pDefVars          = pCg->GetDefinesBase();
+	const CComplexExpression* const pExpr = m_pEntry->m_pExpr.get();
 
-	if ( m_iComboNumber < riAdvanceMore )
+	for ( ;; )
 	{
-		riAdvanceMore -= m_iComboNumber;
-		return false;
+		if ( m_iTotalCommand + 1 >= iTotalCommand || !m_iComboNumber )
+			return false;
+
+		--m_iComboNumber;
+		++m_iTotalCommand;
+
+		size_t nLevel = StepDefine( 0 );
+
+		if ( !pExpr->CanPrune() )
+		{
+			if ( pExpr->Evaluate( pnValues ) )
+				continue;
+			return true;
+		}
+
+		// Terms of the levels that changed are evaluated once per block,
+		// when one of them holds the whole block is skipped in one step.
+		nLevel        = std::max( nLevel, m_nStaleLevel );
+		m_nStaleLevel = 0;
+		while ( nLevel > 0 )
+		{
+			if ( !pExpr->EvaluatePrefix( nLevel, pnValues ) )
+			{
+				--nLevel;
+				continue;
+			}
+
+			// Skip the rest of the block, normally we are at its start unless the level was stale
+			const uint64_t nBlock = m_iComboNumber % pCg->Stride( nLevel ) + 1;
+			if ( m_iComboNumber < nBlock || m_iTotalCommand + nBlock >= iTotalCommand )
+			{
+				// Rest of the entry or of the range is skipped
+				const uint64_t nAdvance = std::min( m_iComboNumber, iTotalCommand - 1 - m_iTotalCommand );
+				m_iComboNumber -= nAdvance;
+				m_iTotalCommand += nAdvance;
+				return false;
+			}
+
+			m_iComboNumber -= nBlock;
+			m_iTotalCommand += nBlock;
+			for ( size_t nSlot = 0; nSlot < nLevel; ++nSlot )
+				m_arrVarSlots[nSlot] = pDefVars[nSlot].Max();
+			nLevel = StepDefine( nLevel );
+		}
+
+		if ( IsSkippedAtLevel0() )
+			continue;
+
+		return true;
 	}
+}
+
+// Level 0 terms change with every combo, so they are evaluated for the upcoming combos
+// in one go when the CPU has wide vector units.
+bool ComboHandleImpl::IsSkippedAtLevel0() noexcept
+{
+	const CComplexExpression* const pExpr = m_pEntry->m_pExpr.get();
+	if ( !pExpr->HasPrefix( 0 ) )
+		return false;
+
+	const uint32_t nWidth = CExprProgram::BatchWidth();
+	if ( !nWidth )
+		return pExpr->EvaluatePrefix( 0, m_arrVarSlots ) != 0;
 
-	// Do the advance
-	m_iTotalCommand += riAdvanceMore;
-	m_iComboNumber -= riAdvanceMore;
-	for ( pSetValues = pnValues, pSetDef = pDefVars; ( pSetValues < pnValuesEnd ) && ( riAdvanceMore > 0 ); ++pSetValues, ++pSetDef )
+	if ( m_iComboNumber > m_iBatchFirst || m_iBatchFirst - m_iComboNumber >= m_nBatchSize )
 	{
-		riAdvanceMore += ( static_cast<uint64_t>( pSetDef->Max() ) - *pSetValues );
-		*pSetValues = pSetDef->Max();
+		// Lane N holds the combo N steps ahead, lanes past the first combo wrap around and are ignored
+		int arrLanes[MAX_DEFINES * CExprProgram::MAX_BATCH_WIDTH];
+		const Define* const pDefVars = m_pEntry->m_pCg->GetDefinesBase();
+
+		for ( size_t nSlot = 0; nSlot < m_nSlots; ++nSlot )
+			arrLanes[nSlot * nWidth] = m_arrVarSlots[nSlot];
+		for ( uint32_t nLane = 1; nLane < nWidth; ++nLane )
+		{
+			bool bCarry = true;
+			for ( size_t nSlot = 0; nSlot < m_nSlots; ++nSlot )
+			{
+				int nValue = arrLanes[nSlot * nWidth + nLane - 1];
+				if ( bCarry && --nValue < pDefVars[nSlot].Min() )
+					nValue = pDefVars[nSlot].Max();
+				else
+					bCarry = false;
+				arrLanes[nSlot * nWidth + nLane] = nValue;
+			}
+		}
 
-		const int iInterval = ( pSetDef->Max() - pSetDef->Min() + 1 );
-		*pSetValues -= static_cast<int>( riAdvanceMore % iInterval );
-		riAdvanceMore /= iInterval;
+		if ( !pExpr->EvaluatePrefixBatch( 0, arrLanes, m_nBatchMask ) )
+			return pExpr->EvaluatePrefix( 0, m_arrVarSlots ) != 0;
+
+		m_iBatchFirst = m_iComboNumber;
+		m_nBatchSize  = static_cast<uint32_t>( std::min<uint64_t>( nWidth, m_iComboNumber + 1 ) );
 	}
 
-	return true;
+	const bool bSkipped = ( m_nBatchMask >> ( m_iBatchFirst - m_iComboNumber ) ) & 1;
+	Assert( bSkipped == ( pExpr->EvaluatePrefix( 0, m_arrVarSlots ) != 0 ) );
+	return bSkipped;
 }
 
-bool ComboHandleImpl::NextNotSkipped( uint64_t iTotalCommand ) noexcept
+//////////////////////////////////////////////////////////////////////////
+//
+// Combo counting
+//
+//////////////////////////////////////////////////////////////////////////
+
+// Counts non-skipped combos of an entry without enumerating them.
+// Defines are assigned slot by slot, a term is checked once its last free slot got a value
+// and only the values still needed by unchecked terms are kept as the state. Combos sharing
+// a state are counted together, so the cost follows how the skip terms tie the defines
+// together rather than the number of combos.
+class ComboCounter
 {
-	// Get the pointers
-	int* const pnValues    = m_arrVarSlots.data();
-	int* const pnValuesEnd = pnValues + m_arrVarSlots.size();
-	int* pSetValues;
+public:
+	explicit ComboCounter( const CfgEntry& entry ) noexcept : m_entry( entry ) {}
 
-	// Defines
-	const Define* const pDefVars = m_pEntry->m_pCg->GetDefinesBase();
-	const Define* pSetDef;
+	[[nodiscard]] uint64_t CountAll() const;
+	// Non-skipped dynamic combos of every static combo, indexed by the static combo number
+	[[nodiscard]] std::vector<uint64_t> CountPerStaticCombo() const;
 
-	// Go ahead and run the iterations
-next_combo_iteration:
-	if ( m_iTotalCommand + 1 >= iTotalCommand || !m_iComboNumber )
-		return false;
+private:
+	using StateMap = robin_hood::unordered_flat_map<uint64_t, uint64_t>;
 
-	--m_iComboNumber;
-	++m_iTotalCommand;
+	[[nodiscard]] bool CanCount() const noexcept { return m_entry.m_pExpr->CanPrune(); }
+	[[nodiscard]] uint64_t Range( size_t nSlot ) const noexcept
+	{
+		const Define& def = m_entry.m_pCg->GetDefinesBase()[nSlot];
+		return static_cast<uint64_t>( def.Max() - def.Min() ) + 1;
+	}
+	[[nodiscard]] uint64_t Count( std::vector<int>& arrValues, const std::vector<bool>& arrFree ) const;
+	// Fallback for expressions without compiled terms
+	template <typename TFunc>
+	void Enumerate( TFunc&& fnOnCombo ) const;
+
+	const CfgEntry& m_entry;
+};
+
+uint64_t ComboCounter::Count( std::vector<int>& arrValues, const std::vector<bool>& arrFree ) const
+{
+	const size_t nSlots = arrValues.size();
 
-	// Do a next iteration
-	for ( pSetValues = pnValues, pSetDef = pDefVars; pSetValues < pnValuesEnd; ++pSetValues, ++pSetDef )
+	// Every term is checked at its last free slot, fixed ones right away
+	std::vector<std::vector<const CExprProgram*>> arrCheckAt( nSlots );
+	std::vector<int> arrLastUse( nSlots, -1 );
+	for ( const CComplexExpression::Term& term : m_entry.m_pExpr->Terms() )
 	{
-		if ( --*pSetValues >= pSetDef->Min() )
-			goto have_combo_iteration;
+		int nLast = -1;
+		for ( const int nSlot : term.m_arrSlots )
+		{
+			if ( arrFree[nSlot] )
+				nLast = nSlot;
+		}
+
+		if ( nLast < 0 )
+		{
+			if ( term.m_program.Evaluate( arrValues.data() ) )
+				return 0;
+			continue;
+		}
 
-		*pSetValues = pSetDef->Max();
+		arrCheckAt[nLast].emplace_back( &term.m_program );
+		for ( const int nSlot : term.m_arrSlots )
+		{
+			if ( arrFree[nSlot] )
+				arrLastUse[nSlot] = std::max( arrLastUse[nSlot], nLast );
+		}
 	}
 
-	return false;
+	const Define* const pDefVars = m_entry.m_pCg->GetDefinesBase();
+	const auto& Encode = [&]( const std::vector<size_t>& arrState ) noexcept
+	{
+		uint64_t nKey = 0;
+		for ( auto it = arrState.crbegin(); it != arrState.crend(); ++it )
+			nKey = nKey * Range( *it ) + static_cast<uint64_t>( arrValues[*it] - pDefVars[*it].Min() );
+		return nKey;
+	};
+	const auto& Decode = [&]( const std::vector<size_t>& arrState, uint64_t nKey ) noexcept
+	{
+		for ( const size_t nSlot : arrState )
+		{
+			arrValues[nSlot] = pDefVars[nSlot].Min() + static_cast<int>( nKey % Range( nSlot ) );
+			nKey /= Range( nSlot );
+		}
+	};
 
-have_combo_iteration:
-	if ( m_pEntry->m_pExpr->Evaluate( this ) )
-		goto next_combo_iteration;
+	StateMap mapStates{ { 0, 1 } };
+	StateMap mapNext;
+	std::vector<size_t> arrState, arrNextState;
+	uint64_t nFactor = 1;
+	for ( size_t nSlot = 0; nSlot < nSlots; ++nSlot )
+	{
+		if ( !arrFree[nSlot] )
+			continue;
 
-	return true;
+		// Define not used by any term multiplies every state
+		if ( arrLastUse[nSlot] < 0 )
+		{
+			nFactor *= Range( nSlot );
+			continue;
+		}
+
+		arrNextState.clear();
+		for ( const size_t nStateSlot : arrState )
+		{
+			if ( arrLastUse[nStateSlot] > static_cast<int>( nSlot ) )
+				arrNextState.emplace_back( nStateSlot );
+		}
+		if ( arrLastUse[nSlot] > static_cast<int>( nSlot ) )
+			arrNextState.emplace_back( nSlot );
+
+		const std::vector<const CExprProgram*>& arrChecks = arrCheckAt[nSlot];
+		mapNext.clear();
+		for ( const auto& [nKey, nCount] : mapStates )
+		{
+			Decode( arrState, nKey );
+			for ( int nValue = pDefVars[nSlot].Min(); nValue <= pDefVars[nSlot].Max(); ++nValue )
+			{
+				arrValues[nSlot] = nValue;
+				if ( std::any_of( arrChecks.cbegin(), arrChecks.cend(), [&arrValues]( const CExprProgram* pTerm ) { return pTerm->Evaluate( arrValues.data() ) != 0; } ) )
+					continue;
+
+				mapNext[Encode( arrNextState )] += nCount;
+			}
+		}
+
+		std::swap( mapStates, mapNext );
+		std::swap( arrState, arrNextState );
+	}
+
+	uint64_t nTotal = 0;
+	for ( const auto& state : mapStates )
+		nTotal += state.second;
+	return nTotal * nFactor;
 }
 
-static thread_local robin_hood::unordered_node_set<std::string> s_tlPool;
-template <typename T>
-static std::string_view String( const T& str )
+template <typename TFunc>
+void ComboCounter::Enumerate( TFunc&& fnOnCombo ) const
 {
-	return *s_tlPool.emplace( str ).first;
+	// Command numbers are relative to the entry here
+	const uint64_t numCombos = m_entry.m_eiInfo.m_numCombos;
+	ComboHandleImpl chi;
+	chi.Initialize( &m_entry, 0, 0 );
+	if ( !chi.IsSkipped() )
+		fnOnCombo( chi.m_iComboNumber );
+	while ( chi.NextNotSkipped( numCombos ) )
+		fnOnCombo( chi.m_iComboNumber );
 }
 
-CfgProcessor::ComboBuildCommand ComboHandleImpl::BuildCommand() const
+uint64_t ComboCounter::CountAll() const
 {
-	// Get the pointers
-	const int* const pnValues    = m_arrVarSlots.data();
-	const int* const pnValuesEnd = pnValues + m_arrVarSlots.size();
-	const int* pSetValues;
+	if ( !CanCount() )
+	{
+		uint64_t nCount = 0;
+		Enumerate( [&nCount]( uint64_t ) noexcept { ++nCount; } );
+		return nCount;
+	}
 
-	// Defines
-	const Define* const pDefVars = m_pEntry->m_pCg->GetDefinesBase();
-	const Define* const pDefVarsEnd = m_pEntry->m_pCg->GetDefinesEnd();
-	const Define* pSetDef;
+	std::vector<int> arrValues( m_entry.m_pCg->DefineCount() );
+	return Count( arrValues, std::vector<bool>( arrValues.size(), true ) );
+}
 
-	CfgProcessor::ComboBuildCommand command{ m_pEntry->m_eiInfo.m_szEntryPoint, m_pEntry->m_szShaderSrc, m_pEntry->m_eiInfo.m_szShaderVersion };
-	command.defines.reserve( m_pEntry->m_pCg->DefineCount() + 2 );
+std::vector<uint64_t> ComboCounter::CountPerStaticCombo() const
+{
+	const CfgProcessor::CfgEntryInfo& info = m_entry.m_eiInfo;
+	std::vector<uint64_t> arrCounts( gsl::narrow<size_t>( info.m_numStaticCombos ) );
+	if ( !CanCount() )
+	{
+		Enumerate( [&arrCounts, &info]( uint64_t iComboNumber ) noexcept { ++arrCounts[iComboNumber / info.m_numDynamicCombos]; } );
+		return arrCounts;
+	}
 
-	char tmpBuf[24]{};
-	std::to_chars( std::begin( tmpBuf ), std::end( tmpBuf ), m_iComboNumber, 16 );
+	const size_t nSlots          = m_entry.m_pCg->DefineCount();
+	const Define* const pDefVars = m_entry.m_pCg->GetDefinesBase();
 
-	command.defines.emplace_back( "SHADERCOMBO", String( tmpBuf ) );
+	std::vector<bool> arrFree( nSlots );
+	std::vector<size_t> arrStaticSlots;
+	for ( size_t nSlot = 0; nSlot < nSlots; ++nSlot )
+	{
+		arrFree[nSlot] = !pDefVars[nSlot].IsStatic();
+		if ( pDefVars[nSlot].IsStatic() )
+			arrStaticSlots.emplace_back( nSlot );
+	}
 
-	char version[16];
-	strcpy_s( version, sizeof( version ), m_pEntry->m_eiInfo.m_szShaderVersion.data() );
-	_strupr_s( version );
-	sprintf_s( tmpBuf, sizeof( tmpBuf ), "SHADER_MODEL_%6.6s", version );
+	// Terms over static defines only reject a static combo as a whole,
+	// the dynamic count only depends on the static defines sharing a term with dynamic ones
+	std::vector<const CExprProgram*> arrStaticTerms;
+	std::vector<bool> arrKeySlots( nSlots );
+	for ( const CComplexExpression::Term& term : m_entry.m_pExpr->Terms() )
+	{
+		if ( std::none_of( term.m_arrSlots.cbegin(), term.m_arrSlots.cend(), [&arrFree]( int nSlot ) { return arrFree[nSlot]; } ) )
+		{
+			arrStaticTerms.emplace_back( &term.m_program );
+			continue;
+		}
+
+		for ( const int nSlot : term.m_arrSlots )
+		{
+			if ( !arrFree[nSlot] )
+				arrKeySlots[nSlot] = true;
+		}
+	}
 
-	command.defines.emplace_back( String( tmpBuf ), "1" );
+	std::vector<size_t> arrKeys;
+	std::copy_if( arrStaticSlots.cbegin(), arrStaticSlots.cend(), std::back_inserter( arrKeys ), [&arrKeySlots]( size_t nSlot ) { return arrKeySlots[nSlot]; } );
 
-	for ( pSetValues = pnValues, pSetDef = pDefVars; pSetValues < pnValuesEnd && pDefVars < pDefVarsEnd; ++pSetValues, ++pSetDef )
+	// Static combo number is the mixed-radix number of the static defines
+	std::vector<int> arrValues( nSlots );
+	for ( const size_t nSlot : arrStaticSlots )
+		arrValues[nSlot] = pDefVars[nSlot].Min();
+
+	StateMap mapMemo;
+	std::vector<int> arrScratch;
+	for ( size_t iStatic = 0; iStatic < arrCounts.size(); ++iStatic )
 	{
-		*std::to_chars( std::begin( tmpBuf ), std::end( tmpBuf ), *pSetValues ).ptr = 0;
-		command.defines.emplace_back( pSetDef->Name(), String( tmpBuf ) );
+		if ( iStatic )
+		{
+			for ( const size_t nSlot : arrStaticSlots )
+			{
+				if ( ++arrValues[nSlot] <= pDefVars[nSlot].Max() )
+					break;
+				arrValues[nSlot] = pDefVars[nSlot].Min();
+			}
+		}
+
+		if ( std::any_of( arrStaticTerms.cbegin(), arrStaticTerms.cend(), [&arrValues]( const CExprProgram* pTerm ) { return pTerm->Evaluate( arrValues.data() ) != 0; } ) )
+			continue;
+
+		uint64_t nKey = 0;
+		for ( auto it = arrKeys.crbegin(); it != arrKeys.crend(); ++it )
+			nKey = nKey * Range( *it ) + static_cast<uint64_t>( arrValues[*it] - pDefVars[*it].Min() );
+
+		auto [itMemo, bInserted] = mapMemo.try_emplace( nKey, 0 );
+		if ( bInserted )
+		{
+			arrScratch = arrValues;
+			itMemo->second = Count( arrScratch, arrFree );
+		}
+		arrCounts[iStatic] = itMemo->second;
 	}
 
-	return command;
+	return arrCounts;
+}
+
+// Only the combo number is formatted, names and values point into tables built during setup
+void ComboHandleImpl::BuildCommand( CfgProcessor::ComboBuildCommand& command ) const
+{
+	const Define* const pDefVars = m_pEntry->m_pCg->GetDefinesBase();
+
+	command.entryPoint  = m_pEntry->m_eiInfo.m_szEntryPoint;
+	command.fileName    = m_pEntry->m_szShaderSrc;
+	command.shaderModel = m_pEntry->m_eiInfo.m_szShaderVersion;
+
+	*std::to_chars( std::begin( command.comboNumber ), std::end( command.comboNumber ) - 1, m_iComboNumber, 16 ).ptr = 0;
+
+	command.defines.resize( m_nSlots + 2 );
+	command.defines[0] = { "SHADERCOMBO", command.comboNumber };
+	command.defines[1] = { m_pEntry->m_szShaderModelDefine, "1" };
+	for ( size_t nSlot = 0; nSlot < m_nSlots; ++nSlot )
+		command.defines[nSlot + 2] = { pDefVars[nSlot].Name(), pDefVars[nSlot].ValueName( m_arrVarSlots[nSlot] ) };
 }
 
 void ComboHandleImpl::FormatCommandHumanReadable( gsl::span<char> pchBuffer ) const
 {
 	// Get the pointers
-	const int* const pnValues    = m_arrVarSlots.data();
-	const int* const pnValuesEnd = pnValues + m_arrVarSlots.size();
+	const int* const pnValues    = m_arrVarSlots;
+	const int* const pnValuesEnd = pnValues + m_nSlots;
 	const int* pSetValues;
 
 	// Defines
@@ -937,8 +1530,9 @@ std::vector<std::pair<std::string, std::string>> GenerateSkipAsserts( const std:
 	return asserts;
 }
 
-static void SetupConfiguration( const std::vector<CfgProcessor::ShaderConfig>& configs, const std::filesystem::path& root, bool bVerbose )
+static bool SetupConfiguration( const std::vector<CfgProcessor::ShaderConfig>& configs, const std::filesystem::path& root, bool bVerbose )
 {
+	bool bSucceeded = true;
 	using namespace std::literals;
 	const auto& AddCombos = []( ComboGenerator& cg, const std::vector<Parser::Combo>& combos, bool staticC )
 	{
@@ -962,7 +1556,16 @@ static void SetupConfiguration( const std::vector<CfgProcessor::ShaderConfig>& c
 
 		AddCombos( cg, conf.dynamic_c, false );
 		AddCombos( cg, conf.static_c, true );
+		if ( cg.DefineCount() > ComboHandleImpl::MAX_DEFINES )
+		{
+			std::cout << clr::red << conf.name << clr::pinkish << " has " << cg.DefineCount() << " defines, only " << ComboHandleImpl::MAX_DEFINES << " are supported" << clr::reset << std::endl;
+			bSucceeded = false;
+			continue;
+		}
 		exprSkip.Parse( ( std::accumulate( conf.skip.begin(), conf.skip.end(), "("s, []( const std::string& s, const std::string& sk ) { return s + sk + ")||("; } ) + "0)" ) );
+		exprSkip.BuildPrefixPrograms( cg.DefineCount() );
+		if ( !exprSkip.CanPrune() )
+			std::cout << clr::red << conf.name << clr::pinkish << " skip expression doesn't compile, its " << cg.NumCombos() << " combos are checked one by one" << clr::reset << std::endl;
 
 		baseTemplate[0] = conf.target[0];
 		baseTemplate[3] = conf.version[0];
@@ -972,12 +1575,16 @@ static void SetupConfiguration( const std::vector<CfgProcessor::ShaderConfig>& c
 		info.m_szName = cfg.m_szName;
 		info.m_szShaderFileName = cfg.m_szShaderSrc;
 		info.m_szShaderVersion = *s_strPool.emplace( baseTemplate ).first;
+		std::string szShaderModel = "SHADER_MODEL_"s + baseTemplate;
+		std::transform( szShaderModel.begin(), szShaderModel.end(), szShaderModel.begin(), []( const char& c ) { return (char)std::toupper( c ); } );
+		cfg.m_szShaderModelDefine = *s_strPool.emplace( std::move( szShaderModel ) ).first;
 		info.m_szEntryPoint = *s_strPool.emplace( conf.main ).first;
 		info.m_numCombos = cg.NumCombos();
 		info.m_numDynamicCombos = cg.NumCombos( false );
 		info.m_numStaticCombos = cg.NumCombos( true );
 		info.m_nCentroidMask = conf.centroid_mask;
 		info.m_nCrc32 = conf.crc32;
+		info.m_numNonSkippedCombos = ComboCounter( cfg ).CountAll();
 
 		s_setEntries.insert( std::move( cfg ) );
 
@@ -1007,22 +1614,10 @@ static void SetupConfiguration( const std::vector<CfgProcessor::ShaderConfig>& c
 	uint64_t nCurrentCommand = 0;
 	for ( auto it = s_setEntries.rbegin(), itEnd = s_setEntries.rend(); it != itEnd; ++it )
 	{
-		// We establish a command mapping for the beginning of the entry
-		ComboHandleImpl chi;
-		chi.Initialize( nCurrentCommand, &*it );
-		s_mapComboCommands.emplace( nCurrentCommand, chi );
+		s_arrEntryStarts.emplace_back( nCurrentCommand );
+		s_arrEntries.emplace_back( &*it );
 
-		// We also establish mapping by either splitting the
-		// combos into 500 intervals or stepping by every 1000 combos.
-		const uint64_t iPartStep = std::max( 1000ULL, chi.m_numCombos / 500 );
-		for ( uint64_t iRecord = nCurrentCommand + iPartStep; iRecord < nCurrentCommand + chi.m_numCombos; iRecord += iPartStep )
-		{
-			uint64_t iAdvance = iPartStep;
-			chi.AdvanceCommands( iAdvance );
-			s_mapComboCommands.emplace( iRecord, chi );
-		}
-
-		nCurrentCommand += chi.m_numCombos;
+		nCurrentCommand += it->m_eiInfo.m_numCombos;
 	}
 
 	// Establish the last command terminator
@@ -1031,17 +1626,18 @@ static void SetupConfiguration( const std::vector<CfgProcessor::ShaderConfig>& c
 		s_term.m_eiInfo.m_iCommandStart = s_term.m_eiInfo.m_iCommandEnd = nCurrentCommand;
 		s_term.m_eiInfo.m_numCombos = s_term.m_eiInfo.m_numStaticCombos = s_term.m_eiInfo.m_numDynamicCombos = 1;
 		s_term.m_eiInfo.m_szName = s_term.m_eiInfo.m_szShaderFileName = s_term.m_eiInfo.m_szEntryPoint = "";
-		ComboHandleImpl chi;
-		chi.m_iTotalCommand = nCurrentCommand;
-		chi.m_pEntry = &s_term;
-		s_mapComboCommands.emplace( nCurrentCommand, chi );
+		s_arrEntryStarts.emplace_back( nCurrentCommand );
+		s_arrEntries.emplace_back( &s_term );
 	}
+
+	return bSucceeded;
 }
 }; // namespace ConfigurationProcessing
 
 namespace CfgProcessor
 {
 using CPCHI_t = ConfigurationProcessing::ComboHandleImpl;
+using ConfigurationProcessing::s_tlHandlePool;
 static CPCHI_t* FromHandle( ComboHandle hCombo ) noexcept
 {
 	return reinterpret_cast<CPCHI_t*>( hCombo );
@@ -1051,9 +1647,9 @@ static ComboHandle AsHandle( CPCHI_t* pImpl ) noexcept
 	return reinterpret_cast<ComboHandle>( pImpl );
 }
 
-void SetupConfiguration( const std::vector<ShaderConfig>& configs, const std::filesystem::path& root, bool bVerbose )
+bool SetupConfiguration( const std::vector<ShaderConfig>& configs, const std::filesystem::path& root, bool bVerbose )
 {
-	ConfigurationProcessing::SetupConfiguration( configs, root, bVerbose );
+	return ConfigurationProcessing::SetupConfiguration( configs, root, bVerbose );
 }
 
 std::unique_ptr<CfgProcessor::CfgEntryInfo[]> DescribeConfiguration( bool bPrintExpressions )
@@ -1087,42 +1683,76 @@ std::unique_ptr<CfgProcessor::CfgEntryInfo[]> DescribeConfiguration( bool bPrint
 	return arrEntries;
 }
 
-static const CPCHI_t& GetLessOrEq( uint64_t& k, const CPCHI_t& v )
+static const ConfigurationProcessing::CfgEntry* FindEntry( const CfgEntryInfo& info )
+{
+	using namespace ConfigurationProcessing;
+	const auto itStart = std::upper_bound( s_arrEntryStarts.cbegin(), s_arrEntryStarts.cend(), info.m_iCommandStart );
+	if ( s_arrEntryStarts.cbegin() == itStart )
+		return nullptr;
+
+	const CfgEntry* const pEntry = s_arrEntries[static_cast<size_t>( std::distance( s_arrEntryStarts.cbegin(), itStart ) ) - 1];
+	return pEntry->m_pCg ? pEntry : nullptr;
+}
+
+std::vector<uint64_t> CountNonSkippedDynamicCombos( const CfgEntryInfo& info )
 {
-	auto it = ConfigurationProcessing::s_mapComboCommands.lower_bound( k );
-	if ( ConfigurationProcessing::s_mapComboCommands.end() == it )
+	const ConfigurationProcessing::CfgEntry* const pEntry = FindEntry( info );
+	if ( !pEntry )
+		return {};
+
+	return ConfigurationProcessing::ComboCounter( *pEntry ).CountPerStaticCombo();
+}
+
+uint64_t CountSkippedCombos( const CfgEntryInfo& info, uint64_t iCombo, uint64_t nCount, bool bTreeWalk )
+{
+	const ConfigurationProcessing::CfgEntry* const pEntry = FindEntry( info );
+	if ( !pEntry )
+		return 0;
+
+	const ComboGenerator& cg     = *pEntry->m_pCg;
+	const Define* const pDefVars = cg.GetDefinesBase();
+	std::vector<int> arrValues( cg.DefineCount() );
+	for ( size_t nSlot = 0; nSlot < arrValues.size(); ++nSlot )
+		arrValues[nSlot] = pDefVars[nSlot].Min() + static_cast<int>( iCombo / cg.Stride( nSlot ) % ( static_cast<uint64_t>( pDefVars[nSlot].Max() - pDefVars[nSlot].Min() ) + 1 ) );
+
+	const CComplexExpression& expr = *pEntry->m_pExpr;
+	const CSlotValuesContext ctx( &cg, arrValues.data() );
+	uint64_t nSkipped = 0;
+	for ( const uint64_t iEnd = std::min( iCombo + nCount, info.m_numCombos ); iCombo < iEnd; ++iCombo )
 	{
-		if ( ConfigurationProcessing::s_mapComboCommands.empty() )
-			return v;
-		--it;
+		nSkipped += ( bTreeWalk ? expr.Evaluate( &ctx ) : expr.Evaluate( arrValues.data() ) ) != 0;
+
+		// Next combo, the first define is the lowest digit
+		for ( size_t nSlot = 0; nSlot < arrValues.size() && ++arrValues[nSlot] > pDefVars[nSlot].Max(); ++nSlot )
+			arrValues[nSlot] = pDefVars[nSlot].Min();
 	}
+	return nSkipped;
+}
 
-	if ( k < it->first )
+std::vector<ComboDefineInfo> DescribeComboDefines( const CfgEntryInfo& info )
+{
+	const ConfigurationProcessing::CfgEntry* const pEntry = FindEntry( info );
+	if ( !pEntry )
+		return {};
+
+	std::vector<ComboDefineInfo> arrDefines;
+	const ComboGenerator* const pCg = pEntry->m_pCg.get();
+	for ( size_t nSlot = 0; nSlot < pCg->DefineCount(); ++nSlot )
 	{
-		if ( ConfigurationProcessing::s_mapComboCommands.begin() == it )
-			return v;
-		--it;
+		const Define& define = pCg->GetDefinesBase()[nSlot];
+		arrDefines.emplace_back( ComboDefineInfo { define.Name(), define.Min(), define.Max(), pCg->Stride( nSlot ), define.IsStatic() } );
 	}
-
-	k = it->first;
-	return it->second;
+	return arrDefines;
 }
 
 ComboHandle Combo_GetCombo( uint64_t iCommandNumber )
 {
-	// Find earlier command
-	uint64_t iCommandFound = iCommandNumber;
-	const CPCHI_t emptyCPCHI;
-	const CPCHI_t& chiFound = GetLessOrEq( iCommandFound, emptyCPCHI );
-
-	if ( chiFound.m_iTotalCommand < 0 || chiFound.m_iTotalCommand > iCommandNumber )
+	CPCHI_t* pImpl = s_tlHandlePool.Alloc();
+	if ( !pImpl->Initialize( iCommandNumber ) )
+	{
+		s_tlHandlePool.Free( pImpl );
 		return nullptr;
-
-	// Advance the handle as needed
-	CPCHI_t* pImpl = new CPCHI_t( chiFound );
-
-	uint64_t iCommandFoundAdvance = iCommandNumber - iCommandFound;
-	pImpl->AdvanceCommands( iCommandFoundAdvance );
+	}
 
 	return AsHandle( pImpl );
 }
@@ -1135,22 +1765,15 @@ void Combo_GetNext( uint64_t& riCommandNumber, ComboHandle& rhCombo, uint64_t iC
 	if ( !rhCombo )
 	{
 		// We don't have a combo handle that corresponds to the command
-
-		// Find earlier command
-		uint64_t iCommandFound = riCommandNumber;
-		const CPCHI_t emptyCPCHI;
-		const CPCHI_t& chiFound = GetLessOrEq( iCommandFound, emptyCPCHI );
-
-		if ( !chiFound.m_pEntry || !chiFound.m_pEntry->m_pCg || !chiFound.m_pEntry->m_pExpr || chiFound.m_iTotalCommand < 0 || chiFound.m_iTotalCommand > riCommandNumber )
+		pImpl = s_tlHandlePool.Alloc();
+		if ( !pImpl->Initialize( riCommandNumber ) || !pImpl->m_pEntry->m_pCg || !pImpl->m_pEntry->m_pExpr )
+		{
+			s_tlHandlePool.Free( pImpl );
 			return;
+		}
 
-		// Advance the handle as needed
-		pImpl   = new CPCHI_t( chiFound );
 		rhCombo = AsHandle( pImpl );
 
-		uint64_t iCommandFoundAdvance = riCommandNumber - iCommandFound;
-		pImpl->AdvanceCommands( iCommandFoundAdvance );
-
 		if ( !pImpl->IsSkipped() )
 			return;
 	}
@@ -1167,38 +1790,28 @@ void Combo_GetNext( uint64_t& riCommandNumber, ComboHandle& rhCombo, uint64_t iC
 		// We failed to get the next combo command (out of range)
 		if ( pImpl->m_iTotalCommand + 1 >= iCommandEnd )
 		{
-			delete pImpl;
+			s_tlHandlePool.Free( pImpl );
 			rhCombo         = nullptr;
 			riCommandNumber = iCommandEnd;
 			return;
 		}
 
-		// Otherwise we just have to obtain the next combo handle
+		// Otherwise we just have to move on to the next entry
 		riCommandNumber = pImpl->m_iTotalCommand + 1;
 
-		// Delete the old combo handle
-		delete pImpl;
-		rhCombo = nullptr;
-
-		// Retrieve the next combo handle data
-		uint64_t iCommandLookup = riCommandNumber;
-		CPCHI_t emptyCPCHI;
-		const CPCHI_t& chiNext = GetLessOrEq( iCommandLookup, emptyCPCHI );
-		Assert( iCommandLookup == riCommandNumber && ( chiNext.m_pEntry ) );
-
-		// Set up the new combo handle
-		pImpl   = new CPCHI_t( chiNext );
-		rhCombo = AsHandle( pImpl );
+		[[maybe_unused]] const bool bFound = pImpl->Initialize( riCommandNumber );
+		Assert( bFound && pImpl->m_iTotalCommand == riCommandNumber && pImpl->m_pEntry->m_pCg );
 
 		if ( !pImpl->IsSkipped() )
 			return;
 	}
 }
 
-ComboBuildCommand Combo_BuildCommand( ComboHandle hCombo )
+const ComboBuildCommand& Combo_BuildCommand( ComboHandle hCombo )
 {
-	const auto pImpl = FromHandle( hCombo );
-	return pImpl->BuildCommand();
+	static thread_local ComboBuildCommand s_tlCommand;
+	FromHandle( hCombo )->BuildCommand( s_tlCommand );
+	return s_tlCommand;
 }
 
 void Combo_FormatCommandHumanReadable( ComboHandle hCombo, gsl::span<char> pchBuffer )
@@ -1228,11 +1841,11 @@ const CfgEntryInfo* Combo_GetEntryInfo( ComboHandle hCombo ) noexcept
 	return nullptr;
 }
 
-ComboHandle Combo_Alloc( ComboHandle hComboCopyFrom ) noexcept
+ComboHandle Combo_Alloc( ComboHandle hComboCopyFrom )
 {
-	if ( hComboCopyFrom )
-		return AsHandle( new CPCHI_t( *FromHandle( hComboCopyFrom ) ) );
-	return AsHandle( new( std::nothrow ) CPCHI_t );
+	CPCHI_t* pImpl = s_tlHandlePool.Alloc();
+	*pImpl         = hComboCopyFrom ? *FromHandle( hComboCopyFrom ) : CPCHI_t{};
+	return AsHandle( pImpl );
 }
 
 void Combo_Assign( ComboHandle hComboDst, ComboHandle hComboSrc )
@@ -1243,7 +1856,7 @@ void Combo_Assign( ComboHandle hComboDst, ComboHandle hComboSrc )
 
 void Combo_Free( ComboHandle& rhComboFree ) noexcept
 {
-	delete FromHandle( rhComboFree );
+	s_tlHandlePool.Free( FromHandle( rhComboFree ) );
 	rhComboFree = nullptr;
 }
 }; // namespace CfgProcessor
\ No newline at end of file
@@ -55,7 +55,8 @@ struct ShaderConfig
 	std::vector<std::string> includes;
 };
 
-void SetupConfiguration( const std::vector<ShaderConfig>& configs, const std::filesystem::path& root, bool bVerbose );
+// Returns false when a shader couldn't be set up, it is left out then
+[[nodiscard]] bool SetupConfiguration( const std::vector<ShaderConfig>& configs, const std::filesystem::path& root, bool bVerbose );
 
 struct CfgEntryInfo
 {
@@ -66,6 +67,7 @@ struct CfgEntryInfo
 	uint64_t			m_numCombos;			// Total possible num of combos, e.g. 1024
 	uint64_t			m_numDynamicCombos;		// Num of dynamic combos, e.g. 4
 	uint64_t			m_numStaticCombos;		// Num of static combos, e.g. 256
+	uint64_t			m_numNonSkippedCombos;	// Num of combos left after the skips, e.g. 600
 	uint64_t			m_iCommandStart;		// Start command, e.g. 0
 	uint64_t			m_iCommandEnd;			// End command, e.g. 1024
 	int					m_nCentroidMask;		// Mask of centroid samplers
@@ -74,6 +76,23 @@ struct CfgEntryInfo
 
 std::unique_ptr<CfgProcessor::CfgEntryInfo[]> DescribeConfiguration( bool bPrintExpressions );
 
+// Num of non-skipped dynamic combos of every static combo of the entry, indexed by static combo number
+std::vector<uint64_t> CountNonSkippedDynamicCombos( const CfgEntryInfo& info );
+// Skipped combos among nCount combos from iCombo on, each checked through the skip expression tree or its compiled program.
+// Only there to time the two against each other, combo handles never walk the tree
+uint64_t CountSkippedCombos( const CfgEntryInfo& info, uint64_t iCombo, uint64_t nCount, bool bTreeWalk );
+
+// Define of a slot of the combo number, the first one is the lowest digit
+struct ComboDefineInfo
+{
+	std::string_view m_szName;
+	int m_nMin;
+	int m_nMax;
+	uint64_t m_nStride; // Combo numbers between two values of the define
+	bool m_bStatic;
+};
+std::vector<ComboDefineInfo> DescribeComboDefines( const CfgEntryInfo& info );
+
 // Working with combos
 struct __ComboHandle
 {
@@ -88,16 +107,19 @@ uint64_t Combo_GetCommandNum( ComboHandle hCombo ) noexcept;
 uint64_t Combo_GetComboNum( ComboHandle hCombo ) noexcept;
 const CfgEntryInfo* Combo_GetEntryInfo( ComboHandle hCombo ) noexcept;
 
+// Defines point into the command itself, so it is reused instead of copied
 struct ComboBuildCommand
 {
 	std::string_view entryPoint;
 	std::string_view fileName;
 	std::string_view shaderModel;
 	std::vector<std::pair<std::string_view, std::string_view>> defines;
+	char comboNumber[24];
 };
-ComboBuildCommand Combo_BuildCommand( ComboHandle hCombo );
+// Returns the command buffer of the calling thread, valid until its next call
+const ComboBuildCommand& Combo_BuildCommand( ComboHandle hCombo );
 
-ComboHandle Combo_Alloc( ComboHandle hComboCopyFrom ) noexcept;
+ComboHandle Combo_Alloc( ComboHandle hComboCopyFrom );
 void Combo_Assign( ComboHandle hComboDst, ComboHandle hComboSrc );
 void Combo_Free( ComboHandle& rhComboFree ) noexcept;
 }; // namespace CfgProcessor
\ No newline at end of file
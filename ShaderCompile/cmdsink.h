@@ -9,6 +9,8 @@
 #pragma once
 
 #include <cstddef>
+#include <string>
+#include <vector>
 
 namespace CmdSink
 {
@@ -39,4 +41,32 @@ public:
 	virtual const char* GetListing() const = 0;
 };
 
+/*
+
+class CBufferResponse
+
+Response keeping its own copy of the result and the listing.
+
+*/
+class CBufferResponse final : public IResponse
+{
+public:
+	CBufferResponse( std::vector<char>&& code, std::string&& listing, bool bSucceeded = true ) noexcept
+		: m_Code( std::move( code ) )
+		, m_Listing( std::move( listing ) )
+		, m_bSucceeded( bSucceeded )
+	{
+	}
+
+	bool Succeeded() const noexcept override { return m_bSucceeded; }
+	size_t GetResultBufferLen() const override { return m_Code.size(); }
+	const void* GetResultBuffer() const override { return m_Code.data(); }
+	const char* GetListing() const override { return m_Listing.empty() ? nullptr : m_Listing.c_str(); }
+
+private:
+	std::vector<char> m_Code;
+	std::string m_Listing;
+	bool m_bSucceeded;
+};
+
 }; // namespace CmdSink
\ No newline at end of file
@@ -0,0 +1,571 @@
+#include "compilecache.h"
+
+#include "cfgprocessor.h"
+#include "d3dxfxc.h"
+#include "digest.hpp"
+#include "preprocessor.h"
+#include "remotecache.h"
+#include "termcolor/style.hpp"
+#include "termcolors.hpp"
+#include "gsl/narrow"
+#include "robin_hood.h"
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <vector>
+
+using namespace std::literals;
+namespace fs = std::filesystem;
+
+namespace CompileCache
+{
+static constexpr uint32_t CACHE_ID      = ( 'C' << 24 ) + ( 'C' << 16 ) + ( 'S' << 8 ) + 'V';
+static constexpr uint32_t CACHE_VERSION = 2;
+
+struct EntryHeader_t
+{
+	uint32_t m_nId;
+	uint32_t m_nVersion;
+	uint32_t m_nKeySize;     // the whole key is stored, a hit has to match it exactly
+	uint32_t m_nCodeSize;
+	uint32_t m_nListingSize; // without the terminator
+};
+static_assert( sizeof( EntryHeader_t ) == 5 * 4 );
+
+static constexpr char KEY_SOURCE       = 'S'; // Digest of the source files and all of the defines
+static constexpr char KEY_PREPROCESSED = 'P'; // Digest of the preprocessed source, shared by combos that compile the same
+static constexpr char KEY_ALIAS        = 'A'; // Command of this run whose result collapsed combos take
+static constexpr uint64_t MAX_MEMORY_SIZE = 256ull << 20;
+
+struct MemoryEntry_t
+{
+	std::vector<char> m_Code;
+	std::string m_Listing;
+	bool m_bSucceeded;
+};
+
+static fs::path s_CacheDir;
+static uint64_t s_nMaxSize = 0;
+static bool s_bEnabled     = false;
+static bool s_bDedup       = true;
+static uint32_t s_nInstance = 0; // Tells temporary files of concurrent runs apart
+
+static std::atomic<uint64_t> s_nHits;
+static std::atomic<uint64_t> s_nRemoteHits;
+static std::atomic<uint64_t> s_nMisses;
+static std::atomic<uint64_t> s_nStored;
+static std::atomic<uint64_t> s_nCacheSize; // Of all entries, from the size file at start plus what this run stored
+static std::atomic<bool> s_bEvicting;
+static std::atomic<uint64_t> s_nEvicted;
+static std::atomic<uint64_t> s_nShared;
+static std::atomic<uint64_t> s_nPreprocessed;
+static std::atomic<uint64_t> s_nNotPreprocessed;
+
+static std::atomic<uint64_t> s_nAliased;
+
+// Results of preprocessed and alias keys for the rest of the run, failures too since the combos sharing them fail the same way
+static std::mutex s_mtxMemory;
+static robin_hood::unordered_node_map<std::string, MemoryEntry_t> s_MemoryEntries;
+static std::deque<std::string> s_MemoryOrder; // Oldest first, dropped once over MAX_MEMORY_SIZE
+static uint64_t s_nMemorySize = 0;
+
+struct SourceFile_t
+{
+	Digest_t m_Hash;
+	std::vector<std::string> m_Includes;
+};
+
+static std::mutex s_mtxSources;
+static robin_hood::unordered_node_map<std::string, SourceFile_t> s_SourceFiles; // Content digest and includes of every file seen
+static robin_hood::unordered_flat_map<std::string, Digest_t> s_SourceHashes;    // Include-expanded digest of the compiled files
+
+static const SourceFile_t* ScanSourceFile( const std::string& fileName )
+{
+	if ( const auto it = s_SourceFiles.find( fileName ); it != s_SourceFiles.end() )
+		return &it->second;
+
+	// Includes resolve through the file cache just like they do for the compiler, missing ones are left for it to report
+	const CSharedFile* pFile = fileCache.Get( fileName );
+	if ( !pFile )
+		return nullptr;
+
+	const std::string_view src( static_cast<const char*>( pFile->Data() ), pFile->Size() );
+	SourceFile_t file { Digest::Bytes( src.data(), src.size() ), {} };
+	for ( size_t nLineStart = 0; nLineStart < src.size(); )
+	{
+		const size_t nLineEnd = std::min( src.find( '\n', nLineStart ), src.size() );
+		std::string_view line = src.substr( nLineStart, nLineEnd - nLineStart );
+		nLineStart = nLineEnd + 1;
+
+		const auto SkipSpaces = [&line] { line.remove_prefix( std::min( line.find_first_not_of( " \t"sv ), line.size() ) ); };
+		SkipSpaces();
+		if ( !line.starts_with( '#' ) )
+			continue;
+		line.remove_prefix( 1 );
+		SkipSpaces();
+		if ( !line.starts_with( "include"sv ) )
+			continue;
+		line.remove_prefix( "include"sv.size() );
+		SkipSpaces();
+		if ( line.empty() || ( line[0] != '"' && line[0] != '<' ) )
+			continue;
+
+		const size_t nNameEnd = line.find( line[0] == '"' ? '"' : '>', 1 );
+		if ( nNameEnd != std::string_view::npos )
+			file.m_Includes.emplace_back( line.substr( 1, nNameEnd - 1 ) );
+	}
+
+	return &s_SourceFiles.emplace( fileName, std::move( file ) ).first->second;
+}
+
+// Digest over the file and everything it includes, directly or not. Conditionals aren't evaluated, every include counts.
+static Digest_t SourceHash( const std::string& fileName )
+{
+	if ( const auto it = s_SourceHashes.find( fileName ); it != s_SourceHashes.end() )
+		return it->second;
+
+	Digest_t hash {};
+	robin_hood::unordered_flat_set<std::string_view> visited;
+	std::vector<std::string_view> stack { fileName };
+	while ( !stack.empty() )
+	{
+		const std::string_view name = stack.back();
+		stack.pop_back();
+		if ( !visited.emplace( name ).second )
+			continue;
+
+		const SourceFile_t* pFile = ScanSourceFile( std::string( name ) );
+		hash = Digest::Mix( Digest::Mix( hash, Digest::Bytes( name.data(), name.size() ) ), pFile ? pFile->m_Hash : Digest_t {} );
+		if ( pFile )
+			stack.insert( stack.end(), pFile->m_Includes.crbegin(), pFile->m_Includes.crend() );
+	}
+
+	s_SourceHashes.emplace( fileName, hash );
+	return hash;
+}
+
+static uint64_t KeyHash( const std::string& key )
+{
+	return robin_hood::hash_bytes( key.data(), key.size() );
+}
+
+static fs::path EntryPath( uint64_t nKeyHash )
+{
+	char szName[17];
+	snprintf( szName, sizeof( szName ), "%016llx", static_cast<unsigned long long>( nKeyHash ) );
+	return s_CacheDir / std::string_view( szName, 2 ) / szName;
+}
+
+// Same bytes on disk and on the wire
+static std::vector<char> SerializeEntry( const std::string& key, const CmdSink::IResponse& response )
+{
+	const char* szListing = response.GetListing();
+	const EntryHeader_t header {
+		CACHE_ID,
+		CACHE_VERSION,
+		gsl::narrow<uint32_t>( key.size() ),
+		gsl::narrow<uint32_t>( response.GetResultBufferLen() ),
+		gsl::narrow<uint32_t>( szListing ? strlen( szListing ) : 0 )
+	};
+
+	std::vector<char> entry( sizeof( header ) + header.m_nKeySize + header.m_nCodeSize + header.m_nListingSize );
+	char* p = entry.data();
+	p = std::copy_n( reinterpret_cast<const char*>( &header ), sizeof( header ), p );
+	p = std::copy_n( key.data(), header.m_nKeySize, p );
+	p = std::copy_n( static_cast<const char*>( response.GetResultBuffer() ), header.m_nCodeSize, p );
+	std::copy_n( szListing, header.m_nListingSize, p );
+	return entry;
+}
+
+static CmdSink::IResponse* ParseEntry( const std::vector<char>& entry, const std::string& key )
+{
+	EntryHeader_t header;
+	if ( entry.size() < sizeof( header ) )
+		return nullptr;
+	memcpy( &header, entry.data(), sizeof( header ) );
+
+	if ( header.m_nId != CACHE_ID || header.m_nVersion != CACHE_VERSION || header.m_nKeySize != key.size()
+		|| entry.size() != sizeof( header ) + uint64_t( header.m_nKeySize ) + header.m_nCodeSize + header.m_nListingSize
+		|| memcmp( entry.data() + sizeof( header ), key.data(), key.size() ) != 0 )
+		return nullptr;
+
+	const char* pCode = entry.data() + sizeof( header ) + header.m_nKeySize;
+	return new( std::nothrow ) CmdSink::CBufferResponse( std::vector<char>( pCode, pCode + header.m_nCodeSize ), std::string( pCode + header.m_nCodeSize, header.m_nListingSize ) );
+}
+
+static CmdSink::IResponse* FindMemory( const std::string& key )
+{
+	std::lock_guard guard{ s_mtxMemory };
+	const auto it = s_MemoryEntries.find( key );
+	if ( it == s_MemoryEntries.end() )
+		return nullptr;
+	const MemoryEntry_t& entry = it->second;
+	return new( std::nothrow ) CmdSink::CBufferResponse( std::vector<char>( entry.m_Code ), std::string( entry.m_Listing ), entry.m_bSucceeded );
+}
+
+static void StoreMemory( const std::string& key, const CmdSink::IResponse& response )
+{
+	const char* szListing = response.GetListing();
+	const char* pCode     = static_cast<const char*>( response.GetResultBuffer() );
+	MemoryEntry_t entry { std::vector<char>( pCode, pCode + response.GetResultBufferLen() ), szListing ? szListing : "", response.Succeeded() };
+	const uint64_t nSize = key.size() + entry.m_Code.size() + entry.m_Listing.size();
+
+	std::lock_guard guard{ s_mtxMemory };
+	if ( !s_MemoryEntries.try_emplace( key, std::move( entry ) ).second )
+		return;
+	s_MemoryOrder.emplace_back( key );
+	s_nMemorySize += nSize;
+
+	while ( s_nMemorySize > MAX_MEMORY_SIZE && s_MemoryOrder.size() > 1 )
+	{
+		const auto it = s_MemoryEntries.find( s_MemoryOrder.front() );
+		s_nMemorySize -= s_MemoryOrder.front().size() + it->second.m_Code.size() + it->second.m_Listing.size();
+		s_MemoryEntries.erase( it );
+		s_MemoryOrder.pop_front();
+	}
+}
+
+// Written under a name of its own first, nobody ever reads a partial entry
+static uint64_t Evict();
+
+// Saved every sixteenth of the limit, a run that gets killed leaves the size it had almost reached
+static std::mutex s_mtxSizeFile;
+static void SaveSize( uint64_t nSize )
+{
+	std::lock_guard guard{ s_mtxSizeFile };
+	std::ofstream file( s_CacheDir / "size.txt"sv, std::ios::trunc );
+	file << nSize;
+}
+
+static bool WriteEntry( const fs::path& path, const std::vector<char>& entry )
+{
+	fs::path tmpPath = path;
+	tmpPath += "."s + std::to_string( s_nInstance ) + "_"s + std::to_string( std::hash<std::thread::id> {}( std::this_thread::get_id() ) ) + ".tmp"s;
+
+	std::error_code c;
+	fs::create_directories( path.parent_path(), c );
+	{
+		std::ofstream file( tmpPath, std::ios::binary | std::ios::trunc );
+		if ( !file.write( entry.data(), entry.size() ) )
+		{
+			file.close();
+			fs::remove( tmpPath, c );
+			return false;
+		}
+	}
+
+	fs::rename( tmpPath, path, c );
+	if ( c )
+	{
+		fs::remove( tmpPath, c );
+		return false;
+	}
+
+	s_nStored.fetch_add( 1, std::memory_order_relaxed );
+
+	// Whoever crosses the limit evicts, the others keep storing meanwhile
+	const uint64_t nBefore = s_nCacheSize.fetch_add( entry.size(), std::memory_order_relaxed );
+	const uint64_t nAfter  = nBefore + entry.size();
+	if ( nAfter > s_nMaxSize && !s_bEvicting.exchange( true, std::memory_order_acquire ) )
+	{
+		const uint64_t nSize = Evict();
+		s_nCacheSize.store( nSize, std::memory_order_relaxed );
+		SaveSize( nSize );
+		s_bEvicting.store( false, std::memory_order_release );
+	}
+	else if ( const uint64_t nStep = s_nMaxSize / 16 + 1; nBefore / nStep != nAfter / nStep )
+		SaveSize( nAfter );
+	return true;
+}
+
+// Drops least recently used entries until the cache is back under 90% of its limit, returns the size left.
+// Entries stored while it runs may be missed, the next eviction counts them again.
+static uint64_t Evict()
+{
+	struct Entry
+	{
+		fs::path m_Path;
+		fs::file_time_type m_Time;
+		uint64_t m_nSize;
+	};
+	std::vector<Entry> entries;
+	uint64_t nSize = 0;
+
+	std::error_code c;
+	for ( const fs::directory_entry& dir : fs::directory_iterator( s_CacheDir, c ) )
+	{
+		if ( !dir.is_directory( c ) )
+			continue;
+		for ( const fs::directory_entry& file : fs::directory_iterator( dir.path(), c ) )
+		{
+			// Temporary files of a store in flight have an extension
+			if ( !file.is_regular_file( c ) || file.path().has_extension() )
+				continue;
+			const uint64_t nFileSize = file.file_size( c );
+			entries.emplace_back( Entry { file.path(), file.last_write_time( c ), nFileSize } );
+			nSize += nFileSize;
+		}
+	}
+
+	std::sort( entries.begin(), entries.end(), []( const Entry& a, const Entry& b ) { return a.m_Time < b.m_Time; } );
+
+	const uint64_t nTarget = s_nMaxSize / 10 * 9;
+	size_t nEvicted = 0;
+	for ( const Entry& entry : entries )
+	{
+		if ( nSize <= nTarget )
+			break;
+		if ( fs::remove( entry.m_Path, c ) )
+		{
+			nSize -= entry.m_nSize;
+			++nEvicted;
+		}
+	}
+
+	s_nEvicted.fetch_add( nEvicted, std::memory_order_relaxed );
+	return nSize;
+}
+
+void Init( const fs::path& dir, uint64_t nMaxSize )
+{
+	std::error_code c;
+	fs::create_directories( dir, c );
+	if ( c )
+	{
+		std::cout << clr::red << "Can't create compile cache "sv << dir << ": "sv << c.message() << clr::reset << std::endl;
+		return;
+	}
+
+	s_CacheDir  = fs::absolute( dir, c );
+	s_nMaxSize  = nMaxSize;
+
+	// Size of the cache is tracked in a file of its own, only going over the limit walks all the entries.
+	// Concurrent runs may race on it, the next eviction corrects it.
+	uint64_t nSize = 0;
+	{
+		std::ifstream file( s_CacheDir / "size.txt"sv );
+		file >> nSize;
+	}
+	s_nCacheSize = nSize;
+	s_nInstance = std::random_device {}();
+	s_bEnabled  = true;
+}
+
+void InitRemote( const std::string& address )
+{
+	if ( s_bEnabled && RemoteCache::Connect( address ) )
+		std::cout << "Using remote compile cache "sv << clr::green << address << clr::reset << std::endl;
+}
+
+void SetDedup( bool bDedup ) noexcept
+{
+	s_bDedup = bDedup;
+}
+
+bool IsEnabled() noexcept
+{
+	return s_bEnabled;
+}
+
+bool IsRemote() noexcept
+{
+	return RemoteCache::IsConnected();
+}
+
+const std::string& BuildAliasKey( uint64_t iCommand )
+{
+	static thread_local std::string key;
+	key.assign( 1, KEY_ALIAS );
+	key.append( reinterpret_cast<const char*>( &iCommand ), sizeof( iCommand ) );
+	return key;
+}
+
+const std::string& BuildKey( const CfgProcessor::ComboBuildCommand& command, unsigned int flags, uint32_t nCompilerVersion )
+{
+	static thread_local std::string key;
+	key.clear();
+
+	// The preprocessed source stands for the file name and the defines it refers to. Debug bytecode has the source
+	// text in it, comments and all, so it can only be shared by combos of the very same files.
+	if ( s_bDedup && !( flags & ( D3DCOMPILE_DEBUG | D3DCOMPILE_DEBUG_NAME_FOR_SOURCE ) ) )
+	{
+		if ( const std::optional<Digest_t> effectiveHash = Preprocessor::EffectiveSourceHash( command ) )
+		{
+			key += KEY_PREPROCESSED;
+			key.append( reinterpret_cast<const char*>( &*effectiveHash ), sizeof( *effectiveHash ) );
+			key.append( reinterpret_cast<const char*>( &flags ), sizeof( flags ) );
+			key.append( reinterpret_cast<const char*>( &nCompilerVersion ), sizeof( nCompilerVersion ) );
+			for ( const std::string_view part : { command.entryPoint, command.shaderModel } )
+				key.append( part ) += '\0';
+			return key;
+		}
+	}
+
+	// Nothing would look it up
+	if ( !s_bEnabled )
+		return key;
+
+	Digest_t sourceHash;
+	{
+		std::lock_guard guard{ s_mtxSources };
+		sourceHash = SourceHash( std::string( command.fileName ) );
+	}
+
+	key += KEY_SOURCE;
+	key.append( reinterpret_cast<const char*>( &sourceHash ), sizeof( sourceHash ) );
+	key.append( reinterpret_cast<const char*>( &flags ), sizeof( flags ) );
+	key.append( reinterpret_cast<const char*>( &nCompilerVersion ), sizeof( nCompilerVersion ) );
+	for ( const std::string_view part : { command.fileName, command.entryPoint, command.shaderModel } )
+		key.append( part ) += '\0';
+	for ( const auto& [name, value] : command.defines )
+	{
+		key.append( name ) += '\0';
+		key.append( value ) += '\0';
+	}
+	return key;
+}
+
+CmdSink::IResponse* Find( const std::string& key )
+{
+	if ( key.empty() )
+	{
+		s_nNotPreprocessed.fetch_add( 1, std::memory_order_relaxed );
+		return nullptr;
+	}
+
+	if ( key[0] == KEY_ALIAS )
+	{
+		CmdSink::IResponse* pResponse = FindMemory( key );
+		if ( pResponse )
+			s_nAliased.fetch_add( 1, std::memory_order_relaxed );
+		return pResponse;
+	}
+
+	const bool bPreprocessed = key[0] == KEY_PREPROCESSED;
+	if ( s_bDedup )
+		( bPreprocessed ? s_nPreprocessed : s_nNotPreprocessed ).fetch_add( 1, std::memory_order_relaxed );
+	if ( bPreprocessed )
+	{
+		if ( CmdSink::IResponse* pResponse = FindMemory( key ) )
+		{
+			s_nShared.fetch_add( 1, std::memory_order_relaxed );
+			return pResponse;
+		}
+	}
+	if ( !s_bEnabled )
+		return nullptr;
+
+	const uint64_t nKeyHash = KeyHash( key );
+	const fs::path path     = EntryPath( nKeyHash );
+
+	std::vector<char> entry;
+	std::error_code c;
+	if ( std::ifstream file{ path, std::ios::binary | std::ios::ate } )
+	{
+		entry.resize( gsl::narrow<size_t>( static_cast<std::streamoff>( file.tellg() ) ) );
+		file.seekg( 0, std::ios::beg );
+		if ( !file.read( entry.data(), entry.size() ) )
+			entry.clear();
+	}
+
+	if ( CmdSink::IResponse* pResponse = ParseEntry( entry, key ) )
+	{
+		// A hit counts as a use for eviction
+		fs::last_write_time( path, fs::file_time_type::clock::now(), c );
+		s_nHits.fetch_add( 1, std::memory_order_relaxed );
+		if ( bPreprocessed )
+			StoreMemory( key, *pResponse );
+		return pResponse;
+	}
+
+	// Remote hits are kept locally, the next run doesn't have to ask again
+	if ( RemoteCache::Get( nKeyHash, entry ) )
+	{
+		if ( CmdSink::IResponse* pResponse = ParseEntry( entry, key ) )
+		{
+			WriteEntry( path, entry );
+			s_nHits.fetch_add( 1, std::memory_order_relaxed );
+			s_nRemoteHits.fetch_add( 1, std::memory_order_relaxed );
+			if ( bPreprocessed )
+				StoreMemory( key, *pResponse );
+			return pResponse;
+		}
+	}
+
+	s_nMisses.fetch_add( 1, std::memory_order_relaxed );
+	return nullptr;
+}
+
+void Prefetch( const std::vector<std::string>& keys )
+{
+	if ( !RemoteCache::IsConnected() )
+		return;
+
+	std::vector<uint64_t> hashes;
+	hashes.reserve( keys.size() );
+	std::error_code c;
+	for ( const std::string& key : keys )
+	{
+		if ( key.empty() )
+			continue;
+		const uint64_t nKeyHash = KeyHash( key );
+		if ( !fs::exists( EntryPath( nKeyHash ), c ) )
+			hashes.emplace_back( nKeyHash );
+	}
+	RemoteCache::Prefetch( hashes );
+}
+
+void Store( const std::string& key, const CmdSink::IResponse& response )
+{
+	if ( key.empty() )
+		return;
+	if ( key[0] != KEY_SOURCE )
+		StoreMemory( key, response );
+	if ( !s_bEnabled || !response.Succeeded() || key[0] == KEY_ALIAS )
+		return;
+
+	const uint64_t nKeyHash = KeyHash( key );
+	std::vector<char> entry = SerializeEntry( key, response );
+	WriteEntry( EntryPath( nKeyHash ), entry );
+	RemoteCache::Put( nKeyHash, std::move( entry ) );
+}
+
+void Shutdown()
+{
+	if ( s_nAliased )
+		std::cout << "Collapsed defines: "sv << clr::green << s_nAliased << clr::reset << " combos took the result of another combo"sv << std::endl;
+
+	if ( s_bDedup && s_nPreprocessed + s_nNotPreprocessed )
+	{
+		const uint64_t nPreprocessed = s_nPreprocessed;
+		std::cout << "Preprocessed source: "sv << clr::green << s_nShared << clr::reset << " of "sv << nPreprocessed << " combos shared a compile ("sv
+				  << ( nPreprocessed ? s_nShared * 100 / nPreprocessed : 0 ) << "%), "sv << s_nNotPreprocessed << " not preprocessed"sv << std::endl;
+	}
+	{
+		std::lock_guard guard{ s_mtxMemory };
+		s_MemoryEntries.clear();
+		s_MemoryOrder.clear();
+		s_nMemorySize = 0;
+	}
+
+	if ( !s_bEnabled )
+		return;
+
+	RemoteCache::Disconnect();
+
+	const uint64_t nHits    = s_nHits;
+	const uint64_t nLookups = nHits + s_nMisses;
+	std::cout << "Compile cache: "sv << clr::green << nHits << clr::reset << " hits ("sv << s_nRemoteHits << " remote), "sv << clr::green << nLookups - nHits << clr::reset << " misses ("sv
+			  << ( nLookups ? nHits * 100 / nLookups : 0 ) << "% hit rate), "sv << s_nStored << " entries stored, "sv << s_nEvicted << " evicted"sv << std::endl;
+
+	SaveSize( s_nCacheSize );
+
+	s_bEnabled = false;
+}
+} // namespace CompileCache
@@ -0,0 +1,43 @@
+#pragma once
+
+#include "cmdsink.h"
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+namespace CfgProcessor
+{
+	struct ComboBuildCommand;
+}
+
+// Persistent compile results, one file per command keyed by everything that can change its bytecode
+namespace CompileCache
+{
+	// Enables the cache, least recently used entries are evicted once it grows past nMaxSize bytes
+	void Init( const std::filesystem::path& dir, uint64_t nMaxSize );
+	// Adds a shared server behind the local cache, its hits are kept locally and local stores are uploaded to it
+	void InitRemote( const std::string& address );
+	// Combos whose preprocessed source is the same share one compile, on unless turned off
+	void SetDedup( bool bDedup ) noexcept;
+	[[nodiscard]] bool IsEnabled() noexcept;
+	[[nodiscard]] bool IsRemote() noexcept;
+
+	// Include-expanded source, defines, entry point, target, flags and compiler version of the command, or the
+	// preprocessed source in place of the files and defines. Empty when neither the cache nor deduplication is on.
+	// Returns the key buffer of the calling thread, valid until its next call
+	[[nodiscard]] const std::string& BuildKey( const CfgProcessor::ComboBuildCommand& command, unsigned int flags, uint32_t nCompilerVersion );
+
+	// Stands for the result of the command in this run only, it is never written to the cache
+	[[nodiscard]] const std::string& BuildAliasKey( uint64_t iCommand );
+
+	// Asks the remote cache for all keys missing locally in one go, ahead of their Find
+	void Prefetch( const std::vector<std::string>& keys );
+	// Returns the stored result of the key or nullptr
+	[[nodiscard]] CmdSink::IResponse* Find( const std::string& key );
+	// Failures are only kept in memory for the combos sharing the key, the cache gets successful results
+	void Store( const std::string& key, const CmdSink::IResponse& response );
+
+	// Prints hit statistics and saves the size of the cache, entries over the limit are evicted while storing
+	void Shutdown();
+} // namespace CompileCache
@@ -6,24 +6,31 @@
 //
 //=============================================================================//
 
+#ifdef _WIN32
 #define WIN32_LEAN_AND_MEAN
 #define NOWINRES
 #define NOSERVICE
 #define NOMCX
 #define NOIME
 #define NOMINMAX
+#endif
 
 #include "d3dxfxc.h"
 
 #include "basetypes.h"
 #include "cfgprocessor.h"
 #include "cmdsink.h"
+#include "compilecache.h"
+#ifdef _WIN32
 #include "d3dcompiler.h"
+#endif
 #include "gsl/narrow"
 #include <malloc.h>
 #include <vector>
 
+#ifdef _WIN32
 #pragma comment( lib, "D3DCompiler" )
+#endif
 
 CSharedFile::CSharedFile( std::vector<char>&& data ) noexcept : std::vector<char>( std::forward<std::vector<char>>( data ) )
 {
@@ -55,6 +62,7 @@ void FileCache::Clear()
 
 FileCache fileCache;
 
+#ifdef _WIN32
 static struct DxIncludeImpl final : public ID3DInclude
 {
 	STDMETHOD( Open )( THIS_ D3D_INCLUDE_TYPE, LPCSTR pFileName, LPCVOID, LPCVOID* ppData, UINT* pBytes ) override
@@ -107,27 +115,71 @@ protected:
 	HRESULT m_hr;
 };
 
+class CD3DCompiler final : public Compiler::IBackend
+{
+public:
+	uint32_t Version() const override { return D3D_COMPILER_VERSION; }
+
+	CmdSink::IResponse* Compile( const CfgProcessor::ComboBuildCommand& pCommand, unsigned int flags ) override
+	{
+		// Macros to be defined for D3DX, the array is reused by the worker thread
+		static thread_local std::vector<D3D_SHADER_MACRO> macros;
+		macros.resize( pCommand.defines.size() + 1 );
+		std::transform( pCommand.defines.cbegin(), pCommand.defines.cend(), macros.begin(), []( const auto& d ) { return D3D_SHADER_MACRO{ d.first.data(), d.second.data() }; } );
+		macros.back() = D3D_SHADER_MACRO{ nullptr, nullptr };
+
+		ID3DBlob* pShader        = nullptr; // NOTE: Must release the COM interface later
+		ID3DBlob* pErrorMessages = nullptr; // NOTE: Must release COM interface later
+
+		LPCVOID lpcvData = nullptr;
+		UINT numBytes    = 0;
+		HRESULT hr       = s_incDxImpl.Open( D3D_INCLUDE_LOCAL, pCommand.fileName.data(), nullptr, &lpcvData, &numBytes );
+		if ( !FAILED( hr ) )
+		{
+			hr = D3DCompile( lpcvData, numBytes, pCommand.fileName.data(), macros.data(), &s_incDxImpl, pCommand.entryPoint.data(), pCommand.shaderModel.data(), flags, 0, &pShader, &pErrorMessages );
+
+			// Close the file
+			s_incDxImpl.Close( lpcvData );
+		}
+
+		return new( std::nothrow ) CResponse( pShader, pErrorMessages, hr );
+	}
+};
+#endif
+
+std::unique_ptr<Compiler::IBackend> Compiler::CreateD3DCompiler()
+{
+#ifdef _WIN32
+	return std::make_unique<CD3DCompiler>();
+#else
+	return nullptr;
+#endif
+}
+
+static std::unique_ptr<Compiler::IBackend> s_pBackend;
+
+void Compiler::SetBackend( std::unique_ptr<IBackend> pBackend ) noexcept
+{
+	s_pBackend = std::move( pBackend );
+}
+
+const std::string& Compiler::CacheKey( const CfgProcessor::ComboBuildCommand& pCommand, unsigned int flags )
+{
+	return CompileCache::BuildKey( pCommand, flags, s_pBackend->Version() );
+}
 
 void Compiler::ExecuteCommand( const CfgProcessor::ComboBuildCommand& pCommand, CmdSink::IResponse* &pResponse, unsigned int flags )
 {
-	// Macros to be defined for D3DX
-	std::vector<D3D_SHADER_MACRO> macros;
-	macros.resize( pCommand.defines.size() + 1 );
-	std::transform( pCommand.defines.cbegin(), pCommand.defines.cend(), macros.begin(), []( const auto& d ) { return D3D_SHADER_MACRO{ d.first.data(), d.second.data() }; } );
-
-	ID3DBlob* pShader        = nullptr; // NOTE: Must release the COM interface later
-	ID3DBlob* pErrorMessages = nullptr; // NOTE: Must release COM interface later
-
-	LPCVOID lpcvData = nullptr;
-	UINT numBytes    = 0;
-	HRESULT hr       = s_incDxImpl.Open( D3D_INCLUDE_LOCAL, pCommand.fileName.data(), nullptr, &lpcvData, &numBytes );
-	if ( !FAILED( hr ) )
-	{
-		hr = D3DCompile( lpcvData, numBytes, pCommand.fileName.data(), macros.data(), &s_incDxImpl, pCommand.entryPoint.data(), pCommand.shaderModel.data(), flags, 0, &pShader, &pErrorMessages );
+	ExecuteCommand( pCommand, pResponse, flags, CacheKey( pCommand, flags ) );
+}
 
-		// Close the file
-		s_incDxImpl.Close( lpcvData );
-	}
+void Compiler::ExecuteCommand( const CfgProcessor::ComboBuildCommand& pCommand, CmdSink::IResponse* &pResponse, unsigned int flags, const std::string& cacheKey )
+{
+	// Also finds combos of this run compiling the same preprocessed source
+	if ( ( pResponse = CompileCache::Find( cacheKey ) ) != nullptr )
+		return;
 
-	pResponse = new( std::nothrow ) CResponse( pShader, pErrorMessages, hr );
+	pResponse = s_pBackend->Compile( pCommand, flags );
+	if ( pResponse )
+		CompileCache::Store( cacheKey, *pResponse );
 }
\ No newline at end of file
@@ -12,6 +12,9 @@
 #include "cmdsink.h"
 
 #include "robin_hood.h"
+#include <filesystem>
+#include <memory>
+#include <string>
 
 class CSharedFile final : private std::vector<char>
 {
@@ -43,6 +46,20 @@ protected:
 
 extern FileCache fileCache;
 
+// Flags of d3dcompiler.h, every backend takes the same ones
+#ifndef _WIN32
+#define D3DCOMPILE_DEBUG                  ( 1 << 0 )
+#define D3DCOMPILE_SKIP_VALIDATION        ( 1 << 1 )
+#define D3DCOMPILE_SKIP_OPTIMIZATION      ( 1 << 2 )
+#define D3DCOMPILE_AVOID_FLOW_CONTROL     ( 1 << 9 )
+#define D3DCOMPILE_PREFER_FLOW_CONTROL    ( 1 << 10 )
+#define D3DCOMPILE_OPTIMIZATION_LEVEL0    ( 1 << 14 )
+#define D3DCOMPILE_OPTIMIZATION_LEVEL1    0
+#define D3DCOMPILE_OPTIMIZATION_LEVEL2    ( ( 1 << 14 ) | ( 1 << 15 ) )
+#define D3DCOMPILE_OPTIMIZATION_LEVEL3    ( 1 << 15 )
+#define D3DCOMPILE_DEBUG_NAME_FOR_SOURCE  ( 1 << 22 )
+#endif
+
 namespace CfgProcessor
 {
 	struct ComboBuildCommand;
@@ -50,5 +67,41 @@ namespace CfgProcessor
 
 namespace Compiler
 {
+	// What turns a command into bytecode, called from all worker threads at once
+	class IBackend
+	{
+	public:
+		virtual ~IBackend() = default;
+
+		// Part of the compile cache keys, results of other backends or settings are never taken
+		[[nodiscard]] virtual uint32_t Version() const = 0;
+		// Returns the result of the command, nullptr when out of memory
+		[[nodiscard]] virtual CmdSink::IResponse* Compile( const CfgProcessor::ComboBuildCommand& command, unsigned int flags ) = 0;
+	};
+
+	// D3DCompile of d3dcompiler_47.dll, nullptr where it doesn't exist
+	[[nodiscard]] std::unique_ptr<IBackend> CreateD3DCompiler();
+	// Runs the command line for every combo, {file} {entry} {target} {defines} {flags} and {out} are replaced by the
+	// quoted source path, entry point, shader model, fxc style /D and flag switches and the quoted file the bytecode
+	// is expected in. Its output is the listing, an exit code other than 0 a failure. nullptr without {file} or {out}.
+	[[nodiscard]] std::unique_ptr<IBackend> CreateExternalCompiler( const std::string& commandLine, const std::filesystem::path& root );
+
+	struct MockSettings
+	{
+		uint32_t m_nLatency; // Average microseconds a compile takes
+		uint32_t m_nSize;    // Average bytes of bytecode
+		uint32_t m_nSpread;  // Percent both vary around the average
+	};
+	// Makes up bytecode that only depends on the preprocessed source, entry point, target and flags, the same on
+	// every run and machine. For measuring everything around the compiler.
+	[[nodiscard]] std::unique_ptr<IBackend> CreateMockCompiler( const MockSettings& settings );
+
+	// Every command is compiled with it, has to be set before the first one
+	void SetBackend( std::unique_ptr<IBackend> pBackend ) noexcept;
+
 	void ExecuteCommand( const CfgProcessor::ComboBuildCommand& pCommand, CmdSink::IResponse* &ppResponse, unsigned int flags );
+	// Same with the key of the command built earlier
+	void ExecuteCommand( const CfgProcessor::ComboBuildCommand& pCommand, CmdSink::IResponse* &ppResponse, unsigned int flags, const std::string& cacheKey );
+	// Compile cache key of the command for this compiler
+	const std::string& CacheKey( const CfgProcessor::ComboBuildCommand& pCommand, unsigned int flags );
 }; // namespace InterceptFxc
\ No newline at end of file
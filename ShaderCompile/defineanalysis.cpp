@@ -0,0 +1,250 @@
+#include "defineanalysis.h"
+
+#include "preprocessor.h"
+#include "termcolor/style.hpp"
+#include "termcolors.hpp"
+#include "robin_hood.h"
+#include <atomic>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+using namespace std::literals;
+
+namespace DefineAnalysis
+{
+static constexpr uint64_t MAX_ANALYZED_COMBOS = 1 << 22; // Preprocessed one by one to confirm, the hashes of all combos are kept at once
+
+struct Collapse_t
+{
+	std::vector<CfgProcessor::ComboDefineInfo> m_Defines;
+	std::vector<std::vector<uint32_t>> m_Representatives; // Per slot, value the value compiles as, counted from the minimum
+};
+
+static robin_hood::unordered_node_map<uint64_t, Collapse_t> s_Collapses; // By first command of the entry
+
+using ComboHashes = robin_hood::unordered_flat_map<uint64_t, Digest_t>;
+
+static inline uint32_t Digit( uint64_t iCombo, const CfgProcessor::ComboDefineInfo& define ) noexcept
+{
+	return static_cast<uint32_t>( iCombo / define.m_nStride % ( static_cast<uint64_t>( define.m_nMax - define.m_nMin ) + 1 ) );
+}
+
+// Preprocessed source hash of every combo left after the skips by combo number, false when one can't be preprocessed
+static bool HashCombos( const CfgProcessor::CfgEntryInfo& info, uint32_t nThreads, ComboHashes& hashes )
+{
+	std::vector<std::vector<std::pair<uint64_t, Digest_t>>> arrHashes( nThreads );
+	std::atomic<bool> bFailed = false;
+
+	std::vector<std::thread> threads;
+	const uint64_t nCommands = info.m_iCommandEnd - info.m_iCommandStart;
+	for ( uint32_t i = 0; i < nThreads; ++i )
+	{
+		threads.emplace_back( [&info, &arrHashes, &bFailed, nCommands, nThreads, i]() {
+			uint64_t iCommand       = info.m_iCommandStart + nCommands * i / nThreads;
+			const uint64_t iEnd     = info.m_iCommandStart + nCommands * ( i + 1 ) / nThreads;
+			CfgProcessor::ComboHandle hCombo = nullptr;
+			for ( CfgProcessor::Combo_GetNext( iCommand, hCombo, iEnd ); hCombo && iCommand < iEnd; CfgProcessor::Combo_GetNext( iCommand, hCombo, iEnd ) )
+			{
+				const std::optional<Digest_t> hash = Preprocessor::EffectiveSourceHash( CfgProcessor::Combo_BuildCommand( hCombo ) );
+				if ( !hash || bFailed.load( std::memory_order_relaxed ) )
+				{
+					bFailed = true;
+					break;
+				}
+				arrHashes[i].emplace_back( CfgProcessor::Combo_GetComboNum( hCombo ), *hash );
+			}
+			CfgProcessor::Combo_Free( hCombo );
+		} );
+	}
+	for ( std::thread& thread : threads )
+		thread.join();
+
+	if ( bFailed )
+		return false;
+
+	hashes.reserve( info.m_numNonSkippedCombos );
+	for ( const auto& arr : arrHashes )
+		hashes.insert( arr.cbegin(), arr.cend() );
+	return true;
+}
+
+// Lowest value each value of the define collapses onto, values without combos stay on their own
+static std::vector<uint32_t> FindRepresentatives( const CfgProcessor::ComboDefineInfo& define, const ComboHashes& hashes )
+{
+	const uint32_t nValues = static_cast<uint32_t>( define.m_nMax - define.m_nMin ) + 1;
+
+	// Value v can't collapse onto r < v once a combo with v has no match with r
+	std::vector<bool> arrMismatch( static_cast<size_t>( nValues ) * nValues );
+	std::vector<uint64_t> arrCombos( nValues );
+	for ( const auto& [iCombo, hash] : hashes )
+	{
+		const uint32_t v = Digit( iCombo, define );
+		++arrCombos[v];
+		for ( uint32_t r = 0; r < v; ++r )
+		{
+			if ( arrMismatch[v * nValues + r] )
+				continue;
+			const auto it = hashes.find( iCombo - ( v - r ) * define.m_nStride );
+			if ( it == hashes.end() || it->second != hash )
+				arrMismatch[v * nValues + r] = true;
+		}
+	}
+
+	std::vector<uint32_t> arrRepresentatives( nValues );
+	for ( uint32_t v = 0; v < nValues; ++v )
+	{
+		arrRepresentatives[v] = v;
+		for ( uint32_t r = 0; r < v && arrCombos[v]; ++r )
+		{
+			if ( arrRepresentatives[r] == r && arrCombos[r] && !arrMismatch[v * nValues + r] )
+			{
+				arrRepresentatives[v] = r;
+				break;
+			}
+		}
+	}
+	return arrRepresentatives;
+}
+
+static void ReportDefines( const Collapse_t& collapse )
+{
+	for ( size_t nSlot = 0; nSlot < collapse.m_Defines.size(); ++nSlot )
+	{
+		const CfgProcessor::ComboDefineInfo& define = collapse.m_Defines[nSlot];
+		const std::vector<uint32_t>& arrRepresentatives = collapse.m_Representatives[nSlot];
+		if ( std::all_of( arrRepresentatives.cbegin(), arrRepresentatives.cend(), []( uint32_t r ) { return r == 0; } ) && arrRepresentatives.size() > 1 )
+		{
+			std::cout << "    "sv << ( define.m_bStatic ? "STATIC "sv : "DYNAMIC "sv ) << clr::green << define.m_szName << clr::reset << " never changes the source"sv << std::endl;
+			continue;
+		}
+		for ( uint32_t v = 0; v < arrRepresentatives.size(); ++v )
+		{
+			if ( arrRepresentatives[v] != v )
+				std::cout << "    "sv << ( define.m_bStatic ? "STATIC "sv : "DYNAMIC "sv ) << clr::green << define.m_szName << clr::reset << " = "sv << define.m_nMin + static_cast<int>( v )
+						  << " is the same as "sv << define.m_nMin + static_cast<int>( arrRepresentatives[v] ) << std::endl;
+		}
+	}
+}
+
+void Analyze( const CfgProcessor::CfgEntryInfo* pEntries, uint32_t nThreads, bool bReport, bool bCollapse )
+{
+	uint64_t nTotal = 0, nTotalCompiled = 0, nTotalUnique = 0;
+	for ( const CfgProcessor::CfgEntryInfo* pInfo = pEntries; pInfo && !pInfo->m_szName.empty(); ++pInfo )
+	{
+		Collapse_t collapse { CfgProcessor::DescribeComboDefines( *pInfo ), {} };
+
+		// Defines the source never names can't change it, whatever the number of combos
+		std::vector<std::string_view> arrNames;
+		for ( const CfgProcessor::ComboDefineInfo& define : collapse.m_Defines )
+			arrNames.emplace_back( define.m_szName );
+		const std::optional<std::vector<bool>> referenced = Preprocessor::ReferencedNames( pInfo->m_szShaderFileName, arrNames );
+
+		// Preprocessing every combo also finds values that don't matter, small shaders are confirmed that way
+		ComboHashes hashes;
+		if ( pInfo->m_numNonSkippedCombos > MAX_ANALYZED_COMBOS || !HashCombos( *pInfo, std::max( nThreads, 1U ), hashes ) )
+		{
+			if ( !referenced )
+			{
+				if ( bReport )
+					std::cout << clr::pinkish << pInfo->m_szName << ": not analyzed, the source includes something the preprocessor can't follow"sv << clr::reset << std::endl;
+				continue;
+			}
+
+			bool bCollapsed = false;
+			uint32_t nUnreferenced = 0;
+			for ( size_t nSlot = 0; nSlot < collapse.m_Defines.size(); ++nSlot )
+			{
+				const CfgProcessor::ComboDefineInfo& define = collapse.m_Defines[nSlot];
+				const uint32_t nValues = static_cast<uint32_t>( define.m_nMax - define.m_nMin ) + 1;
+				std::vector<uint32_t>& arrRepresentatives = collapse.m_Representatives.emplace_back( nValues );
+				if ( ( *referenced )[nSlot] || nValues == 1 )
+				{
+					for ( uint32_t v = 0; v < nValues; ++v )
+						arrRepresentatives[v] = v;
+					continue;
+				}
+				bCollapsed = true;
+				++nUnreferenced;
+			}
+
+			if ( bReport )
+			{
+				std::cout << clr::green << pInfo->m_szName << clr::reset << ": "sv << pInfo->m_numNonSkippedCombos << " combos, "sv << clr::blue << nUnreferenced << clr::reset
+						  << " defines never named by the source"sv << std::endl;
+				ReportDefines( collapse );
+			}
+
+			if ( bCollapse && bCollapsed )
+				s_Collapses.emplace( pInfo->m_iCommandStart, std::move( collapse ) );
+			continue;
+		}
+
+		bool bCollapsed = false;
+		for ( size_t nSlot = 0; nSlot < collapse.m_Defines.size(); ++nSlot )
+		{
+			std::vector<uint32_t>& arrRepresentatives = collapse.m_Representatives.emplace_back( FindRepresentatives( collapse.m_Defines[nSlot], hashes ) );
+
+			// Pasting makes the preprocessor hash every define, the tokens still tell the ones it can't make up
+			if ( referenced && !( *referenced )[nSlot] )
+				std::fill( arrRepresentatives.begin(), arrRepresentatives.end(), 0 );
+			for ( uint32_t v = 0; v < arrRepresentatives.size(); ++v )
+				bCollapsed |= arrRepresentatives[v] != v;
+		}
+
+		// Combos with only values that don't collapse are the ones left to compile
+		uint64_t nCompiled = 0;
+		robin_hood::unordered_flat_set<Digest_t, Digest::Hasher> uniqueHashes;
+		for ( const auto& [iCombo, hash] : hashes )
+		{
+			uniqueHashes.emplace( hash );
+			bool bRepresentative = true;
+			for ( size_t nSlot = 0; nSlot < collapse.m_Defines.size() && bRepresentative; ++nSlot )
+			{
+				const uint32_t v = Digit( iCombo, collapse.m_Defines[nSlot] );
+				bRepresentative = collapse.m_Representatives[nSlot][v] == v;
+			}
+			nCompiled += bRepresentative;
+		}
+		nTotal += hashes.size();
+		nTotalCompiled += nCompiled;
+		nTotalUnique += uniqueHashes.size();
+
+		if ( bReport )
+		{
+			std::cout << clr::green << pInfo->m_szName << clr::reset << ": "sv << clr::blue << nCompiled << clr::reset << " of "sv << hashes.size() << " combos left with collapsed defines, "sv
+					  << uniqueHashes.size() << " different preprocessed sources"sv << std::endl;
+			ReportDefines( collapse );
+		}
+
+		if ( bCollapse && bCollapsed )
+			s_Collapses.emplace( pInfo->m_iCommandStart, std::move( collapse ) );
+	}
+
+	std::cout << "Define analysis: "sv << clr::green << nTotalCompiled << clr::reset << " of "sv << nTotal << " preprocessed combos left with collapsed defines, "sv
+			  << nTotalUnique << " different preprocessed sources"sv << std::endl;
+}
+
+std::optional<uint64_t> Representative( CfgProcessor::ComboHandle hCombo )
+{
+	if ( s_Collapses.empty() )
+		return std::nullopt;
+
+	const auto it = s_Collapses.find( CfgProcessor::Combo_GetEntryInfo( hCombo )->m_iCommandStart );
+	if ( it == s_Collapses.end() )
+		return std::nullopt;
+
+	// Values only ever collapse onto lower ones, so the combo number only goes down
+	const Collapse_t& collapse = it->second;
+	const uint64_t iCombo      = CfgProcessor::Combo_GetComboNum( hCombo );
+	uint64_t iRepresentative   = iCombo;
+	for ( size_t nSlot = 0; nSlot < collapse.m_Defines.size(); ++nSlot )
+	{
+		const uint32_t v = Digit( iCombo, collapse.m_Defines[nSlot] );
+		iRepresentative -= ( v - collapse.m_Representatives[nSlot][v] ) * collapse.m_Defines[nSlot].m_nStride;
+	}
+
+	// Commands count the combos down
+	return CfgProcessor::Combo_GetCommandNum( hCombo ) + ( iCombo - iRepresentative );
+}
+} // namespace DefineAnalysis
@@ -0,0 +1,20 @@
+#pragma once
+
+#include "cfgprocessor.h"
+#include <cstdint>
+#include <optional>
+
+// Finds define values that can't change what a shader compiles to. A define the source and its includes never
+// name can't change anything, that takes one pass over the tokens. Shaders with few enough combos are also
+// preprocessed combo by combo: a value collapses onto another one of the same define when every combo with it
+// has a combo with the other value, the rest of the defines the same, whose preprocessed source is identical.
+namespace DefineAnalysis
+{
+	// Analyzes every entry and prints how many of the preprocessed combos the collapsed values save, with
+	// bReport also the defines and values of every shader. With bCollapse the combos are compiled as the
+	// combo with the values they collapse onto, see Representative.
+	void Analyze( const CfgProcessor::CfgEntryInfo* pEntries, uint32_t nThreads, bool bReport, bool bCollapse );
+
+	// Command whose result the combo takes, nothing when no define of the shader collapses
+	[[nodiscard]] std::optional<uint64_t> Representative( CfgProcessor::ComboHandle hCombo );
+} // namespace DefineAnalysis
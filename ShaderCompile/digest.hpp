@@ -0,0 +1,90 @@
+#pragma once
+
+#include <bit>
+#include <cstdint>
+#include <cstring>
+
+// 128 bits, wide enough that results looked up by it never belong to other sources
+struct Digest_t
+{
+	uint64_t m_nLow;
+	uint64_t m_nHigh;
+
+	[[nodiscard]] constexpr bool operator==( const Digest_t& other ) const noexcept = default;
+};
+
+namespace Digest
+{
+	namespace detail
+	{
+		static constexpr uint64_t C1 = UINT64_C( 0x87C37B91114253D5 );
+		static constexpr uint64_t C2 = UINT64_C( 0x4CF5AD432745937F );
+
+		[[nodiscard]] constexpr uint64_t FMix( uint64_t k ) noexcept
+		{
+			k ^= k >> 33;
+			k *= UINT64_C( 0xFF51AFD7ED558CCD );
+			k ^= k >> 33;
+			k *= UINT64_C( 0xC4CEB9FE1A85EC53 );
+			k ^= k >> 33;
+			return k;
+		}
+	} // namespace detail
+
+	// MurmurHash3 x64 128
+	[[nodiscard]] inline Digest_t Bytes( const void* pData, size_t nSize ) noexcept
+	{
+		using namespace detail;
+		const auto* p = static_cast<const uint8_t*>( pData );
+		uint64_t h1 = 0, h2 = 0;
+
+		const size_t nBlocks = nSize / 16;
+		for ( size_t i = 0; i < nBlocks; ++i, p += 16 )
+		{
+			uint64_t k1, k2;
+			memcpy( &k1, p, 8 );
+			memcpy( &k2, p + 8, 8 );
+
+			h1 ^= std::rotl( k1 * C1, 31 ) * C2;
+			h1 = ( std::rotl( h1, 27 ) + h2 ) * 5 + 0x52DCE729;
+			h2 ^= std::rotl( k2 * C2, 33 ) * C1;
+			h2 = ( std::rotl( h2, 31 ) + h1 ) * 5 + 0x38495AB5;
+		}
+
+		// Tail, little endian like the blocks
+		uint64_t k1 = 0, k2 = 0;
+		const size_t nTail = nSize & 15;
+		for ( size_t i = nTail; i > 8; --i )
+			k2 = ( k2 << 8 ) | p[i - 1];
+		for ( size_t i = nTail < 8 ? nTail : 8; i > 0; --i )
+			k1 = ( k1 << 8 ) | p[i - 1];
+		if ( nTail > 8 )
+			h2 ^= std::rotl( k2 * C2, 33 ) * C1;
+		if ( nTail )
+			h1 ^= std::rotl( k1 * C1, 31 ) * C2;
+
+		h1 ^= nSize;
+		h2 ^= nSize;
+		h1 += h2;
+		h2 += h1;
+		h1 = FMix( h1 );
+		h2 = FMix( h2 );
+		h1 += h2;
+		h2 += h1;
+		return { h1, h2 };
+	}
+
+	// Order matters, the halves are chained so neither one alone decides a match
+	[[nodiscard]] constexpr Digest_t Mix( const Digest_t& hash, const Digest_t& value ) noexcept
+	{
+		const uint64_t nLow  = std::rotr( ( hash.m_nLow ^ value.m_nLow ) * UINT64_C( 0x9E3779B97F4A7C15 ), 29 );
+		const uint64_t nHigh = std::rotr( ( hash.m_nHigh ^ value.m_nHigh ^ nLow ) * UINT64_C( 0xC2B2AE3D27D4EB4F ), 31 );
+		return { nLow, nHigh };
+	}
+
+	// For hash maps, either half is mixed well enough
+	struct Hasher
+	{
+		[[nodiscard]] size_t operator()( const Digest_t& hash ) const noexcept { return static_cast<size_t>( hash.m_nLow ); }
+	};
+} // namespace Digest
@@ -0,0 +1,268 @@
+#include "exprprogram.h"
+
+#include "basetypes.h"
+#include "gsl/narrow"
+#include <algorithm>
+#include <iterator>
+
+#if defined( _M_X64 ) || defined( _M_IX86 ) || defined( __x86_64__ ) || defined( __i386__ )
+#define EXPR_PROGRAM_LANES
+#if defined( _MSC_VER )
+#include <intrin.h>
+#endif
+#include <immintrin.h>
+#endif
+
+void CExprProgram::Clear() noexcept
+{
+	m_arrCode.clear();
+	m_nDepth    = 0;
+	m_nMaxDepth = 0;
+}
+
+void CExprProgram::EmitConst( int nValue )
+{
+	m_arrCode.emplace_back( Instruction{ Op::Const, nValue } );
+	m_nMaxDepth = std::max( m_nMaxDepth, ++m_nDepth );
+}
+
+void CExprProgram::EmitVar( int nSlot )
+{
+	// Unknown variables evaluate to zero
+	if ( nSlot < 0 )
+		return EmitConst( 0 );
+
+	m_arrCode.emplace_back( Instruction{ Op::Var, nSlot } );
+	m_nMaxDepth = std::max( m_nMaxDepth, ++m_nDepth );
+}
+
+void CExprProgram::EmitOp( Op op )
+{
+	Assert( op != Op::Const && op != Op::Var && op != Op::JumpIfFalse && op != Op::JumpIfTrue );
+	m_arrCode.emplace_back( Instruction{ op, 0 } );
+	if ( op != Op::Not && op != Op::Bool )
+		--m_nDepth;
+}
+
+size_t CExprProgram::EmitJump( Op op )
+{
+	// The operand is popped when the jump is not taken
+	Assert( op == Op::JumpIfFalse || op == Op::JumpIfTrue );
+	m_arrCode.emplace_back( Instruction{ op, 0 } );
+	--m_nDepth;
+	return m_arrCode.size() - 1;
+}
+
+void CExprProgram::PatchJump( size_t nJump ) noexcept
+{
+	m_arrCode[nJump].m_nArg = gsl::narrow_cast<int32_t>( m_arrCode.size() );
+}
+
+std::vector<int> CExprProgram::Slots() const
+{
+	std::vector<int> arrSlots;
+	for ( const Instruction& instr : m_arrCode )
+	{
+		if ( instr.m_op == Op::Var )
+			arrSlots.emplace_back( instr.m_nArg );
+	}
+
+	std::sort( arrSlots.begin(), arrSlots.end() );
+	arrSlots.erase( std::unique( arrSlots.begin(), arrSlots.end() ), arrSlots.end() );
+	return arrSlots;
+}
+
+int CExprProgram::Evaluate( const int* pnValues ) const noexcept
+{
+	int stack[MAX_STACK_DEPTH];
+	int* pTop = stack; // One past the top
+
+	const Instruction* const pBegin = m_arrCode.data();
+	const Instruction* const pEnd   = pBegin + m_arrCode.size();
+	for ( const Instruction* pInstr = pBegin; pInstr < pEnd; ++pInstr )
+	{
+		switch ( pInstr->m_op )
+		{
+		case Op::Const:
+			*pTop++ = pInstr->m_nArg;
+			break;
+		case Op::Var:
+			*pTop++ = pnValues[pInstr->m_nArg];
+			break;
+		case Op::Not:
+			pTop[-1] = !pTop[-1];
+			break;
+		case Op::Bool:
+			pTop[-1] = pTop[-1] != 0;
+			break;
+		case Op::Eq:
+			--pTop;
+			pTop[-1] = pTop[-1] == *pTop;
+			break;
+		case Op::Neq:
+			--pTop;
+			pTop[-1] = pTop[-1] != *pTop;
+			break;
+		case Op::G:
+			--pTop;
+			pTop[-1] = pTop[-1] > *pTop;
+			break;
+		case Op::Ge:
+			--pTop;
+			pTop[-1] = pTop[-1] >= *pTop;
+			break;
+		case Op::L:
+			--pTop;
+			pTop[-1] = pTop[-1] < *pTop;
+			break;
+		case Op::Le:
+			--pTop;
+			pTop[-1] = pTop[-1] <= *pTop;
+			break;
+		case Op::JumpIfFalse:
+			if ( !pTop[-1] )
+				pInstr = pBegin + pInstr->m_nArg - 1;
+			else
+				--pTop;
+			break;
+		case Op::JumpIfTrue:
+			if ( pTop[-1] )
+			{
+				pTop[-1] = 1;
+				pInstr   = pBegin + pInstr->m_nArg - 1;
+			}
+			else
+				--pTop;
+			break;
+		}
+	}
+
+	return pTop > stack ? pTop[-1] : 0;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+// Batch evaluation
+//
+//////////////////////////////////////////////////////////////////////////
+
+#ifdef EXPR_PROGRAM_LANES
+#if defined( __GNUC__ )
+#pragma GCC push_options
+#pragma GCC target( "avx2" )
+#endif
+
+namespace Avx2
+{
+struct Lanes
+{
+	using Vec = __m256i;
+	static constexpr uint32_t WIDTH = 8;
+	static constexpr uint32_t ALL   = 0xFF;
+
+	static Vec Load( const int* pnValues ) noexcept { return _mm256_loadu_si256( reinterpret_cast<const __m256i*>( pnValues ) ); }
+	static Vec Set( int nValue ) noexcept { return _mm256_set1_epi32( nValue ); }
+	static Vec Eq( Vec a, Vec b ) noexcept { return _mm256_srli_epi32( _mm256_cmpeq_epi32( a, b ), 31 ); }
+	static Vec Gt( Vec a, Vec b ) noexcept { return _mm256_srli_epi32( _mm256_cmpgt_epi32( a, b ), 31 ); }
+	static Vec Not( Vec a ) noexcept { return Eq( a, _mm256_setzero_si256() ); }
+	static Vec Bool( Vec a ) noexcept { return _mm256_xor_si256( Not( a ), Set( 1 ) ); }
+	static Vec And( Vec a, Vec b ) noexcept { return _mm256_and_si256( a, b ); }
+	static Vec Or( Vec a, Vec b ) noexcept { return _mm256_or_si256( a, b ); }
+	static uint32_t NonZeroMask( Vec a ) noexcept { return ~static_cast<uint32_t>( _mm256_movemask_ps( _mm256_castsi256_ps( _mm256_cmpeq_epi32( a, _mm256_setzero_si256() ) ) ) ) & ALL; }
+};
+
+#include "exprprogram_lanes.hpp"
+} // namespace Avx2
+
+#if defined( __GNUC__ )
+#pragma GCC pop_options
+#pragma GCC push_options
+#pragma GCC target( "avx512f" )
+#endif
+
+namespace Avx512
+{
+struct Lanes
+{
+	using Vec = __m512i;
+	static constexpr uint32_t WIDTH = 16;
+	static constexpr uint32_t ALL   = 0xFFFF;
+
+	static Vec Load( const int* pnValues ) noexcept { return _mm512_loadu_si512( pnValues ); }
+	static Vec Set( int nValue ) noexcept { return _mm512_set1_epi32( nValue ); }
+	static Vec Eq( Vec a, Vec b ) noexcept { return _mm512_maskz_set1_epi32( _mm512_cmpeq_epi32_mask( a, b ), 1 ); }
+	static Vec Gt( Vec a, Vec b ) noexcept { return _mm512_maskz_set1_epi32( _mm512_cmpgt_epi32_mask( a, b ), 1 ); }
+	static Vec Not( Vec a ) noexcept { return _mm512_maskz_set1_epi32( _mm512_testn_epi32_mask( a, a ), 1 ); }
+	static Vec Bool( Vec a ) noexcept { return _mm512_maskz_set1_epi32( _mm512_test_epi32_mask( a, a ), 1 ); }
+	static Vec And( Vec a, Vec b ) noexcept { return _mm512_and_si512( a, b ); }
+	static Vec Or( Vec a, Vec b ) noexcept { return _mm512_or_si512( a, b ); }
+	static uint32_t NonZeroMask( Vec a ) noexcept { return _mm512_test_epi32_mask( a, a ); }
+};
+
+#include "exprprogram_lanes.hpp"
+} // namespace Avx512
+
+#if defined( __GNUC__ )
+#pragma GCC pop_options
+#endif
+
+static uint32_t DetectBatchWidth() noexcept
+{
+#if defined( _MSC_VER )
+	int regs[4];
+	__cpuid( regs, 0 );
+	if ( regs[0] < 7 )
+		return 0;
+
+	// The OS has to save the wide registers as well
+	__cpuid( regs, 1 );
+	if ( !( regs[2] & ( 1 << 27 ) ) || !( regs[2] & ( 1 << 28 ) ) )
+		return 0;
+
+	const uint64_t xcr0 = _xgetbv( 0 );
+	__cpuidex( regs, 7, 0 );
+	if ( ( regs[1] & ( 1 << 16 ) ) && ( xcr0 & 0xE6 ) == 0xE6 )
+		return Avx512::Lanes::WIDTH;
+	if ( ( regs[1] & ( 1 << 5 ) ) && ( xcr0 & 0x6 ) == 0x6 )
+		return Avx2::Lanes::WIDTH;
+	return 0;
+#else
+	__builtin_cpu_init();
+	if ( __builtin_cpu_supports( "avx512f" ) )
+		return Avx512::Lanes::WIDTH;
+	if ( __builtin_cpu_supports( "avx2" ) )
+		return Avx2::Lanes::WIDTH;
+	return 0;
+#endif
+}
+#else
+static uint32_t DetectBatchWidth() noexcept
+{
+	return 0;
+}
+#endif
+
+static const uint32_t s_nBatchWidth = DetectBatchWidth();
+
+uint32_t CExprProgram::BatchWidth() noexcept
+{
+	return s_nBatchWidth;
+}
+
+bool CExprProgram::EvaluateBatch( const int* pnLanes, uint32_t& rnMask ) const noexcept
+{
+	const Instruction* const pBegin = m_arrCode.data();
+	const Instruction* const pEnd   = pBegin + m_arrCode.size();
+
+#ifdef EXPR_PROGRAM_LANES
+	switch ( s_nBatchWidth )
+	{
+	case Avx512::Lanes::WIDTH:
+		return Avx512::EvaluateLanes( pBegin, pEnd, pnLanes, rnMask );
+	case Avx2::Lanes::WIDTH:
+		return Avx2::EvaluateLanes( pBegin, pEnd, pnLanes, rnMask );
+	}
+#endif
+
+	return false;
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Flat postfix form of a skip expression.
+// Runs over the raw define slot values without touching the expression tree,
+// && and || keep their short-circuit behaviour through conditional jumps.
+class CExprProgram
+{
+public:
+	enum class Op : uint8_t
+	{
+		Const,			// push m_nArg
+		Var,			// push value of slot m_nArg
+		Not,
+		Bool,			// top becomes 0 or 1
+		Eq,
+		Neq,
+		G,
+		Ge,
+		L,
+		Le,
+		JumpIfFalse,	// jump to m_nArg if top is zero, otherwise pop it
+		JumpIfTrue,		// jump to m_nArg with top set to 1 if it is non-zero, otherwise pop it
+	};
+
+	struct Instruction
+	{
+		Op m_op;
+		int32_t m_nArg;
+	};
+
+	static constexpr int MAX_STACK_DEPTH = 64;
+	static constexpr uint32_t MAX_BATCH_WIDTH = 16;
+
+	CExprProgram() noexcept : m_nDepth( 0 ), m_nMaxDepth( 0 ) {}
+
+	void Clear() noexcept;
+
+	void EmitConst( int nValue );
+	void EmitVar( int nSlot );
+	void EmitOp( Op op );
+	[[nodiscard]] size_t EmitJump( Op op );
+	void PatchJump( size_t nJump ) noexcept;
+
+	// Program is usable if it was emitted and fits into the evaluation stack
+	[[nodiscard]] bool IsValid() const noexcept { return !m_arrCode.empty() && m_nMaxDepth <= MAX_STACK_DEPTH; }
+	[[nodiscard]] size_t Size() const noexcept { return m_arrCode.size(); }
+	// Sorted list of the slots read by the program
+	[[nodiscard]] std::vector<int> Slots() const;
+
+	[[nodiscard]] int Evaluate( const int* pnValues ) const noexcept;
+
+	// Combos evaluated at once by EvaluateBatch, 8 with AVX2, 16 with AVX-512 and 0 if the CPU has neither
+	[[nodiscard]] static uint32_t BatchWidth() noexcept;
+	// Evaluates the program for BatchWidth() combos at once, pnLanes holds BatchWidth() values of every slot.
+	// Bit N of rnMask is set if the program holds for lane N. Fails for programs with too many
+	// short-circuit operators pending at once, those have to be evaluated one combo at a time.
+	[[nodiscard]] bool EvaluateBatch( const int* pnLanes, uint32_t& rnMask ) const noexcept;
+
+private:
+	std::vector<Instruction> m_arrCode;
+	int m_nDepth;
+	int m_nMaxDepth;
+};
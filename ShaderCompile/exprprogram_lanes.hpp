@@ -0,0 +1,111 @@
+// Lane interpreter of CExprProgram, included by exprprogram.cpp once for every instruction set.
+// The including namespace provides Lanes with the vector type and the lane-wise operations,
+// comparisons and logic produce 0 or 1 in every lane just like the scalar interpreter.
+
+// Short-circuit operator whose lanes went both ways, it is merged back when its target is reached
+struct PendingJump
+{
+	int32_t m_nTarget;
+	CExprProgram::Op m_op;
+	Lanes::Vec m_vLeft; // Left operand as 0 or 1
+};
+
+static bool EvaluateLanes( const CExprProgram::Instruction* pBegin, const CExprProgram::Instruction* pEnd, const int* pnLanes, uint32_t& rnMask ) noexcept
+{
+	using Op = CExprProgram::Op;
+
+	Lanes::Vec stack[CExprProgram::MAX_STACK_DEPTH];
+	Lanes::Vec* pTop = stack; // One past the top
+	PendingJump pending[CExprProgram::MAX_STACK_DEPTH];
+	size_t nPending = 0;
+
+	const auto& MergePending = [&]( int32_t nTarget ) noexcept
+	{
+		for ( ; nPending && pending[nPending - 1].m_nTarget == nTarget; --nPending )
+		{
+			const PendingJump& jump = pending[nPending - 1];
+			pTop[-1] = jump.m_op == Op::JumpIfFalse ? Lanes::And( jump.m_vLeft, pTop[-1] ) : Lanes::Or( jump.m_vLeft, pTop[-1] );
+		}
+	};
+
+	for ( const CExprProgram::Instruction* pInstr = pBegin; pInstr < pEnd; ++pInstr )
+	{
+		MergePending( static_cast<int32_t>( pInstr - pBegin ) );
+
+		switch ( pInstr->m_op )
+		{
+		case Op::Const:
+			*pTop++ = Lanes::Set( pInstr->m_nArg );
+			break;
+		case Op::Var:
+			*pTop++ = Lanes::Load( pnLanes + static_cast<size_t>( pInstr->m_nArg ) * Lanes::WIDTH );
+			break;
+		case Op::Not:
+			pTop[-1] = Lanes::Not( pTop[-1] );
+			break;
+		case Op::Bool:
+			pTop[-1] = Lanes::Bool( pTop[-1] );
+			break;
+		case Op::Eq:
+			--pTop;
+			pTop[-1] = Lanes::Eq( pTop[-1], *pTop );
+			break;
+		case Op::Neq:
+			--pTop;
+			pTop[-1] = Lanes::Not( Lanes::Eq( pTop[-1], *pTop ) );
+			break;
+		case Op::G:
+			--pTop;
+			pTop[-1] = Lanes::Gt( pTop[-1], *pTop );
+			break;
+		case Op::Ge:
+			--pTop;
+			pTop[-1] = Lanes::Not( Lanes::Gt( *pTop, pTop[-1] ) );
+			break;
+		case Op::L:
+			--pTop;
+			pTop[-1] = Lanes::Gt( *pTop, pTop[-1] );
+			break;
+		case Op::Le:
+			--pTop;
+			pTop[-1] = Lanes::Not( Lanes::Gt( pTop[-1], *pTop ) );
+			break;
+		case Op::JumpIfFalse:
+		case Op::JumpIfTrue:
+		{
+			// Jump only when all lanes agree, otherwise every lane runs the right operand
+			const bool bOnTrue    = pInstr->m_op == Op::JumpIfTrue;
+			const uint32_t nTaken = Lanes::NonZeroMask( bOnTrue ? pTop[-1] : Lanes::Not( pTop[-1] ) );
+			if ( nTaken == Lanes::ALL )
+			{
+				if ( bOnTrue )
+					pTop[-1] = Lanes::Set( 1 );
+				pInstr = pBegin + pInstr->m_nArg - 1;
+				break;
+			}
+
+			if ( nTaken )
+			{
+				const Lanes::Vec vLeft = Lanes::Bool( pTop[-1] );
+				// Chains of the same operator fold into one pending operand
+				if ( nPending && pending[nPending - 1].m_nTarget == pInstr->m_nArg && pending[nPending - 1].m_op == pInstr->m_op )
+				{
+					PendingJump& jump = pending[nPending - 1];
+					jump.m_vLeft      = bOnTrue ? Lanes::Or( jump.m_vLeft, vLeft ) : Lanes::And( jump.m_vLeft, vLeft );
+				}
+				else if ( nPending < std::size( pending ) )
+					pending[nPending++] = PendingJump{ pInstr->m_nArg, pInstr->m_op, vLeft };
+				else
+					return false;
+			}
+			--pTop;
+			break;
+		}
+		}
+	}
+
+	MergePending( static_cast<int32_t>( pEnd - pBegin ) );
+
+	rnMask = pTop > stack ? Lanes::NonZeroMask( pTop[-1] ) : 0;
+	return true;
+}
@@ -0,0 +1,257 @@
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOWINRES
+#define NOSERVICE
+#define NOMCX
+#define NOIME
+#define NOMINMAX
+#include <windows.h>
+#include "d3dcompiler.h"
+#endif
+
+#include "d3dxfxc.h"
+
+#include "cfgprocessor.h"
+#include "robin_hood.h"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <random>
+#include <string_view>
+
+#ifdef _WIN32
+#define popen _popen
+#define pclose _pclose
+#endif
+
+using namespace std::literals;
+namespace fs = std::filesystem;
+
+static std::string FlagSwitches( unsigned int flags )
+{
+	std::string switches;
+	if ( flags & D3DCOMPILE_DEBUG )
+		switches += " /Zi"sv;
+	if ( flags & D3DCOMPILE_DEBUG_NAME_FOR_SOURCE )
+		switches += " /Zss"sv;
+	if ( flags & D3DCOMPILE_SKIP_VALIDATION )
+		switches += " /Vd"sv;
+	if ( flags & D3DCOMPILE_SKIP_OPTIMIZATION )
+		switches += " /Od"sv;
+	if ( flags & D3DCOMPILE_AVOID_FLOW_CONTROL )
+		switches += " /Gfa"sv;
+	if ( flags & D3DCOMPILE_PREFER_FLOW_CONTROL )
+		switches += " /Gfp"sv;
+
+	// Level 2 is both bits of the others
+	switch ( flags & D3DCOMPILE_OPTIMIZATION_LEVEL2 )
+	{
+	case D3DCOMPILE_OPTIMIZATION_LEVEL0:
+		switches += " /O0"sv;
+		break;
+	case D3DCOMPILE_OPTIMIZATION_LEVEL2:
+		switches += " /O2"sv;
+		break;
+	case D3DCOMPILE_OPTIMIZATION_LEVEL3:
+		switches += " /O3"sv;
+		break;
+	default:
+		switches += " /O1"sv;
+		break;
+	}
+	return switches.substr( 1 );
+}
+
+static fs::path FindExecutable( const fs::path& name )
+{
+	std::error_code c;
+	if ( name.has_parent_path() )
+		return fs::is_regular_file( name, c ) ? name : fs::path();
+
+	// Searched for on the PATH just like the shell does
+	const char* szPath = std::getenv( "PATH" );
+#ifdef _WIN32
+	static constexpr char PATH_SEPARATOR = ';';
+#else
+	static constexpr char PATH_SEPARATOR = ':';
+#endif
+	const std::string_view path = szPath ? szPath : "";
+	for ( size_t nStart = 0; nStart <= path.size(); )
+	{
+		const size_t nEnd = std::min( path.find( PATH_SEPARATOR, nStart ), path.size() );
+		const fs::path dir( path.substr( nStart, nEnd - nStart ) );
+		nStart = nEnd + 1;
+		if ( dir.empty() )
+			continue;
+
+		fs::path candidate = dir / name;
+#ifdef _WIN32
+		if ( !candidate.has_extension() )
+			candidate += ".exe";
+#endif
+		if ( fs::is_regular_file( candidate, c ) )
+			return candidate;
+	}
+	return {};
+}
+
+// Path, size and modification time of the compiler and of every file the command names, a script run by an
+// interpreter or a configuration. A new build of any of them counts as another compiler.
+static std::string FileIdentities( std::string_view commandLine )
+{
+	std::string identities;
+	bool bFirst = true;
+	for ( size_t nPos = 0; nPos < commandLine.size(); )
+	{
+		nPos = commandLine.find_first_not_of( " \t"sv, nPos );
+		if ( nPos == std::string_view::npos )
+			break;
+
+		size_t nEnd;
+		std::string_view word;
+		if ( commandLine[nPos] == '"' )
+		{
+			nEnd = std::min( commandLine.find( '"', nPos + 1 ), commandLine.size() );
+			word = commandLine.substr( nPos + 1, nEnd - nPos - 1 );
+			++nEnd;
+		}
+		else
+		{
+			nEnd = std::min( commandLine.find_first_of( " \t"sv, nPos ), commandLine.size() );
+			word = commandLine.substr( nPos, nEnd - nPos );
+		}
+		nPos = nEnd;
+
+		// Placeholders are filled in for every combo
+		const bool bCompiler = std::exchange( bFirst, false );
+		if ( word.empty() || word.find( '{' ) != std::string_view::npos )
+			continue;
+
+		std::error_code c;
+		const fs::path file = bCompiler ? FindExecutable( word ) : fs::path( word );
+		if ( file.empty() || !fs::is_regular_file( file, c ) )
+			continue;
+
+		const fs::path absolute = fs::absolute( file, c );
+		identities.append( absolute.string() ) += '\0';
+		identities.append( std::to_string( fs::file_size( file, c ) ) ) += '\0';
+		identities.append( std::to_string( fs::last_write_time( file, c ).time_since_epoch().count() ) ) += '\0';
+	}
+	return identities;
+}
+
+static uint32_t CompilerVersion( const std::string& commandLine )
+{
+	const std::string identity = commandLine + '\0' + FileIdentities( commandLine );
+	return static_cast<uint32_t>( robin_hood::hash_bytes( identity.data(), identity.size() ) );
+}
+
+class CExternalCompiler final : public Compiler::IBackend
+{
+public:
+	CExternalCompiler( const std::string& commandLine, const fs::path& root )
+		: m_szCommandLine( commandLine )
+		, m_Root( root )
+		, m_nVersion( CompilerVersion( commandLine ) )
+		, m_nInstance( std::random_device{}() )
+	{
+	}
+
+	uint32_t Version() const override { return m_nVersion; }
+
+	CmdSink::IResponse* Compile( const CfgProcessor::ComboBuildCommand& command, unsigned int flags ) override
+	{
+		// Every thread has its own output file, other runs at the same time use other names
+		static std::atomic<uint32_t> s_nThreads;
+		static thread_local fs::path out;
+		if ( out.empty() )
+		{
+			std::error_code c;
+			out = fs::temp_directory_path( c ) / ( "ShaderCompile_"s + std::to_string( m_nInstance ) + "_"s + std::to_string( s_nThreads++ ) + ".bin"s );
+		}
+
+		std::string defines;
+		for ( const auto& [name, value] : command.defines )
+		{
+			if ( !defines.empty() )
+				defines += ' ';
+			defines.append( "/D"sv ).append( name ).append( 1, '=' ).append( value );
+		}
+
+		const std::array<std::pair<std::string_view, std::string>, 6> args = { {
+			{ "{file}"sv, "\""s + ( m_Root / command.fileName ).string() + "\""s },
+			{ "{entry}"sv, std::string( command.entryPoint ) },
+			{ "{target}"sv, std::string( command.shaderModel ) },
+			{ "{defines}"sv, std::move( defines ) },
+			{ "{flags}"sv, FlagSwitches( flags ) },
+			{ "{out}"sv, "\""s + out.string() + "\""s },
+		} };
+
+		// One pass, so nothing put in is replaced again
+		std::string cmd;
+		for ( size_t nPos = 0; nPos < m_szCommandLine.size(); )
+		{
+			const auto it = std::find_if( args.cbegin(), args.cend(), [&]( const auto& arg ) { return m_szCommandLine.compare( nPos, arg.first.size(), arg.first ) == 0; } );
+			if ( it != args.cend() )
+			{
+				cmd += it->second;
+				nPos += it->first.size();
+			}
+			else
+				cmd += m_szCommandLine[nPos++];
+		}
+		cmd += " 2>&1"sv;
+#ifdef _WIN32
+		// cmd.exe /c drops the first and the last quote of the line
+		cmd = "\""s + cmd + "\""s;
+#endif
+
+		FILE* pPipe = popen( cmd.c_str(), "r" );
+		if ( !pPipe )
+			return new( std::nothrow ) CmdSink::CBufferResponse( {}, "Couldn't run the external compiler: "s + cmd, false );
+
+		std::string listing;
+		std::array<char, 4096> chBuffer;
+		for ( size_t nRead; ( nRead = fread( chBuffer.data(), 1, chBuffer.size(), pPipe ) ) != 0; )
+			listing.append( chBuffer.data(), nRead );
+		const bool bSucceeded = pclose( pPipe ) == 0;
+
+		// Paths relative to the shader root like D3DCompile reports them
+		const std::string root = ( m_Root / "" ).string();
+		for ( size_t nPos; ( nPos = listing.find( root ) ) != std::string::npos; )
+			listing.erase( nPos, root.size() );
+
+		std::vector<char> code;
+		if ( bSucceeded )
+		{
+			std::ifstream file( out, std::ios::binary | std::ios::ate );
+			if ( file )
+			{
+				code.resize( static_cast<size_t>( static_cast<std::streamoff>( file.tellg() ) ) );
+				file.seekg( 0, std::ios::beg );
+				file.read( code.data(), code.size() );
+			}
+		}
+		std::error_code c;
+		fs::remove( out, c );
+
+		const bool bGotCode = !code.empty();
+		return new( std::nothrow ) CmdSink::CBufferResponse( std::move( code ), std::move( listing ), bSucceeded && bGotCode );
+	}
+
+private:
+	std::string m_szCommandLine;
+	fs::path m_Root;
+	uint32_t m_nVersion;
+	uint32_t m_nInstance; // Tells output files of concurrent runs apart
+};
+
+std::unique_ptr<Compiler::IBackend> Compiler::CreateExternalCompiler( const std::string& commandLine, const fs::path& root )
+{
+	if ( commandLine.find( "{file}"sv ) == std::string::npos || commandLine.find( "{out}"sv ) == std::string::npos )
+		return nullptr;
+	return std::make_unique<CExternalCompiler>( commandLine, root );
+}
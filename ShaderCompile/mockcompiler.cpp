@@ -0,0 +1,86 @@
+#include "d3dxfxc.h"
+
+#include "cfgprocessor.h"
+#include "preprocessor.h"
+#include "robin_hood.h"
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstring>
+#include <random>
+#include <thread>
+
+using namespace std::literals;
+
+static inline uint64_t HashCombine( uint64_t nHash, const void* pData, size_t nSize ) noexcept
+{
+	return nHash * 0x9E3779B97F4A7C15ull ^ robin_hood::hash_bytes( pData, nSize );
+}
+
+class CMockCompiler final : public Compiler::IBackend
+{
+public:
+	explicit CMockCompiler( const Compiler::MockSettings& settings ) noexcept
+		: m_Settings( settings )
+	{
+	}
+
+	// The latency doesn't change the bytecode
+	uint32_t Version() const override
+	{
+		const std::array<uint32_t, 3> arrSettings = { ( 'M' << 24 ) + ( 'O' << 16 ) + ( 'C' << 8 ) + 'K', m_Settings.m_nSize, m_Settings.m_nSpread };
+		return static_cast<uint32_t>( robin_hood::hash_bytes( arrSettings.data(), sizeof( arrSettings ) ) );
+	}
+
+	CmdSink::IResponse* Compile( const CfgProcessor::ComboBuildCommand& command, unsigned int flags ) override
+	{
+		// Same as a real compiler, combos with the same preprocessed source get the same bytecode
+		uint64_t nHash;
+		if ( const std::optional<Digest_t> effectiveHash = Preprocessor::EffectiveSourceHash( command ) )
+			nHash = effectiveHash->m_nLow ^ effectiveHash->m_nHigh;
+		else
+		{
+			const CSharedFile* pFile = fileCache.Get( std::string( command.fileName ) );
+			nHash = pFile ? robin_hood::hash_bytes( pFile->Data(), pFile->Size() ) : 0;
+			for ( const auto& [name, value] : command.defines )
+				nHash = HashCombine( HashCombine( nHash, name.data(), name.size() ), value.data(), value.size() );
+		}
+		nHash = HashCombine( nHash, &flags, sizeof( flags ) );
+		nHash = HashCombine( nHash, command.entryPoint.data(), command.entryPoint.size() );
+		nHash = HashCombine( nHash, command.shaderModel.data(), command.shaderModel.size() );
+
+		// Only the engine is specified exactly, the distributions of the standard library differ between implementations
+		std::mt19937_64 rng( nHash );
+		const auto& vary = [&rng, this]( uint32_t nAverage ) -> uint64_t {
+			const uint64_t nSpread = std::min( m_Settings.m_nSpread, 100U );
+			return nAverage * ( 100 - nSpread + rng() % ( 2 * nSpread + 1 ) ) / 100;
+		};
+		const uint64_t nLatency = vary( m_Settings.m_nLatency );
+		const size_t nSize      = static_cast<size_t>( std::max<uint64_t>( vary( m_Settings.m_nSize ), 8 ) ) & ~size_t( 3 );
+
+		// Instructions come from a small set per shader, the bytecode of its combos compresses like the real one
+		std::mt19937_64 rngShader( robin_hood::hash_bytes( command.fileName.data(), command.fileName.size() ) );
+		std::array<uint32_t, 64> arrInstructions;
+		for ( uint32_t& nInstruction : arrInstructions )
+			nInstruction = static_cast<uint32_t>( rngShader() );
+
+		std::vector<char> code( nSize );
+		memcpy( code.data(), "DXBC", 4 );
+		for ( size_t nPos = 4; nPos < nSize; nPos += 4 )
+		{
+			const uint32_t nInstruction = arrInstructions[rng() % arrInstructions.size()];
+			memcpy( code.data() + nPos, &nInstruction, 4 );
+		}
+
+		std::this_thread::sleep_for( std::chrono::microseconds( nLatency ) );
+		return new( std::nothrow ) CmdSink::CBufferResponse( std::move( code ), {} );
+	}
+
+private:
+	Compiler::MockSettings m_Settings;
+};
+
+std::unique_ptr<Compiler::IBackend> Compiler::CreateMockCompiler( const MockSettings& settings )
+{
+	return std::make_unique<CMockCompiler>( settings );
+}
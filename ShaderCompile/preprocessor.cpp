@@ -0,0 +1,855 @@
+#include "preprocessor.h"
+
+#include "cfgprocessor.h"
+#include "d3dxfxc.h"
+#include "robin_hood.h"
+#include <algorithm>
+#include <mutex>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+using namespace std::literals;
+
+namespace Preprocessor
+{
+static constexpr uint32_t MAX_INCLUDE_DEPTH = 64;
+static constexpr uint32_t MAX_EXPAND_DEPTH  = 64;
+
+enum class TokenType : uint8_t
+{
+	Identifier,
+	Number,
+	String,
+	Punct
+};
+
+struct Token_t
+{
+	std::string_view m_Text;
+	TokenType m_eType;
+	bool m_bSpace; // Whitespace in front of it, "a + +b" is not "a ++b"
+};
+
+struct Line_t
+{
+	Digest_t m_Hash;    // Tokens and line number, what the line adds to the source when it is live
+	uint32_t m_nLine;   // Logical line, continued lines count as one
+	uint32_t m_nFirst;  // First token
+	uint32_t m_nCount;
+	bool m_bDirective;
+};
+
+struct File_t
+{
+	std::string m_Text; // Continued lines joined, tokens point into it
+	std::vector<Token_t> m_Tokens;
+	std::vector<Line_t> m_Lines;
+	Digest_t m_NameHash;
+};
+
+struct Macro_t
+{
+	std::span<const Token_t> m_Body;
+	std::vector<std::string_view> m_Params;
+	bool m_bFunction;
+	bool m_bVariadic;
+	bool m_bPasting; // ## in the body
+};
+
+using Digest::Mix;
+
+static inline Digest_t HashText( std::string_view text ) noexcept
+{
+	return Digest::Bytes( text.data(), text.size() );
+}
+
+static inline bool IsIdentStart( char c ) noexcept
+{
+	return ( c >= 'a' && c <= 'z' ) || ( c >= 'A' && c <= 'Z' ) || c == '_';
+}
+
+static inline bool IsIdentChar( char c ) noexcept
+{
+	return IsIdentStart( c ) || ( c >= '0' && c <= '9' );
+}
+
+static inline bool IsDigit( char c ) noexcept
+{
+	return c >= '0' && c <= '9';
+}
+
+// Longest ones first
+static constexpr std::string_view s_Puncts[] = {
+	"<<="sv, ">>="sv, "..."sv,
+	"->"sv, "++"sv, "--"sv, "<<"sv, ">>"sv, "<="sv, ">="sv, "=="sv, "!="sv, "&&"sv, "||"sv,
+	"*="sv, "/="sv, "%="sv, "+="sv, "-="sv, "&="sv, "^="sv, "|="sv, "##"sv, "::"sv
+};
+
+// Splits text into tokens, comments are whitespace
+static void Tokenize( std::string_view text, std::vector<Token_t>& tokens, std::vector<Line_t>* pLines )
+{
+	uint32_t nLine = 1;
+	bool bSpace    = false;
+	bool bNewLine  = true;
+	for ( size_t i = 0; i < text.size(); )
+	{
+		const char c    = text[i];
+		const char next = i + 1 < text.size() ? text[i + 1] : '\0';
+		if ( c == '\n' )
+		{
+			++nLine;
+			bNewLine = true;
+			bSpace   = false;
+			++i;
+			continue;
+		}
+		if ( c == ' ' || c == '\t' || c == '\r' || c == '\f' || c == '\v' )
+		{
+			bSpace = true;
+			++i;
+			continue;
+		}
+		if ( c == '/' && next == '/' )
+		{
+			i      = std::min( text.find( '\n', i ), text.size() );
+			bSpace = true;
+			continue;
+		}
+		if ( c == '/' && next == '*' )
+		{
+			// The line goes on after the comment, even when the comment doesn't end on it
+			const size_t nEnd = std::min( text.find( "*/"sv, i + 2 ), text.size() );
+			nLine += static_cast<uint32_t>( std::count( text.begin() + i, text.begin() + nEnd, '\n' ) );
+			i      = std::min( nEnd + 2, text.size() );
+			bSpace = true;
+			continue;
+		}
+
+		size_t nLength = 1;
+		TokenType eType = TokenType::Punct;
+		if ( IsIdentStart( c ) )
+		{
+			eType = TokenType::Identifier;
+			while ( i + nLength < text.size() && IsIdentChar( text[i + nLength] ) )
+				++nLength;
+		}
+		else if ( IsDigit( c ) || ( c == '.' && IsDigit( next ) ) )
+		{
+			eType = TokenType::Number;
+			for ( ; i + nLength < text.size(); ++nLength )
+			{
+				const char n = text[i + nLength];
+				const char prev = text[i + nLength - 1];
+				if ( !IsIdentChar( n ) && n != '.' && !( ( n == '+' || n == '-' ) && ( prev == 'e' || prev == 'E' || prev == 'p' || prev == 'P' ) ) )
+					break;
+			}
+		}
+		else if ( c == '"' || c == '\'' )
+		{
+			eType = TokenType::String;
+			while ( i + nLength < text.size() && text[i + nLength] != c && text[i + nLength] != '\n' )
+				nLength += text[i + nLength] == '\\' && i + nLength + 1 < text.size() && text[i + nLength + 1] != '\n' ? 2 : 1;
+			if ( i + nLength < text.size() && text[i + nLength] == c )
+				++nLength;
+		}
+		else
+		{
+			for ( const std::string_view punct : s_Puncts )
+			{
+				if ( text.substr( i ).starts_with( punct ) )
+				{
+					nLength = punct.size();
+					break;
+				}
+			}
+		}
+
+		if ( pLines && bNewLine )
+		{
+			pLines->emplace_back( Line_t { {}, nLine, static_cast<uint32_t>( tokens.size() ), 0, c == '#' } );
+			bNewLine = false;
+		}
+		tokens.emplace_back( Token_t { text.substr( i, nLength ), eType, bSpace } );
+		if ( pLines )
+			++pLines->back().m_nCount;
+		bSpace = false;
+		i += nLength;
+	}
+}
+
+static std::mutex s_mtxFiles;
+static robin_hood::unordered_node_map<std::string, File_t> s_Files; // Every file seen, tokenized once for all commands
+static robin_hood::unordered_flat_set<std::string> s_MissingFiles; // Includes not in the file cache
+
+static const File_t* GetFile( std::string_view fileName )
+{
+	std::lock_guard guard{ s_mtxFiles };
+
+	const std::string name( fileName );
+	if ( const auto it = s_Files.find( name ); it != s_Files.end() )
+		return &it->second;
+	if ( s_MissingFiles.contains( name ) )
+		return nullptr;
+
+	// Includes resolve through the file cache just like they do for the compiler
+	const CSharedFile* pFile = fileCache.Get( name );
+	if ( !pFile )
+	{
+		s_MissingFiles.emplace( name );
+		return nullptr;
+	}
+
+	File_t& file = s_Files[name];
+	file.m_NameHash = HashText( name );
+
+	// Join continued lines first, everything after that sees logical lines only
+	const std::string_view src( static_cast<const char*>( pFile->Data() ), pFile->Size() );
+	file.m_Text.reserve( src.size() );
+	for ( size_t i = 0; i < src.size(); ++i )
+	{
+		if ( src[i] == '\\' && i + 1 < src.size() && src[i + 1] == '\n' )
+			++i;
+		else if ( src[i] == '\\' && i + 2 < src.size() && src[i + 1] == '\r' && src[i + 2] == '\n' )
+			i += 2;
+		else
+			file.m_Text += src[i];
+	}
+
+	Tokenize( file.m_Text, file.m_Tokens, &file.m_Lines );
+	for ( Line_t& line : file.m_Lines )
+	{
+		Digest_t hash { line.m_nLine, 0 };
+		for ( uint32_t i = 0; i < line.m_nCount; ++i )
+		{
+			const Token_t& token = file.m_Tokens[line.m_nFirst + i];
+			Digest_t tokenHash = HashText( token.m_Text );
+			tokenHash.m_nLow += i && token.m_bSpace;
+			hash = Mix( hash, tokenHash );
+		}
+		line.m_Hash = hash;
+	}
+
+	return &file;
+}
+
+static const File_t* Include( std::span<const Token_t> args )
+{
+	if ( args.empty() )
+		return nullptr;
+
+	// Computed includes are left to the compiler
+	const Token_t& first = args[0];
+	if ( first.m_eType == TokenType::String && first.m_Text.size() >= 2 && first.m_Text.front() == '"' && first.m_Text.back() == '"' )
+		return GetFile( first.m_Text.substr( 1, first.m_Text.size() - 2 ) );
+	if ( first.m_Text == "<"sv )
+	{
+		for ( const Token_t& token : args.subspan( 1 ) )
+		{
+			if ( token.m_Text == ">"sv )
+				return GetFile( std::string_view( first.m_Text.data() + 1, token.m_Text.data() ) );
+		}
+	}
+	return nullptr;
+}
+
+// Walks the source of one command, the state is kept by the thread to spare allocations
+class CPreprocessor
+{
+public:
+	std::optional<Digest_t> Run( const CfgProcessor::ComboBuildCommand& command )
+	{
+		m_Macros.clear();
+		m_CommandDefines.clear();
+		m_arrReferenced.assign( command.defines.size(), false );
+		m_bAllReferenced = false;
+		m_nPasting       = 0;
+		m_PragmaOnce.clear();
+		m_Conds.clear();
+		m_arrExpanding.clear();
+		m_bLive = true;
+		m_Hash  = {};
+
+		// The command's defines come first, their values are tokenized just like the source
+		m_DefineTokens.clear();
+		std::vector<uint32_t> arrFirstToken;
+		for ( const auto& [name, value] : command.defines )
+		{
+			arrFirstToken.emplace_back( static_cast<uint32_t>( m_DefineTokens.size() ) );
+			Tokenize( value, m_DefineTokens, nullptr );
+		}
+		arrFirstToken.emplace_back( static_cast<uint32_t>( m_DefineTokens.size() ) );
+		for ( size_t i = 0; i < command.defines.size(); ++i )
+		{
+			const std::string_view name = command.defines[i].first;
+			m_CommandDefines.insert_or_assign( name, i );
+			m_Macros.insert_or_assign( name, Macro_t { std::span<const Token_t>( m_DefineTokens ).subspan( arrFirstToken[i], arrFirstToken[i + 1] - arrFirstToken[i] ), {}, false, false, false } );
+		}
+
+		const File_t* pFile = GetFile( command.fileName );
+		if ( !pFile || !Walk( *pFile, 0 ) || !m_Conds.empty() )
+			return std::nullopt;
+
+		// Defines the source never refers to don't change it, SHADERCOMBO is the usual one
+		Digest_t hash = m_Hash;
+		for ( size_t i = 0; i < command.defines.size(); ++i )
+		{
+			if ( m_bAllReferenced || m_arrReferenced[i] )
+				hash = Mix( Mix( hash, HashText( command.defines[i].first ) ), HashText( command.defines[i].second ) );
+		}
+		return hash;
+	}
+
+private:
+	struct Cond_t
+	{
+		bool m_bParentLive;
+		bool m_bTaken;
+		bool m_bElse;
+	};
+
+	bool Walk( const File_t& file, uint32_t nDepth )
+	{
+		if ( nDepth > MAX_INCLUDE_DEPTH )
+			return false;
+
+		const size_t nConds = m_Conds.size();
+		m_Hash = Mix( m_Hash, file.m_NameHash );
+		for ( const Line_t& line : file.m_Lines )
+		{
+			const Token_t* pTokens = &file.m_Tokens[line.m_nFirst];
+			if ( !line.m_bDirective )
+			{
+				if ( m_bLive )
+					HashLine( line, pTokens, true );
+				continue;
+			}
+
+			// Null directive
+			if ( line.m_nCount == 1 )
+				continue;
+
+			const std::string_view directive = pTokens[1].m_Text;
+			const std::span<const Token_t> args( pTokens + 2, line.m_nCount - 2 );
+			if ( directive == "if"sv || directive == "ifdef"sv || directive == "ifndef"sv )
+			{
+				bool bValue = false;
+				if ( m_bLive && !Condition( directive, args, bValue ) )
+					return false;
+				m_Conds.emplace_back( Cond_t { m_bLive, bValue, false } );
+				m_bLive = m_bLive && bValue;
+			}
+			else if ( directive == "elif"sv )
+			{
+				if ( m_Conds.size() == nConds || m_Conds.back().m_bElse )
+					return false;
+				Cond_t& cond = m_Conds.back();
+				bool bValue  = false;
+				if ( cond.m_bParentLive && !cond.m_bTaken && !Condition( directive, args, bValue ) )
+					return false;
+				m_bLive = cond.m_bParentLive && !cond.m_bTaken && bValue;
+				cond.m_bTaken |= bValue;
+			}
+			else if ( directive == "else"sv )
+			{
+				if ( m_Conds.size() == nConds || m_Conds.back().m_bElse )
+					return false;
+				Cond_t& cond = m_Conds.back();
+				m_bLive      = cond.m_bParentLive && !cond.m_bTaken;
+				cond.m_bElse = cond.m_bTaken = true;
+			}
+			else if ( directive == "endif"sv )
+			{
+				if ( m_Conds.size() == nConds )
+					return false;
+				m_bLive = m_Conds.back().m_bParentLive;
+				m_Conds.pop_back();
+			}
+			else if ( !m_bLive )
+				continue;
+			else if ( directive == "define"sv )
+			{
+				HashLine( line, pTokens, false );
+				if ( !Define( args ) )
+					return false;
+			}
+			else if ( directive == "undef"sv )
+			{
+				HashLine( line, pTokens, false );
+				if ( args.empty() || args[0].m_eType != TokenType::Identifier )
+					return false;
+				Undefine( args[0].m_Text );
+			}
+			else if ( directive == "include"sv )
+			{
+				HashLine( line, pTokens, true );
+				const File_t* pInclude = Include( args );
+				if ( !pInclude )
+					return false;
+				if ( !m_PragmaOnce.contains( pInclude ) && !Walk( *pInclude, nDepth + 1 ) )
+					return false;
+			}
+			else if ( directive == "pragma"sv && args.size() == 1 && args[0].m_Text == "once"sv )
+				m_PragmaOnce.emplace( &file );
+			else if ( directive == "pragma"sv || directive == "line"sv )
+				HashLine( line, pTokens, true );
+			else
+				return false; // #error and anything unknown, the compiler has the final say
+		}
+		m_Hash = Mix( m_Hash, { ~file.m_NameHash.m_nLow, ~file.m_NameHash.m_nHigh } );
+
+		return m_Conds.size() == nConds;
+	}
+
+	// bExpanded: macros on the line are expanded right away, bodies of definitions only once they are used
+	void HashLine( const Line_t& line, const Token_t* pTokens, bool bExpanded )
+	{
+		m_Hash = Mix( m_Hash, line.m_Hash );
+		for ( uint32_t i = 0; i < line.m_nCount; ++i )
+		{
+			const Token_t& token = pTokens[i];
+			if ( token.m_eType != TokenType::Identifier )
+				continue;
+			if ( const auto it = m_CommandDefines.find( token.m_Text ); it != m_CommandDefines.end() )
+				m_arrReferenced[it->second] = true;
+			// Pasting can make up the name of any define
+			if ( bExpanded && m_nPasting && !m_bAllReferenced && ReachesPasting( token.m_Text ) )
+				m_bAllReferenced = true;
+		}
+	}
+
+	// Whether expanding the name may paste tokens, through the bodies of the macros as they are now
+	bool ReachesPasting( std::string_view name )
+	{
+		m_arrVisited.clear();
+		m_arrVisited.emplace_back( name );
+		for ( size_t i = 0; i < m_arrVisited.size(); ++i )
+		{
+			const auto it = m_Macros.find( m_arrVisited[i] );
+			if ( it == m_Macros.end() )
+				continue;
+			if ( it->second.m_bPasting )
+				return true;
+			for ( const Token_t& token : it->second.m_Body )
+			{
+				if ( token.m_eType == TokenType::Identifier && std::find( m_arrVisited.begin(), m_arrVisited.end(), token.m_Text ) == m_arrVisited.end() )
+					m_arrVisited.emplace_back( token.m_Text );
+			}
+		}
+		return false;
+	}
+
+	void Undefine( std::string_view name )
+	{
+		if ( const auto it = m_Macros.find( name ); it != m_Macros.end() )
+		{
+			m_nPasting -= it->second.m_bPasting;
+			m_Macros.erase( it );
+		}
+	}
+
+	bool Define( std::span<const Token_t> args )
+	{
+		if ( args.empty() || args[0].m_eType != TokenType::Identifier )
+			return false;
+
+		Macro_t macro { {}, {}, false, false, false };
+		size_t i = 1;
+		if ( args.size() > 1 && args[1].m_Text == "("sv && !args[1].m_bSpace )
+		{
+			macro.m_bFunction = true;
+			for ( i = 2; i < args.size() && args[i].m_Text != ")"sv; ++i )
+			{
+				if ( args[i].m_eType == TokenType::Identifier )
+					macro.m_Params.emplace_back( args[i].m_Text );
+				else if ( args[i].m_Text == "..."sv )
+				{
+					macro.m_Params.emplace_back( "__VA_ARGS__"sv );
+					macro.m_bVariadic = true;
+				}
+				else if ( args[i].m_Text != ","sv )
+					return false;
+			}
+			if ( i++ == args.size() )
+				return false;
+		}
+
+		macro.m_Body     = args.subspan( i );
+		macro.m_bPasting = std::any_of( macro.m_Body.begin(), macro.m_Body.end(), []( const Token_t& token ) { return token.m_Text == "##"sv; } );
+		Undefine( args[0].m_Text );
+		m_nPasting += macro.m_bPasting;
+		m_Macros.emplace( args[0].m_Text, std::move( macro ) );
+		return true;
+	}
+
+	bool Condition( std::string_view directive, std::span<const Token_t> args, bool& bValue )
+	{
+		if ( directive == "ifdef"sv || directive == "ifndef"sv )
+		{
+			if ( args.empty() || args[0].m_eType != TokenType::Identifier )
+				return false;
+			bool bDefined;
+			if ( !IsDefined( args[0].m_Text, bDefined ) )
+				return false;
+			bValue = bDefined == ( directive == "ifdef"sv );
+			return true;
+		}
+
+		m_Expanded.clear();
+		if ( !Expand( args, m_Expanded, 0 ) )
+			return false;
+
+		m_pExpr    = m_Expanded.data();
+		m_pExprEnd = m_Expanded.data() + m_Expanded.size();
+		int64_t nValue;
+		if ( !Ternary( nValue ) || m_pExpr != m_pExprEnd )
+			return false;
+		bValue = nValue != 0;
+		return true;
+	}
+
+	// Macros the compiler defines on its own are unknown here, so are names it may treat specially
+	bool IsDefined( std::string_view name, bool& bDefined ) const
+	{
+		bDefined = m_Macros.contains( name );
+		return bDefined || !name.starts_with( "__"sv );
+	}
+
+	// Replaces macros in a condition, defined() is left for the evaluation
+	bool Expand( std::span<const Token_t> in, std::vector<Token_t>& out, uint32_t nDepth )
+	{
+		if ( nDepth > MAX_EXPAND_DEPTH )
+			return false;
+
+		for ( size_t i = 0; i < in.size(); ++i )
+		{
+			const Token_t& token = in[i];
+			if ( token.m_eType != TokenType::Identifier )
+			{
+				out.emplace_back( token );
+				continue;
+			}
+
+			if ( token.m_Text == "defined"sv )
+			{
+				out.emplace_back( token );
+				const size_t nOperand = i + 1 < in.size() && in[i + 1].m_Text == "("sv ? 3 : 1;
+				for ( size_t j = 0; j < nOperand && i + 1 < in.size(); ++j )
+					out.emplace_back( in[++i] );
+				continue;
+			}
+
+			const auto it = m_Macros.find( token.m_Text );
+			if ( it == m_Macros.end() || std::find( m_arrExpanding.begin(), m_arrExpanding.end(), token.m_Text ) != m_arrExpanding.end() )
+			{
+				out.emplace_back( token );
+				continue;
+			}
+
+			const Macro_t& macro = it->second;
+			if ( !macro.m_bFunction )
+			{
+				m_arrExpanding.emplace_back( token.m_Text );
+				const bool bOk = Expand( macro.m_Body, out, nDepth + 1 );
+				m_arrExpanding.pop_back();
+				if ( !bOk )
+					return false;
+				continue;
+			}
+
+			// The arguments may come from what follows the expansion, not worth following
+			if ( i + 1 >= in.size() || in[i + 1].m_Text != "("sv )
+				return false;
+
+			std::vector<std::span<const Token_t>> arrArgs;
+			size_t nArgStart = i + 2;
+			int nParens      = 0;
+			size_t j         = i + 2;
+			for ( ; j < in.size(); ++j )
+			{
+				const std::string_view text = in[j].m_Text;
+				if ( text == "("sv )
+					++nParens;
+				else if ( text == ")"sv && nParens )
+					--nParens;
+				else if ( text == ")"sv || ( text == ","sv && !nParens && !( macro.m_bVariadic && arrArgs.size() + 1 >= macro.m_Params.size() ) ) )
+				{
+					arrArgs.emplace_back( in.subspan( nArgStart, j - nArgStart ) );
+					nArgStart = j + 1;
+					if ( text == ")"sv )
+						break;
+				}
+			}
+			if ( j == in.size() )
+				return false;
+			if ( macro.m_Params.empty() && arrArgs.size() == 1 && arrArgs[0].empty() )
+				arrArgs.clear();
+			if ( arrArgs.size() != macro.m_Params.size() )
+				return false;
+
+			std::vector<Token_t> substituted;
+			for ( size_t k = 0; k < macro.m_Body.size(); ++k )
+			{
+				const Token_t& bodyToken = macro.m_Body[k];
+				if ( bodyToken.m_Text == "#"sv || bodyToken.m_Text == "##"sv )
+					return false; // Not worth following in a condition
+
+				const auto itParam = std::find( macro.m_Params.begin(), macro.m_Params.end(), bodyToken.m_Text );
+				if ( bodyToken.m_eType != TokenType::Identifier || itParam == macro.m_Params.end() )
+					substituted.emplace_back( bodyToken );
+				else if ( !Expand( arrArgs[itParam - macro.m_Params.begin()], substituted, nDepth + 1 ) )
+					return false;
+			}
+
+			m_arrExpanding.emplace_back( token.m_Text );
+			const bool bOk = Expand( substituted, out, nDepth + 1 );
+			m_arrExpanding.pop_back();
+			if ( !bOk )
+				return false;
+			i = j;
+		}
+		return true;
+	}
+
+	bool Accept( std::string_view text )
+	{
+		if ( m_pExpr == m_pExprEnd || m_pExpr->m_Text != text )
+			return false;
+		++m_pExpr;
+		return true;
+	}
+
+	bool Ternary( int64_t& nValue )
+	{
+		if ( !Binary( 0, nValue ) )
+			return false;
+		if ( !Accept( "?"sv ) )
+			return true;
+
+		int64_t nTrue, nFalse;
+		if ( !Ternary( nTrue ) || !Accept( ":"sv ) || !Ternary( nFalse ) )
+			return false;
+		nValue = nValue ? nTrue : nFalse;
+		return true;
+	}
+
+	static int Precedence( std::string_view op ) noexcept
+	{
+		static constexpr std::pair<std::string_view, int> s_Ops[] = {
+			{ "||"sv, 1 }, { "&&"sv, 2 }, { "|"sv, 3 }, { "^"sv, 4 }, { "&"sv, 5 }, { "=="sv, 6 }, { "!="sv, 6 },
+			{ "<"sv, 7 }, { ">"sv, 7 }, { "<="sv, 7 }, { ">="sv, 7 }, { "<<"sv, 8 }, { ">>"sv, 8 },
+			{ "+"sv, 9 }, { "-"sv, 9 }, { "*"sv, 10 }, { "/"sv, 10 }, { "%"sv, 10 }
+		};
+		for ( const auto& [name, nPrecedence] : s_Ops )
+		{
+			if ( name == op )
+				return nPrecedence;
+		}
+		return -1;
+	}
+
+	bool Binary( int nMinPrecedence, int64_t& nValue )
+	{
+		if ( !Unary( nValue ) )
+			return false;
+
+		for ( ;; )
+		{
+			if ( m_pExpr == m_pExprEnd )
+				return true;
+			const std::string_view op = m_pExpr->m_Text;
+			const int nPrecedence     = m_pExpr->m_eType == TokenType::Punct ? Precedence( op ) : -1;
+			if ( nPrecedence < 0 || nPrecedence < nMinPrecedence )
+				return true;
+			++m_pExpr;
+
+			int64_t nRight;
+			if ( !Binary( nPrecedence + 1, nRight ) )
+				return false;
+
+			if ( ( op == "/"sv || op == "%"sv ) && nRight == 0 )
+				return false;
+			if ( ( op == "<<"sv || op == ">>"sv ) && ( nRight < 0 || nRight > 63 ) )
+				return false;
+
+			if ( op == "||"sv ) nValue = nValue || nRight;
+			else if ( op == "&&"sv ) nValue = nValue && nRight;
+			else if ( op == "|"sv ) nValue |= nRight;
+			else if ( op == "^"sv ) nValue ^= nRight;
+			else if ( op == "&"sv ) nValue &= nRight;
+			else if ( op == "=="sv ) nValue = nValue == nRight;
+			else if ( op == "!="sv ) nValue = nValue != nRight;
+			else if ( op == "<"sv ) nValue = nValue < nRight;
+			else if ( op == ">"sv ) nValue = nValue > nRight;
+			else if ( op == "<="sv ) nValue = nValue <= nRight;
+			else if ( op == ">="sv ) nValue = nValue >= nRight;
+			else if ( op == "<<"sv ) nValue = static_cast<int64_t>( static_cast<uint64_t>( nValue ) << nRight );
+			else if ( op == ">>"sv ) nValue >>= nRight;
+			else if ( op == "+"sv ) nValue = static_cast<int64_t>( static_cast<uint64_t>( nValue ) + static_cast<uint64_t>( nRight ) );
+			else if ( op == "-"sv ) nValue = static_cast<int64_t>( static_cast<uint64_t>( nValue ) - static_cast<uint64_t>( nRight ) );
+			else if ( op == "*"sv ) nValue = static_cast<int64_t>( static_cast<uint64_t>( nValue ) * static_cast<uint64_t>( nRight ) );
+			else if ( op == "/"sv ) nValue = nRight == -1 ? static_cast<int64_t>( 0 - static_cast<uint64_t>( nValue ) ) : nValue / nRight;
+			else nValue = nRight == -1 ? 0 : nValue % nRight;
+		}
+	}
+
+	bool Unary( int64_t& nValue )
+	{
+		if ( m_pExpr == m_pExprEnd )
+			return false;
+
+		const Token_t& token = *m_pExpr++;
+		if ( token.m_Text == "!"sv || token.m_Text == "~"sv || token.m_Text == "-"sv || token.m_Text == "+"sv )
+		{
+			if ( !Unary( nValue ) )
+				return false;
+			if ( token.m_Text == "!"sv ) nValue = !nValue;
+			else if ( token.m_Text == "~"sv ) nValue = ~nValue;
+			else if ( token.m_Text == "-"sv ) nValue = static_cast<int64_t>( 0 - static_cast<uint64_t>( nValue ) );
+			return true;
+		}
+		if ( token.m_Text == "("sv )
+			return Ternary( nValue ) && Accept( ")"sv );
+
+		if ( token.m_eType == TokenType::Number )
+			return Number( token.m_Text, nValue );
+
+		if ( token.m_eType != TokenType::Identifier )
+			return false;
+
+		if ( token.m_Text == "defined"sv )
+		{
+			const bool bParen = Accept( "("sv );
+			if ( m_pExpr == m_pExprEnd || m_pExpr->m_eType != TokenType::Identifier )
+				return false;
+			bool bDefined;
+			if ( !IsDefined( ( m_pExpr++ )->m_Text, bDefined ) || ( bParen && !Accept( ")"sv ) ) )
+				return false;
+			nValue = bDefined;
+			return true;
+		}
+
+		// Names left over after expansion are 0, unless the compiler may know better
+		if ( token.m_Text.starts_with( "__"sv ) || token.m_Text == "true"sv || token.m_Text == "false"sv )
+			return false;
+		nValue = 0;
+		return true;
+	}
+
+	// Integers only, suffixes that change the type of the expression aren't followed
+	static bool Number( std::string_view text, int64_t& nValue )
+	{
+		while ( !text.empty() && ( text.back() == 'l' || text.back() == 'L' ) )
+			text.remove_suffix( 1 );
+
+		int nBase = 10;
+		if ( text.size() > 2 && text[0] == '0' && ( text[1] == 'x' || text[1] == 'X' ) )
+		{
+			nBase = 16;
+			text.remove_prefix( 2 );
+		}
+		else if ( text.size() > 1 && text[0] == '0' )
+			nBase = 8;
+
+		uint64_t nResult = 0;
+		for ( const char c : text )
+		{
+			int nDigit;
+			if ( c >= '0' && c <= '9' )
+				nDigit = c - '0';
+			else if ( c >= 'a' && c <= 'f' )
+				nDigit = c - 'a' + 10;
+			else if ( c >= 'A' && c <= 'F' )
+				nDigit = c - 'A' + 10;
+			else
+				return false;
+			if ( nDigit >= nBase )
+				return false;
+			nResult = nResult * nBase + nDigit;
+		}
+		nValue = static_cast<int64_t>( nResult );
+		return true;
+	}
+
+	robin_hood::unordered_flat_map<std::string_view, Macro_t> m_Macros;
+	robin_hood::unordered_flat_map<std::string_view, size_t> m_CommandDefines;
+	std::vector<Token_t> m_DefineTokens;
+	std::vector<bool> m_arrReferenced;
+	bool m_bAllReferenced = false;
+	uint32_t m_nPasting   = 0; // Macros defined with ## in them
+	std::vector<std::string_view> m_arrVisited;
+	robin_hood::unordered_flat_set<const File_t*> m_PragmaOnce;
+	std::vector<Cond_t> m_Conds;
+	bool m_bLive = true;
+	Digest_t m_Hash {};
+
+	std::vector<std::string_view> m_arrExpanding; // Macros being expanded, they don't expand again inside themselves
+	std::vector<Token_t> m_Expanded;
+	const Token_t* m_pExpr    = nullptr;
+	const Token_t* m_pExprEnd = nullptr;
+};
+
+std::optional<std::vector<bool>> ReferencedNames( std::string_view fileName, std::span<const std::string_view> names )
+{
+	// Every file that may get included, whatever the conditions around the include are
+	const File_t* pFile = GetFile( fileName );
+	if ( !pFile )
+		return std::nullopt;
+	std::vector<const File_t*> arrFiles { pFile };
+	robin_hood::unordered_flat_set<const File_t*> files { pFile };
+
+	robin_hood::unordered_flat_set<std::string_view> pieces; // Identifiers and numbers, what pasting can glue names from
+	bool bPasting = false;
+	for ( size_t i = 0; i < arrFiles.size(); ++i )
+	{
+		const File_t& file = *arrFiles[i];
+		for ( const Line_t& line : file.m_Lines )
+		{
+			const Token_t* pTokens = &file.m_Tokens[line.m_nFirst];
+			if ( line.m_bDirective && line.m_nCount > 1 && pTokens[1].m_Text == "include"sv )
+			{
+				const File_t* pInclude = Include( std::span<const Token_t>( pTokens + 2, line.m_nCount - 2 ) );
+				if ( !pInclude )
+					return std::nullopt;
+				if ( files.emplace( pInclude ).second )
+					arrFiles.emplace_back( pInclude );
+				continue;
+			}
+
+			for ( uint32_t j = 0; j < line.m_nCount; ++j )
+			{
+				const Token_t& token = pTokens[j];
+				if ( token.m_eType == TokenType::Identifier || token.m_eType == TokenType::Number )
+					pieces.emplace( token.m_Text );
+				bPasting |= token.m_Text == "##"sv;
+			}
+		}
+	}
+
+	std::vector<bool> arrReferenced( names.size() );
+	for ( size_t i = 0; i < names.size(); ++i )
+	{
+		const std::string_view name = names[i];
+		bool bReferenced = pieces.contains( name );
+
+		// A pasted name starts with one piece and ends with another
+		for ( size_t nSplit = 1; bPasting && !bReferenced && nSplit < name.size(); ++nSplit )
+		{
+			if ( pieces.contains( name.substr( 0, nSplit ) ) )
+			{
+				for ( size_t nSuffix = nSplit; nSuffix < name.size() && !bReferenced; ++nSuffix )
+					bReferenced = pieces.contains( name.substr( nSuffix ) );
+			}
+		}
+		arrReferenced[i] = bReferenced;
+	}
+	return arrReferenced;
+}
+
+std::optional<Digest_t> EffectiveSourceHash( const CfgProcessor::ComboBuildCommand& command )
+{
+	static thread_local CPreprocessor s_Preprocessor;
+	return s_Preprocessor.Run( command );
+}
+} // namespace Preprocessor
@@ -0,0 +1,27 @@
+#pragma once
+
+#include "digest.hpp"
+#include <cstdint>
+#include <optional>
+#include <span>
+#include <string_view>
+#include <vector>
+
+namespace CfgProcessor
+{
+	struct ComboBuildCommand;
+}
+
+// Just enough of the HLSL preprocessor to tell which combos compile the same source. Includes are expanded from
+// the file cache and conditionals evaluated with the defines of the command, everything else is hashed as tokens.
+namespace Preprocessor
+{
+	// Digest of the source the compiler gets to see after preprocessing, along with the values of the command's
+	// defines the source refers to. Nothing when the source uses something this preprocessor can't follow.
+	[[nodiscard]] std::optional<Digest_t> EffectiveSourceHash( const CfgProcessor::ComboBuildCommand& command );
+
+	// Whether any condition, line or macro body of the file and of everything it may include names each of the
+	// names, also through pasting. One pass over the tokens, no matter how many combos the shader has. Nothing
+	// when an include can't be followed.
+	[[nodiscard]] std::optional<std::vector<bool>> ReferencedNames( std::string_view fileName, std::span<const std::string_view> names );
+} // namespace Preprocessor
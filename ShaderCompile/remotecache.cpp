@@ -0,0 +1,320 @@
+#include "cacheprotocol.hpp"
+#include "remotecache.h"
+
+#include "termcolor/style.hpp"
+#include "termcolors.hpp"
+#include "robin_hood.h"
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <iostream>
+#include <list>
+#include <mutex>
+#include <thread>
+
+using namespace std::literals;
+
+namespace RemoteCache
+{
+static constexpr uint32_t CONNECT_TIMEOUT_MS = 2000;
+static constexpr uint32_t IO_TIMEOUT_MS      = 30000; // A server this slow is as good as gone
+static constexpr uint64_t MAX_UNCLAIMED_SIZE = 64ull << 20; // Prefetched values nobody picked up yet, the oldest are dropped past it
+
+struct Lookup_t
+{
+	bool m_bDone     = false;
+	bool m_bUnclaimed = false; // In s_Unclaimed
+	uint32_t m_nWaiting = 0;
+	std::vector<char> m_Value;
+	std::list<uint64_t>::iterator m_itUnclaimed;
+};
+
+static CacheProtocol::Socket s_Socket = CacheProtocol::INVALID;
+static std::atomic<bool> s_bConnected;
+
+static std::mutex s_Mutex;
+static std::condition_variable s_cvSend;     // Sender waits for requests
+static std::condition_variable s_cvInFlight; // Receiver waits for sent lookups
+static std::condition_variable s_cvReply;    // Get waits for its value
+static robin_hood::unordered_node_map<uint64_t, Lookup_t> s_Lookups; // Requested and not picked up yet
+static std::vector<uint64_t> s_arrGets;                              // Lookups not sent yet
+static std::vector<std::pair<uint64_t, std::vector<char>>> s_arrPuts;
+static std::deque<std::vector<uint64_t>> s_InFlight;                 // Sent lookups in order, waiting for replies
+static std::list<uint64_t> s_Unclaimed;                              // Replies nobody waits for, oldest first
+static uint64_t s_nUnclaimedSize = 0;
+static bool s_bQuit = false;
+static bool s_bSent = false; // Sender is gone, nothing more goes in flight
+
+static std::thread s_Sender;
+static std::thread s_Receiver;
+
+static std::atomic<uint64_t> s_nRequested;
+static std::atomic<uint64_t> s_nFound;
+static std::atomic<uint64_t> s_nUploaded;
+
+static inline uint64_t UnclaimedSize( const Lookup_t& lookup ) noexcept
+{
+	return lookup.m_Value.size() + sizeof( Lookup_t );
+}
+
+static void RemoveUnclaimed( Lookup_t& lookup )
+{
+	if ( !std::exchange( lookup.m_bUnclaimed, false ) )
+		return;
+	s_Unclaimed.erase( lookup.m_itUnclaimed );
+	s_nUnclaimedSize -= UnclaimedSize( lookup );
+}
+
+// Keys found locally or answered by another combo are never asked for, their prefetched values would stay forever.
+// A dropped value that is asked for after all just costs another round trip.
+static void DropUnclaimed()
+{
+	while ( s_nUnclaimedSize > MAX_UNCLAIMED_SIZE )
+	{
+		const auto it = s_Lookups.find( s_Unclaimed.front() );
+		RemoveUnclaimed( it->second );
+		if ( !it->second.m_nWaiting )
+			s_Lookups.erase( it );
+	}
+}
+
+// Any error drops the server for the rest of the run, waiting lookups turn into misses
+static void Fail()
+{
+	{
+		std::lock_guard guard{ s_Mutex };
+		if ( !s_bConnected.exchange( false ) )
+			return;
+
+		for ( auto& [nHash, lookup] : s_Lookups )
+			lookup.m_bDone = true;
+		s_arrGets.clear();
+		s_arrPuts.clear();
+		s_InFlight.clear();
+		CacheProtocol::ShutdownSocket( s_Socket );
+	}
+	s_cvSend.notify_all();
+	s_cvInFlight.notify_all();
+	s_cvReply.notify_all();
+
+	std::cout << clr::pinkish << "Lost connection to remote compile cache, continuing without it"sv << clr::reset << std::endl;
+}
+
+static void DoSend()
+{
+	std::vector<char> buffer;
+	for ( ;; )
+	{
+		std::vector<uint64_t> arrGets;
+		std::vector<std::pair<uint64_t, std::vector<char>>> arrPuts;
+		{
+			std::unique_lock guard{ s_Mutex };
+			s_cvSend.wait( guard, [] { return s_bQuit || !s_arrGets.empty() || !s_arrPuts.empty() || !s_bConnected; } );
+			if ( !s_bConnected || ( s_arrGets.empty() && s_arrPuts.empty() ) )
+				break;
+
+			if ( s_arrGets.size() > CacheProtocol::MAX_BATCH )
+			{
+				arrGets.assign( s_arrGets.begin(), s_arrGets.begin() + CacheProtocol::MAX_BATCH );
+				s_arrGets.erase( s_arrGets.begin(), s_arrGets.begin() + CacheProtocol::MAX_BATCH );
+			}
+			else
+				std::swap( arrGets, s_arrGets );
+			std::swap( arrPuts, s_arrPuts );
+
+			if ( !arrGets.empty() )
+				s_InFlight.emplace_back( arrGets );
+		}
+		s_cvInFlight.notify_one();
+
+		if ( !arrGets.empty() )
+		{
+			const uint32_t nCount = static_cast<uint32_t>( arrGets.size() );
+			buffer.resize( 1 + sizeof( nCount ) + nCount * sizeof( uint64_t ) );
+			buffer[0] = CacheProtocol::OP_GET;
+			memcpy( &buffer[1], &nCount, sizeof( nCount ) );
+			memcpy( &buffer[1 + sizeof( nCount )], arrGets.data(), nCount * sizeof( uint64_t ) );
+			if ( !CacheProtocol::SendAll( s_Socket, buffer.data(), buffer.size() ) )
+				return Fail();
+			s_nRequested += nCount;
+		}
+
+		for ( const auto& [nHash, value] : arrPuts )
+		{
+			const uint32_t nSize = static_cast<uint32_t>( value.size() );
+			char header[1 + sizeof( nHash ) + sizeof( nSize )];
+			header[0] = CacheProtocol::OP_PUT;
+			memcpy( &header[1], &nHash, sizeof( nHash ) );
+			memcpy( &header[1 + sizeof( nHash )], &nSize, sizeof( nSize ) );
+			if ( !CacheProtocol::SendAll( s_Socket, header, sizeof( header ) ) || !CacheProtocol::SendAll( s_Socket, value.data(), nSize ) )
+				return Fail();
+			++s_nUploaded;
+		}
+	}
+
+	{
+		std::lock_guard guard{ s_Mutex };
+		s_bSent = true;
+	}
+	s_cvInFlight.notify_one();
+}
+
+static void DoReceive()
+{
+	for ( ;; )
+	{
+		std::vector<uint64_t> arrHashes;
+		{
+			std::unique_lock guard{ s_Mutex };
+			s_cvInFlight.wait( guard, [] { return s_bSent || !s_InFlight.empty() || !s_bConnected; } );
+			if ( !s_bConnected || s_InFlight.empty() )
+				return;
+			arrHashes = std::move( s_InFlight.front() );
+			s_InFlight.pop_front();
+		}
+
+		for ( const uint64_t nHash : arrHashes )
+		{
+			uint32_t nSize;
+			if ( !CacheProtocol::RecvAll( s_Socket, &nSize, sizeof( nSize ) ) || nSize > CacheProtocol::MAX_VALUE )
+				return Fail();
+			std::vector<char> value( nSize );
+			if ( !CacheProtocol::RecvAll( s_Socket, value.data(), nSize ) )
+				return Fail();
+
+			s_nFound += nSize != 0;
+			{
+				std::lock_guard guard{ s_Mutex };
+				Lookup_t& lookup = s_Lookups[nHash];
+				lookup.m_bDone   = true;
+				lookup.m_Value   = std::move( value );
+				if ( !lookup.m_nWaiting )
+				{
+					lookup.m_bUnclaimed  = true;
+					lookup.m_itUnclaimed = s_Unclaimed.emplace( s_Unclaimed.end(), nHash );
+					s_nUnclaimedSize += UnclaimedSize( lookup );
+					DropUnclaimed();
+				}
+			}
+			s_cvReply.notify_all();
+		}
+	}
+}
+
+bool Connect( const std::string& address )
+{
+	std::string host;
+	uint16_t nPort;
+	try
+	{
+		CacheProtocol::ParseAddress( address, host, nPort );
+	}
+	catch ( const std::exception& )
+	{
+		std::cout << clr::red << "Bad remote compile cache address "sv << address << clr::reset << std::endl;
+		return false;
+	}
+
+	if ( !CacheProtocol::Startup() || ( s_Socket = CacheProtocol::Connect( host, nPort, CONNECT_TIMEOUT_MS ) ) == CacheProtocol::INVALID )
+	{
+		std::cout << clr::pinkish << "Can't reach remote compile cache "sv << address << ", continuing without it"sv << clr::reset << std::endl;
+		return false;
+	}
+	CacheProtocol::SetTimeout( s_Socket, IO_TIMEOUT_MS );
+
+	s_bConnected = true;
+	s_Sender     = std::thread( DoSend );
+	s_Receiver   = std::thread( DoReceive );
+	return true;
+}
+
+bool IsConnected() noexcept
+{
+	return s_bConnected.load( std::memory_order_relaxed );
+}
+
+void Prefetch( const std::vector<uint64_t>& hashes )
+{
+	if ( !IsConnected() )
+		return;
+
+	{
+		std::lock_guard guard{ s_Mutex };
+		for ( const uint64_t nHash : hashes )
+		{
+			if ( s_Lookups.try_emplace( nHash ).second )
+				s_arrGets.emplace_back( nHash );
+		}
+	}
+	s_cvSend.notify_one();
+}
+
+bool Get( uint64_t nHash, std::vector<char>& value )
+{
+	if ( !IsConnected() )
+		return false;
+
+	std::unique_lock guard{ s_Mutex };
+	if ( !s_bConnected )
+		return false;
+
+	const auto [it, bNew] = s_Lookups.try_emplace( nHash );
+	Lookup_t& lookup      = it->second;
+	if ( bNew )
+	{
+		s_arrGets.emplace_back( nHash );
+		s_cvSend.notify_one();
+	}
+
+	RemoveUnclaimed( lookup );
+	++lookup.m_nWaiting;
+	s_cvReply.wait( guard, [&lookup] { return lookup.m_bDone; } );
+
+	// The same command may be waited on by more than one thread, the last one cleans up
+	if ( --lookup.m_nWaiting )
+		value = lookup.m_Value;
+	else
+	{
+		value = std::move( lookup.m_Value );
+		s_Lookups.erase( nHash );
+	}
+	return !value.empty();
+}
+
+void Put( uint64_t nHash, std::vector<char>&& value )
+{
+	if ( !IsConnected() || value.size() > CacheProtocol::MAX_VALUE )
+		return;
+
+	{
+		std::lock_guard guard{ s_Mutex };
+		s_arrPuts.emplace_back( nHash, std::move( value ) );
+	}
+	s_cvSend.notify_one();
+}
+
+void Disconnect()
+{
+	if ( !s_Sender.joinable() )
+		return;
+
+	{
+		std::lock_guard guard{ s_Mutex };
+		s_bQuit = true;
+	}
+	s_cvSend.notify_one();
+	s_Sender.join();
+	s_Receiver.join();
+
+	if ( s_bConnected )
+		std::cout << "Remote compile cache: "sv << clr::green << s_nFound << clr::reset << " of "sv << s_nRequested << " lookups found, "sv
+				  << s_nUploaded << " entries uploaded"sv << std::endl;
+
+	s_bConnected = false;
+	CacheProtocol::CloseSocket( s_Socket );
+	s_Socket = CacheProtocol::INVALID;
+	s_Lookups.clear();
+	s_Unclaimed.clear();
+	s_nUnclaimedSize = 0;
+}
+} // namespace RemoteCache
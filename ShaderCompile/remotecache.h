@@ -0,0 +1,24 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Client of a shared compile cache server, see cacheprotocol.hpp. Lookups of all threads go out
+// together in one request and replies are read while further requests are sent.
+// Once the server can't be reached every lookup is a miss and uploads are dropped.
+namespace RemoteCache
+{
+	// host[:port], returns false when the server can't be reached
+	bool Connect( const std::string& address );
+	[[nodiscard]] bool IsConnected() noexcept;
+
+	// Asks for the values ahead of time, Get picks them up
+	void Prefetch( const std::vector<uint64_t>& hashes );
+	// Waits for the value, asking for it now unless it was prefetched. False when the server doesn't have it
+	bool Get( uint64_t nHash, std::vector<char>& value );
+	void Put( uint64_t nHash, std::vector<char>&& value );
+
+	// Sends the remaining uploads, closes the connection and prints statistics
+	void Disconnect();
+} // namespace RemoteCache
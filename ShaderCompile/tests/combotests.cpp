@@ -0,0 +1,792 @@
+// Checks combo decoding, skip evaluation and counting against brute force.
+// Run with "bench" to time the same paths instead.
+
+#include "cfgprocessor.h"
+#include "exprprogram.h"
+#include "shaderparser.h"
+
+#include "termcolor/style.hpp"
+#include "termcolors.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace std::literals;
+namespace fs = std::filesystem;
+
+static constexpr uint64_t MAX_BRUTE_FORCE_COMBOS = 1 << 20; // Every combo is checked up to this many
+static constexpr uint64_t MAX_DECODED_COMBOS     = 1 << 16; // Larger entries decode random samples
+static constexpr uint64_t SAMPLES                = 1 << 16;
+static constexpr uint64_t MAX_PASSED_COMBOS      = 1 << 12; // Combos jumped over by Combo_GetNext checked on larger entries
+static constexpr size_t MAX_REPORTED_FAILURES    = 20;
+
+static uint64_t s_nChecks   = 0;
+static uint64_t s_nFailures = 0;
+
+// Every allocation of the process, combo handles and commands must not allocate once they are warmed up
+static std::atomic<uint64_t> s_nAllocations { 0 };
+
+void* operator new( std::size_t nSize )
+{
+	s_nAllocations.fetch_add( 1, std::memory_order_relaxed );
+	if ( void* p = std::malloc( nSize ? nSize : 1 ) )
+		return p;
+	throw std::bad_alloc();
+}
+void* operator new[]( std::size_t nSize )
+{
+	return operator new( nSize );
+}
+void operator delete( void* p ) noexcept
+{
+	std::free( p );
+}
+void operator delete[]( void* p ) noexcept
+{
+	std::free( p );
+}
+void operator delete( void* p, std::size_t ) noexcept
+{
+	std::free( p );
+}
+void operator delete[]( void* p, std::size_t ) noexcept
+{
+	std::free( p );
+}
+
+static void Check( bool bPassed, const std::string_view& what, uint64_t nWhere )
+{
+	++s_nChecks;
+	if ( bPassed )
+		return;
+	if ( s_nFailures++ < MAX_REPORTED_FAILURES )
+		std::cout << clr::red << "FAILED: "sv << clr::reset << what << " ("sv << nWhere << ")"sv << std::endl;
+}
+
+// Reference form of a skip expression, evaluated with plain C++ operators
+struct Expr_t
+{
+	enum class Kind
+	{
+		Const,
+		Var,
+		Not,
+		And,
+		Or,
+		Eq,
+		Neq,
+		G,
+		Ge,
+		L,
+		Le,
+	};
+
+	Kind m_eKind;
+	int m_nValue; // Constant, or slot of the variable with -1 for an unknown one
+	std::unique_ptr<Expr_t> m_pX;
+	std::unique_ptr<Expr_t> m_pY;
+};
+
+static std::unique_ptr<Expr_t> RandomExpr( std::mt19937_64& rng, int nSlots, int nDepth )
+{
+	auto pExpr = std::make_unique<Expr_t>();
+	const int nKind = nDepth > 0 ? std::uniform_int_distribution( 0, 10 )( rng ) : std::uniform_int_distribution( 0, 1 )( rng );
+	pExpr->m_eKind = static_cast<Expr_t::Kind>( nKind );
+	switch ( pExpr->m_eKind )
+	{
+	case Expr_t::Kind::Const:
+		pExpr->m_nValue = std::uniform_int_distribution( 0, 3 )( rng );
+		break;
+	case Expr_t::Kind::Var:
+		// Now and then a define the shader doesn't have
+		pExpr->m_nValue = nSlots && rng() % 16 ? std::uniform_int_distribution( 0, nSlots - 1 )( rng ) : -1;
+		break;
+	case Expr_t::Kind::Not:
+		pExpr->m_pX = RandomExpr( rng, nSlots, nDepth - 1 );
+		break;
+	default:
+		pExpr->m_pX = RandomExpr( rng, nSlots, nDepth - 1 );
+		pExpr->m_pY = RandomExpr( rng, nSlots, nDepth - 1 );
+		break;
+	}
+	return pExpr;
+}
+
+static int Evaluate( const Expr_t& expr, const int* pnValues )
+{
+	switch ( expr.m_eKind )
+	{
+	case Expr_t::Kind::Const:
+		return expr.m_nValue;
+	case Expr_t::Kind::Var:
+		return expr.m_nValue < 0 ? 0 : pnValues[expr.m_nValue];
+	case Expr_t::Kind::Not:
+		return !Evaluate( *expr.m_pX, pnValues );
+	case Expr_t::Kind::And:
+		return Evaluate( *expr.m_pX, pnValues ) && Evaluate( *expr.m_pY, pnValues );
+	case Expr_t::Kind::Or:
+		return Evaluate( *expr.m_pX, pnValues ) || Evaluate( *expr.m_pY, pnValues );
+	case Expr_t::Kind::Eq:
+		return Evaluate( *expr.m_pX, pnValues ) == Evaluate( *expr.m_pY, pnValues );
+	case Expr_t::Kind::Neq:
+		return Evaluate( *expr.m_pX, pnValues ) != Evaluate( *expr.m_pY, pnValues );
+	case Expr_t::Kind::G:
+		return Evaluate( *expr.m_pX, pnValues ) > Evaluate( *expr.m_pY, pnValues );
+	case Expr_t::Kind::Ge:
+		return Evaluate( *expr.m_pX, pnValues ) >= Evaluate( *expr.m_pY, pnValues );
+	case Expr_t::Kind::L:
+		return Evaluate( *expr.m_pX, pnValues ) < Evaluate( *expr.m_pY, pnValues );
+	case Expr_t::Kind::Le:
+		return Evaluate( *expr.m_pX, pnValues ) <= Evaluate( *expr.m_pY, pnValues );
+	}
+	return 0;
+}
+
+// Same instruction sequence as the expression tree of cfgprocessor emits
+static void Emit( const Expr_t& expr, CExprProgram& program )
+{
+	static constexpr CExprProgram::Op s_Compare[] = { CExprProgram::Op::Eq, CExprProgram::Op::Neq, CExprProgram::Op::G, CExprProgram::Op::Ge, CExprProgram::Op::L, CExprProgram::Op::Le };
+	switch ( expr.m_eKind )
+	{
+	case Expr_t::Kind::Const:
+		program.EmitConst( expr.m_nValue );
+		break;
+	case Expr_t::Kind::Var:
+		program.EmitVar( expr.m_nValue );
+		break;
+	case Expr_t::Kind::Not:
+		Emit( *expr.m_pX, program );
+		program.EmitOp( CExprProgram::Op::Not );
+		break;
+	case Expr_t::Kind::And:
+	case Expr_t::Kind::Or:
+	{
+		Emit( *expr.m_pX, program );
+		const size_t nJump = program.EmitJump( expr.m_eKind == Expr_t::Kind::And ? CExprProgram::Op::JumpIfFalse : CExprProgram::Op::JumpIfTrue );
+		Emit( *expr.m_pY, program );
+		program.EmitOp( CExprProgram::Op::Bool );
+		program.PatchJump( nJump );
+		break;
+	}
+	default:
+		Emit( *expr.m_pX, program );
+		Emit( *expr.m_pY, program );
+		program.EmitOp( s_Compare[static_cast<int>( expr.m_eKind ) - static_cast<int>( Expr_t::Kind::Eq )] );
+		break;
+	}
+}
+
+// Fully bracketed, so the parser's priorities don't matter
+static std::string Format( const Expr_t& expr, const std::vector<std::string>& names )
+{
+	static constexpr std::string_view s_Ops[] = { ""sv, ""sv, ""sv, "&&"sv, "||"sv, "=="sv, "!="sv, ">"sv, ">="sv, "<"sv, "<="sv };
+	switch ( expr.m_eKind )
+	{
+	case Expr_t::Kind::Const:
+		return std::to_string( expr.m_nValue );
+	case Expr_t::Kind::Var:
+		return "$"s + ( expr.m_nValue < 0 ? "UNKNOWN"s : names[expr.m_nValue] );
+	case Expr_t::Kind::Not:
+		return "!("s + Format( *expr.m_pX, names ) + ")"s;
+	default:
+		return "("s + Format( *expr.m_pX, names ) + " "s + std::string( s_Ops[static_cast<int>( expr.m_eKind )] ) + " "s + Format( *expr.m_pY, names ) + ")"s;
+	}
+}
+
+struct Shader_t
+{
+	CfgProcessor::ShaderConfig m_Config;
+	std::vector<std::string> m_Names; // By slot, the dynamic defines come first
+	std::vector<std::unique_ptr<Expr_t>> m_Skips;
+
+	bool IsSkipped( const int* pnValues ) const
+	{
+		for ( const auto& pSkip : m_Skips )
+		{
+			if ( Evaluate( *pSkip, pnValues ) )
+				return true;
+		}
+		return false;
+	}
+};
+
+static Shader_t RandomShader( std::mt19937_64& rng, const std::string& name, int nDynamic, int nStatic, int nMinRange, int nMaxRange, int nSkips )
+{
+	Shader_t shader;
+	CfgProcessor::ShaderConfig& conf = shader.m_Config;
+	conf.name          = name;
+	conf.main          = "main";
+	conf.version       = "30"sv;
+	conf.target        = "ps"sv;
+	conf.centroid_mask = 0;
+	conf.crc32         = 0;
+	conf.includes.emplace_back( "combotests.fxc" );
+
+	for ( int i = 0; i < nDynamic + nStatic; ++i )
+	{
+		const bool bStatic = i >= nDynamic;
+		const int nMin     = std::uniform_int_distribution( 0, 2 )( rng );
+		const int nMax     = nMin + std::uniform_int_distribution( nMinRange, nMaxRange )( rng );
+		std::string& define = shader.m_Names.emplace_back( ( bStatic ? "S"s : "D"s ) + std::to_string( bStatic ? i - nDynamic : i ) );
+		( bStatic ? conf.static_c : conf.dynamic_c ).emplace_back( define, nMin, nMax, "" );
+	}
+
+	for ( int i = 0; i < nSkips; ++i )
+	{
+		shader.m_Skips.emplace_back( RandomExpr( rng, nDynamic + nStatic, std::uniform_int_distribution( 1, 4 )( rng ) ) );
+		conf.skip.emplace_back( Format( *shader.m_Skips.back(), shader.m_Names ) );
+	}
+	return shader;
+}
+
+// Random skips over that many defines easily skip everything, these only apply where a static define is at its lowest value
+static void AddLimitedSkips( std::mt19937_64& rng, Shader_t& shader, int nSkips )
+{
+	const int nDynamic = static_cast<int>( shader.m_Config.dynamic_c.size() );
+	for ( int i = 0; i < nSkips; ++i )
+	{
+		auto pSkip     = std::make_unique<Expr_t>();
+		pSkip->m_eKind = Expr_t::Kind::And;
+		pSkip->m_pX    = std::make_unique<Expr_t>( Expr_t { Expr_t::Kind::Eq, 0, std::make_unique<Expr_t>( Expr_t { Expr_t::Kind::Var, nDynamic + i, nullptr, nullptr } ),
+															std::make_unique<Expr_t>( Expr_t { Expr_t::Kind::Const, shader.m_Config.static_c[i].minVal, nullptr, nullptr } ) } );
+		pSkip->m_pY    = RandomExpr( rng, static_cast<int>( shader.m_Names.size() ), 3 );
+		shader.m_Config.skip.emplace_back( Format( *pSkip, shader.m_Names ) );
+		shader.m_Skips.emplace_back( std::move( pSkip ) );
+	}
+}
+
+// Comparisons nested far deeper than the evaluation stack, on random sides
+static void AddDeepSkip( std::mt19937_64& rng, Shader_t& shader, int nDepth )
+{
+	const int nSlots = static_cast<int>( shader.m_Names.size() );
+	std::uniform_int_distribution slot( 0, nSlots - 1 );
+	auto pSkip = std::make_unique<Expr_t>( Expr_t { Expr_t::Kind::Var, slot( rng ), nullptr, nullptr } );
+	for ( int i = 0; i < nDepth; ++i )
+	{
+		auto pVar  = std::make_unique<Expr_t>( Expr_t { Expr_t::Kind::Var, slot( rng ), nullptr, nullptr } );
+		auto pNext = std::make_unique<Expr_t>();
+		pNext->m_eKind = static_cast<Expr_t::Kind>( std::uniform_int_distribution( static_cast<int>( Expr_t::Kind::Eq ), static_cast<int>( Expr_t::Kind::Le ) )( rng ) );
+		const bool bLeft = std::uniform_int_distribution( 0, 1 )( rng );
+		pNext->m_pX = bLeft ? std::move( pSkip ) : std::move( pVar );
+		pNext->m_pY = bLeft ? std::move( pVar ) : std::move( pSkip );
+		pSkip       = std::move( pNext );
+	}
+	shader.m_Config.skip.emplace_back( Format( *pSkip, shader.m_Names ) );
+	shader.m_Skips.emplace_back( std::move( pSkip ) );
+}
+
+static void ComboValues( const std::vector<CfgProcessor::ComboDefineInfo>& defines, uint64_t iCombo, std::vector<int>& values )
+{
+	values.resize( defines.size() );
+	for ( size_t nSlot = 0; nSlot < defines.size(); ++nSlot )
+	{
+		const CfgProcessor::ComboDefineInfo& define = defines[nSlot];
+		values[nSlot] = define.m_nMin + static_cast<int>( iCombo / define.m_nStride % ( static_cast<uint64_t>( define.m_nMax - define.m_nMin ) + 1 ) );
+	}
+}
+
+static void CheckDecode( const CfgProcessor::CfgEntryInfo& info, const std::vector<CfgProcessor::ComboDefineInfo>& defines, uint64_t iCommand, std::vector<int>& values )
+{
+	CfgProcessor::ComboHandle hCombo = CfgProcessor::Combo_GetCombo( iCommand );
+	Check( hCombo != nullptr, "command decodes"sv, iCommand );
+	if ( !hCombo )
+		return;
+
+	// Commands count the combos down
+	const uint64_t iCombo = info.m_numCombos - 1 - ( iCommand - info.m_iCommandStart );
+	Check( CfgProcessor::Combo_GetComboNum( hCombo ) == iCombo, "combo number of the command"sv, iCommand );
+	Check( CfgProcessor::Combo_GetCommandNum( hCombo ) == iCommand, "command number of the combo"sv, iCommand );
+	Check( CfgProcessor::Combo_GetEntryInfo( hCombo )->m_iCommandStart == info.m_iCommandStart, "entry of the command"sv, iCommand );
+
+	ComboValues( defines, iCombo, values );
+	const CfgProcessor::ComboBuildCommand& command = CfgProcessor::Combo_BuildCommand( hCombo );
+	Check( command.defines.size() == defines.size() + 2, "number of defines"sv, iCommand );
+	Check( command.defines[0].second == std::string_view( command.comboNumber ), "SHADERCOMBO define"sv, iCommand );
+	for ( size_t nSlot = 0; nSlot < defines.size() && nSlot + 2 < command.defines.size(); ++nSlot )
+	{
+		Check( command.defines[nSlot + 2].first == defines[nSlot].m_szName, "define name"sv, iCommand );
+		Check( command.defines[nSlot + 2].second == std::to_string( values[nSlot] ), "define value"sv, iCommand );
+	}
+	CfgProcessor::Combo_Free( hCombo );
+}
+
+// Commands Combo_GetNext visits in [iBegin, iEnd)
+static std::vector<uint64_t> Enumerate( uint64_t iBegin, uint64_t iEnd )
+{
+	std::vector<uint64_t> commands;
+	uint64_t iCommand                = iBegin;
+	CfgProcessor::ComboHandle hCombo = nullptr;
+	for ( CfgProcessor::Combo_GetNext( iCommand, hCombo, iEnd ); hCombo && iCommand < iEnd; CfgProcessor::Combo_GetNext( iCommand, hCombo, iEnd ) )
+		commands.emplace_back( iCommand );
+	CfgProcessor::Combo_Free( hCombo );
+	return commands;
+}
+
+// Non-skipped commands of the entry, empty when there are too many combos to find them all
+static std::vector<uint64_t> CheckEntry( std::mt19937_64& rng, const CfgProcessor::CfgEntryInfo& info, const Shader_t& shader )
+{
+	const std::vector<CfgProcessor::ComboDefineInfo> defines = CfgProcessor::DescribeComboDefines( info );
+	Check( defines.size() == shader.m_Names.size(), "number of combo defines"sv, info.m_iCommandStart );
+	if ( defines.size() != shader.m_Names.size() )
+		return {};
+
+	// Mixed radix with the first define as the lowest digit
+	uint64_t nStride = 1;
+	for ( size_t nSlot = 0; nSlot < defines.size(); ++nSlot )
+	{
+		Check( defines[nSlot].m_szName == shader.m_Names[nSlot], "define order"sv, nSlot );
+		Check( defines[nSlot].m_nStride == nStride, "define stride"sv, nSlot );
+		nStride *= static_cast<uint64_t>( defines[nSlot].m_nMax - defines[nSlot].m_nMin ) + 1;
+	}
+	Check( nStride == info.m_numCombos, "number of combos"sv, info.m_iCommandStart );
+
+	std::vector<int> values;
+	std::uniform_int_distribution<uint64_t> command( info.m_iCommandStart, info.m_iCommandEnd - 1 );
+	if ( info.m_numCombos <= MAX_DECODED_COMBOS )
+	{
+		for ( uint64_t iCommand = info.m_iCommandStart; iCommand < info.m_iCommandEnd; ++iCommand )
+			CheckDecode( info, defines, iCommand, values );
+	}
+	else
+	{
+		for ( uint64_t i = 0; i < SAMPLES; ++i )
+			CheckDecode( info, defines, command( rng ), values );
+	}
+
+	if ( info.m_numCombos > MAX_BRUTE_FORCE_COMBOS )
+	{
+		// Every found combo holds, the ones jumped over are skipped as long as there are few enough to look at
+		for ( uint64_t i = 0; i < SAMPLES / 16; ++i )
+		{
+			const uint64_t iBegin      = command( rng );
+			uint64_t iCommand          = iBegin;
+			CfgProcessor::ComboHandle hCombo = nullptr;
+			CfgProcessor::Combo_GetNext( iCommand, hCombo, info.m_iCommandEnd );
+			if ( hCombo )
+			{
+				ComboValues( defines, info.m_numCombos - 1 - ( iCommand - info.m_iCommandStart ), values );
+				Check( !shader.IsSkipped( values.data() ), "found combo is not skipped"sv, iCommand );
+			}
+			for ( uint64_t iSkipped = iBegin; iSkipped < std::min( iCommand, iBegin + MAX_PASSED_COMBOS ); ++iSkipped )
+			{
+				ComboValues( defines, info.m_numCombos - 1 - ( iSkipped - info.m_iCommandStart ), values );
+				Check( shader.IsSkipped( values.data() ), "passed combo is skipped"sv, iSkipped );
+			}
+			CfgProcessor::Combo_Free( hCombo );
+		}
+		return {};
+	}
+
+	// Brute force, every combo evaluated through the reference expressions
+	std::vector<uint64_t> expected;
+	std::vector<uint64_t> arrDynamicLeft( info.m_numStaticCombos );
+	for ( uint64_t iCommand = info.m_iCommandStart; iCommand < info.m_iCommandEnd; ++iCommand )
+	{
+		const uint64_t iCombo = info.m_numCombos - 1 - ( iCommand - info.m_iCommandStart );
+		ComboValues( defines, iCombo, values );
+		if ( shader.IsSkipped( values.data() ) )
+			continue;
+		expected.emplace_back( iCommand );
+		++arrDynamicLeft[iCombo / info.m_numDynamicCombos];
+	}
+
+	Check( Enumerate( info.m_iCommandStart, info.m_iCommandEnd ) == expected, "combos enumerated"sv, info.m_iCommandStart );
+	Check( info.m_numNonSkippedCombos == expected.size(), "number of non-skipped combos"sv, info.m_iCommandStart );
+	Check( CfgProcessor::CountNonSkippedDynamicCombos( info ) == arrDynamicLeft, "non-skipped dynamic combos of every static combo"sv, info.m_iCommandStart );
+
+	// Windows starting and ending anywhere
+	for ( int i = 0, nWindows = info.m_numCombos <= MAX_DECODED_COMBOS ? 64 : 4; i < nWindows; ++i )
+	{
+		uint64_t iBegin = command( rng ), iEnd = command( rng ) + 1;
+		if ( iBegin > iEnd )
+			std::swap( iBegin, iEnd );
+		const auto itBegin = std::lower_bound( expected.cbegin(), expected.cend(), iBegin );
+		const auto itEnd   = std::lower_bound( expected.cbegin(), expected.cend(), iEnd );
+		Check( Enumerate( iBegin, iEnd ) == std::vector<uint64_t>( itBegin, itEnd ), "combos enumerated in a window"sv, iBegin );
+	}
+	return expected;
+}
+
+static void CheckPrograms( std::mt19937_64& rng )
+{
+	static constexpr int SLOTS = 6;
+	const uint32_t nWidth      = CExprProgram::BatchWidth();
+	uint64_t nBatches = 0, nScalarOnly = 0;
+
+	std::vector<int> lanes( SLOTS * CExprProgram::MAX_BATCH_WIDTH );
+	std::vector<int> values( SLOTS );
+	std::uniform_int_distribution value( -2, 4 );
+	for ( int i = 0; i < 4096; ++i )
+	{
+		const auto pExpr = RandomExpr( rng, SLOTS, std::uniform_int_distribution( 0, 6 )( rng ) );
+		CExprProgram program;
+		Emit( *pExpr, program );
+		Check( program.IsValid(), "program is valid"sv, i );
+
+		for ( int nRound = 0; nRound < 16; ++nRound )
+		{
+			for ( int& nValue : lanes )
+				nValue = value( rng );
+
+			uint32_t nExpected = 0;
+			for ( uint32_t nLane = 0; nLane < std::max( nWidth, 1U ); ++nLane )
+			{
+				for ( int nSlot = 0; nSlot < SLOTS; ++nSlot )
+					values[nSlot] = lanes[nSlot * nWidth + nLane];
+				const int nResult = Evaluate( *pExpr, values.data() );
+				Check( program.Evaluate( values.data() ) == nResult, "program evaluates like the expression"sv, i );
+				nExpected |= static_cast<uint32_t>( nResult != 0 ) << nLane;
+			}
+
+			if ( !nWidth )
+				continue;
+			uint32_t nMask = 0;
+			if ( program.EvaluateBatch( lanes.data(), nMask ) )
+			{
+				++nBatches;
+				Check( nMask == nExpected, "lanes evaluate like single combos"sv, i );
+			}
+			else
+				++nScalarOnly;
+		}
+	}
+
+	if ( nWidth )
+		std::cout << "Lane evaluation: "sv << nWidth << " lanes, "sv << nBatches << " batches checked, "sv << nScalarOnly << " left to single combos"sv << std::endl;
+	else
+		std::cout << clr::pinkish << "Lane evaluation: not supported by this CPU"sv << clr::reset << std::endl;
+}
+
+// What a compile thread does with every command it picks up
+static uint64_t TakeCommands( const std::vector<uint64_t>& commands )
+{
+	uint64_t nSum = 0;
+	for ( const uint64_t iCommand : commands )
+	{
+		CfgProcessor::ComboHandle hCombo = CfgProcessor::Combo_GetCombo( iCommand );
+		CfgProcessor::ComboHandle hCopy  = CfgProcessor::Combo_Alloc( hCombo );
+		nSum += CfgProcessor::Combo_BuildCommand( hCopy ).defines.size();
+		CfgProcessor::Combo_Free( hCopy );
+		CfgProcessor::Combo_Free( hCombo );
+	}
+	return nSum;
+}
+
+static void CheckAllocations( std::mt19937_64& rng, const CfgProcessor::CfgEntryInfo& info )
+{
+	std::uniform_int_distribution<uint64_t> command( info.m_iCommandStart, info.m_iCommandEnd - 1 );
+	std::vector<uint64_t> commands( SAMPLES );
+	for ( uint64_t& iCommand : commands )
+		iCommand = command( rng );
+
+	// The first round fills the handle pool and the command buffer of the thread
+	TakeCommands( commands );
+	const uint64_t nBefore = s_nAllocations.load();
+	TakeCommands( commands );
+	const uint64_t nAllocations = s_nAllocations.load() - nBefore;
+	Check( nAllocations == 0, "no allocations decoding, copying and building warm combos"sv, nAllocations );
+}
+
+template <typename F>
+static double NanosecondsEach( uint64_t nCount, F&& f )
+{
+	const auto start = std::chrono::steady_clock::now();
+	f();
+	return std::chrono::duration<double, std::nano>( std::chrono::steady_clock::now() - start ).count() / static_cast<double>( std::max<uint64_t>( nCount, 1 ) );
+}
+
+static void Report( const std::string_view& what, double fNanoseconds )
+{
+	std::cout << what << ": "sv << clr::green << fNanoseconds << clr::reset << " ns"sv << std::endl;
+}
+
+// Combo_GetCombo as it was before handles were decoded from the command number. Setup walks the entry and keeps a
+// checkpoint every 1000 combos or 1/500 of the entry, a lookup copies the nearest earlier one and advances it.
+class CBaselineDecoder
+{
+public:
+	struct Handle_t
+	{
+		uint64_t m_iTotalCommand;
+		uint64_t m_iComboNumber;
+		std::vector<int> m_arrVarSlots;
+	};
+
+	CBaselineDecoder( const CfgProcessor::CfgEntryInfo& info, std::vector<CfgProcessor::ComboDefineInfo> defines ) : m_arrDefines( std::move( defines ) )
+	{
+		Handle_t chi { info.m_iCommandStart, info.m_numCombos - 1, {} };
+		for ( const CfgProcessor::ComboDefineInfo& define : m_arrDefines )
+			chi.m_arrVarSlots.emplace_back( define.m_nMax );
+		m_mapComboCommands.emplace( info.m_iCommandStart, chi );
+
+		const uint64_t iPartStep = std::max<uint64_t>( 1000, info.m_numCombos / 500 );
+		for ( uint64_t iRecord = info.m_iCommandStart + iPartStep; iRecord < info.m_iCommandStart + info.m_numCombos; iRecord += iPartStep )
+		{
+			uint64_t iAdvance = iPartStep;
+			AdvanceCommands( chi, iAdvance );
+			m_mapComboCommands.emplace( iRecord, chi );
+		}
+	}
+
+	[[nodiscard]] std::unique_ptr<Handle_t> GetCombo( uint64_t iCommandNumber ) const
+	{
+		auto it = m_mapComboCommands.upper_bound( iCommandNumber );
+		if ( it == m_mapComboCommands.cbegin() )
+			return nullptr;
+		--it;
+
+		auto pImpl        = std::make_unique<Handle_t>( it->second );
+		uint64_t iAdvance = iCommandNumber - it->first;
+		AdvanceCommands( *pImpl, iAdvance );
+		return pImpl;
+	}
+
+private:
+	bool AdvanceCommands( Handle_t& chi, uint64_t& riAdvanceMore ) const noexcept
+	{
+		if ( !riAdvanceMore )
+			return true;
+		if ( chi.m_iComboNumber < riAdvanceMore )
+		{
+			riAdvanceMore -= chi.m_iComboNumber;
+			return false;
+		}
+
+		chi.m_iTotalCommand += riAdvanceMore;
+		chi.m_iComboNumber -= riAdvanceMore;
+		for ( size_t nSlot = 0; nSlot < chi.m_arrVarSlots.size() && riAdvanceMore > 0; ++nSlot )
+		{
+			const CfgProcessor::ComboDefineInfo& define = m_arrDefines[nSlot];
+			int& nValue = chi.m_arrVarSlots[nSlot];
+			riAdvanceMore += static_cast<uint64_t>( define.m_nMax ) - nValue;
+			nValue = define.m_nMax;
+
+			const int iInterval = define.m_nMax - define.m_nMin + 1;
+			nValue -= static_cast<int>( riAdvanceMore % iInterval );
+			riAdvanceMore /= iInterval;
+		}
+		return true;
+	}
+
+	std::vector<CfgProcessor::ComboDefineInfo> m_arrDefines;
+	std::map<uint64_t, Handle_t> m_mapComboCommands;
+};
+
+static void Bench( std::mt19937_64& rng, const CfgProcessor::CfgEntryInfo& info )
+{
+	static constexpr uint64_t COUNT = 1 << 22;
+	std::uniform_int_distribution<uint64_t> command( info.m_iCommandStart, info.m_iCommandEnd - 1 );
+	std::cout << "Benchmarking on "sv << clr::green << info.m_szName << clr::reset << ", "sv << info.m_numCombos << " combos"sv << std::endl;
+
+	std::vector<uint64_t> commands( COUNT );
+	for ( uint64_t& iCommand : commands )
+		iCommand = command( rng );
+	uint64_t nSum = 0;
+	const double fDecode = NanosecondsEach( COUNT, [&]() {
+		for ( const uint64_t iCommand : commands )
+		{
+			CfgProcessor::ComboHandle hCombo = CfgProcessor::Combo_GetCombo( iCommand );
+			nSum += CfgProcessor::Combo_GetComboNum( hCombo );
+			CfgProcessor::Combo_Free( hCombo );
+		}
+	} );
+	Report( "Decoding a combo"sv, fDecode );
+
+	const std::vector<CfgProcessor::ComboDefineInfo> defines = CfgProcessor::DescribeComboDefines( info );
+	std::unique_ptr<CBaselineDecoder> pBaseline;
+	Report( "    Setting up the checkpoint map it replaced"sv, NanosecondsEach( 1, [&]() { pBaseline = std::make_unique<CBaselineDecoder>( info, defines ); } ) );
+	const double fBaseline = NanosecondsEach( COUNT, [&]() {
+		for ( const uint64_t iCommand : commands )
+			nSum += pBaseline->GetCombo( iCommand )->m_iComboNumber;
+	} );
+	Report( "    Decoding a combo by walking the checkpoint map"sv, fBaseline );
+	std::cout << "    "sv << clr::green << fBaseline / fDecode << clr::reset << "x faster than the map walk"sv << std::endl;
+
+	std::vector<int> values;
+	for ( uint64_t i = 0; i < SAMPLES / 16; ++i )
+	{
+		const uint64_t iCommand = commands[i];
+		ComboValues( defines, info.m_numCombos - 1 - ( iCommand - info.m_iCommandStart ), values );
+		const std::unique_ptr<CBaselineDecoder::Handle_t> pHandle = pBaseline->GetCombo( iCommand );
+		Check( pHandle->m_arrVarSlots == values, "map walk decodes the same combo"sv, iCommand );
+	}
+
+	CfgProcessor::ComboHandle hCombo = CfgProcessor::Combo_GetCombo( info.m_iCommandStart );
+	Report( "Building a command"sv, NanosecondsEach( COUNT / 4, [&]() {
+		for ( uint64_t i = 0; i < COUNT / 4; ++i )
+			nSum += CfgProcessor::Combo_BuildCommand( hCombo ).defines.size();
+	} ) );
+	// Every thread has its own handle pool and command buffer, so this should scale with the cores
+	const unsigned int nMaxThreads = std::max( std::thread::hardware_concurrency(), 4U );
+	for ( unsigned int nThreads = 1;; nThreads = std::min( nThreads * 2, nMaxThreads ) )
+	{
+		std::vector<std::thread> threads;
+		std::vector<uint64_t> sums( nThreads );
+		const double fEach = NanosecondsEach( COUNT * nThreads, [&]() {
+			for ( unsigned int i = 0; i < nThreads; ++i )
+				threads.emplace_back( [&commands, &sums, i]() { sums[i] = TakeCommands( commands ); } );
+			for ( std::thread& thread : threads )
+				thread.join();
+		} );
+		for ( const uint64_t nThreadSum : sums )
+			nSum += nThreadSum;
+		std::cout << "Taking commands on "sv << nThreads << " threads: "sv << clr::green << 1e3 / fEach << clr::reset << "M commands/s"sv << std::endl;
+		if ( nThreads == nMaxThreads )
+			break;
+	}
+	Report( "Copying a combo"sv, NanosecondsEach( COUNT, [&]() {
+		for ( uint64_t i = 0; i < COUNT; ++i )
+		{
+			CfgProcessor::ComboHandle hCopy = CfgProcessor::Combo_Alloc( hCombo );
+			nSum += CfgProcessor::Combo_GetComboNum( hCopy );
+			CfgProcessor::Combo_Free( hCopy );
+		}
+	} ) );
+	CfgProcessor::Combo_Free( hCombo );
+
+	uint64_t nFound = 0, iCommand = info.m_iCommandStart;
+	const double fEnumerate = NanosecondsEach( 1, [&]() {
+		CfgProcessor::ComboHandle hNext = nullptr;
+		for ( CfgProcessor::Combo_GetNext( iCommand, hNext, info.m_iCommandEnd ); hNext && nFound < COUNT; CfgProcessor::Combo_GetNext( iCommand, hNext, info.m_iCommandEnd ) )
+			++nFound;
+		CfgProcessor::Combo_Free( hNext );
+	} );
+	Report( "Finding the next combo"sv, fEnumerate / static_cast<double>( std::max<uint64_t>( nFound, 1 ) ) );
+	std::cout << "    "sv << nFound << " combos found in "sv << iCommand - info.m_iCommandStart << " commands"sv << std::endl;
+
+	if ( info.m_numStaticCombos <= MAX_BRUTE_FORCE_COMBOS )
+		Report( "Counting non-skipped dynamic combos of the entry"sv, NanosecondsEach( 1, [&]() { nSum += CfgProcessor::CountNonSkippedDynamicCombos( info ).size(); } ) );
+
+	// The same combos through the skip expression tree and through its program
+	const uint64_t iFirst = std::uniform_int_distribution<uint64_t>( 0, info.m_numCombos - std::min( info.m_numCombos, COUNT ) )( rng );
+	uint64_t nTreeSkipped = 0, nProgramSkipped = 0;
+	const double fTree    = NanosecondsEach( COUNT, [&]() { nTreeSkipped = CfgProcessor::CountSkippedCombos( info, iFirst, COUNT, true ); } );
+	const double fProgram = NanosecondsEach( COUNT, [&]() { nProgramSkipped = CfgProcessor::CountSkippedCombos( info, iFirst, COUNT, false ); } );
+	Check( nTreeSkipped == nProgramSkipped, "tree and program skip the same combos"sv, iFirst );
+	std::cout << "Checking skips: "sv << clr::green << 1e3 / fTree << clr::reset << "M combos/s walking the expression tree, "sv << clr::green << 1e3 / fProgram
+			  << clr::reset << "M combos/s running its program ("sv << fTree / fProgram << "x)"sv << std::endl;
+
+	// A skip of every shader of this size
+	static constexpr int SLOTS = 12;
+	std::vector<std::unique_ptr<Expr_t>> exprs;
+	std::vector<CExprProgram> programs( 64 );
+	for ( CExprProgram& program : programs )
+	{
+		Emit( *exprs.emplace_back( RandomExpr( rng, SLOTS, 5 ) ), program );
+	}
+	std::vector<int> lanes( SLOTS * CExprProgram::MAX_BATCH_WIDTH );
+	std::uniform_int_distribution value( 0, 3 );
+	for ( int& nValue : lanes )
+		nValue = value( rng );
+
+	Report( "Evaluating a combo"sv, NanosecondsEach( COUNT, [&]() {
+		for ( uint64_t i = 0; i < COUNT; ++i )
+			nSum += programs[i % programs.size()].Evaluate( &lanes[i % CExprProgram::MAX_BATCH_WIDTH] );
+	} ) );
+	if ( const uint32_t nWidth = CExprProgram::BatchWidth() )
+	{
+		Report( "Evaluating a combo in lanes"sv, NanosecondsEach( COUNT, [&]() {
+			for ( uint64_t i = 0; i < COUNT / nWidth; ++i )
+			{
+				uint32_t nMask = 0;
+				if ( programs[i % programs.size()].EvaluateBatch( lanes.data(), nMask ) )
+					nSum += nMask;
+			}
+		} ) );
+	}
+
+	// Keeps the loops from being thrown away
+	if ( nSum == 1 )
+		std::cout << std::endl;
+}
+
+int main( int argc, const char* argv[] )
+{
+	const bool bBench = argc > 1 && argv[1] == "bench"sv;
+	std::mt19937_64 rng( 0x5EED );
+
+	std::error_code c;
+	const fs::path root = fs::temp_directory_path( c ) / "ShaderCompileTests";
+	fs::create_directories( root, c );
+	std::ofstream( root / "combotests.fxc" ) << "float4 main() : COLOR { return 0; }\n";
+
+	// Small random shaders checked combo by combo, one of 2^42 combos sampled
+	std::vector<Shader_t> shaders;
+	for ( int i = 0; i < 48; ++i )
+	{
+		shaders.emplace_back( RandomShader( rng, "small"s + std::to_string( i ), std::uniform_int_distribution( 0, 3 )( rng ), std::uniform_int_distribution( 0, 4 )( rng ), 0, 3,
+											std::uniform_int_distribution( 0, 3 )( rng ) ) );
+	}
+	AddDeepSkip( rng, shaders.emplace_back( RandomShader( rng, "deep", 2, 4, 1, 3, 1 ) ), 3 * CExprProgram::MAX_STACK_DEPTH );
+	AddLimitedSkips( rng, shaders.emplace_back( RandomShader( rng, "medium", 2, 18, 1, 1, 0 ) ), 3 );
+	AddLimitedSkips( rng, shaders.emplace_back( RandomShader( rng, "large", 2, 19, 3, 3, 0 ) ), 3 );
+
+	std::vector<CfgProcessor::ShaderConfig> configs;
+	for ( const Shader_t& shader : shaders )
+		configs.emplace_back( shader.m_Config );
+	if ( !CfgProcessor::SetupConfiguration( configs, root, false ) )
+	{
+		std::cout << clr::red << "Couldn't set up the shaders"sv << clr::reset << std::endl;
+		return 1;
+	}
+
+	const std::unique_ptr<CfgProcessor::CfgEntryInfo[]> arrEntries = CfgProcessor::DescribeConfiguration( false );
+
+	if ( bBench )
+	{
+		for ( const CfgProcessor::CfgEntryInfo* pInfo = arrEntries.get(); !pInfo->m_szName.empty(); ++pInfo )
+		{
+			if ( pInfo->m_szName == "medium"sv || pInfo->m_szName == "large"sv )
+				Bench( rng, *pInfo );
+		}
+		return s_nFailures ? 1 : 0;
+	}
+
+	// Non-skipped commands of every entry, to check windows across entries
+	std::vector<std::vector<uint64_t>> arrExpected;
+	for ( const CfgProcessor::CfgEntryInfo* pInfo = arrEntries.get(); !pInfo->m_szName.empty(); ++pInfo )
+	{
+		const auto it = std::find_if( shaders.cbegin(), shaders.cend(), [pInfo]( const Shader_t& shader ) { return shader.m_Config.name == pInfo->m_szName; } );
+		Check( it != shaders.cend(), "entry belongs to a shader"sv, pInfo->m_iCommandStart );
+		arrExpected.emplace_back( it != shaders.cend() ? CheckEntry( rng, *pInfo, *it ) : std::vector<uint64_t>() );
+	}
+	Check( arrExpected.size() == shaders.size(), "every shader has an entry"sv, arrExpected.size() );
+
+	// Windows from the middle of an entry into the middle of the next one, Combo_GetNext moves on by itself
+	for ( size_t i = 0; i + 1 < arrExpected.size(); ++i )
+	{
+		const CfgProcessor::CfgEntryInfo& info = arrEntries[i];
+		const CfgProcessor::CfgEntryInfo& next = arrEntries[i + 1];
+		if ( info.m_numCombos > MAX_DECODED_COMBOS || next.m_numCombos > MAX_DECODED_COMBOS )
+			continue;
+		const uint64_t iBegin = info.m_iCommandStart + info.m_numCombos / 2;
+		const uint64_t iEnd   = next.m_iCommandStart + next.m_numCombos / 2 + 1;
+		std::vector<uint64_t> expected;
+		std::copy_if( arrExpected[i].cbegin(), arrExpected[i].cend(), std::back_inserter( expected ), [iBegin]( uint64_t iCommand ) { return iCommand >= iBegin; } );
+		std::copy_if( arrExpected[i + 1].cbegin(), arrExpected[i + 1].cend(), std::back_inserter( expected ), [iEnd]( uint64_t iCommand ) { return iCommand < iEnd; } );
+		Check( Enumerate( iBegin, iEnd ) == expected, "combos enumerated across entries"sv, iBegin );
+	}
+
+	CheckPrograms( rng );
+	for ( const CfgProcessor::CfgEntryInfo* pInfo = arrEntries.get(); !pInfo->m_szName.empty(); ++pInfo )
+		CheckAllocations( rng, *pInfo );
+
+	if ( s_nFailures )
+	{
+		std::cout << clr::red << s_nFailures << " of "sv << s_nChecks << " checks failed"sv << clr::reset << std::endl;
+		return 1;
+	}
+	std::cout << clr::green << s_nChecks << " checks passed"sv << clr::reset << std::endl;
+	return 0;
+}
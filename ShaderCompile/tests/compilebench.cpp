@@ -0,0 +1,131 @@
+// Times whole ShaderCompile runs with the mock compiler at no latency, so only scheduling, packing and writing are left.
+// "ShaderCompileBench tiny" compiles many small shaders, "contention" one shader with many combos that all compile
+// at once and "static" one shader with a million static combos. Without an argument every bench runs.
+
+#include "termcolor/style.hpp"
+#include "termcolors.hpp"
+#include <chrono>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+using namespace std::literals;
+namespace fs = std::filesystem;
+
+static constexpr uint32_t THREAD_COUNTS[] = { 8, 32, 64 };
+
+// Shader with binary defines, every combo differs in its source
+static std::string WriteShader( const fs::path& root, const std::string& name, int nStatic, int nDynamic )
+{
+	const std::string fileName = name + "_ps2x.fxc"s;
+	std::ofstream file( root / fileName );
+	for ( int i = 0; i < nStatic; ++i )
+		file << "// STATIC: \"S"sv << i << "\" \"0..1\"\n"sv;
+	for ( int i = 0; i < nDynamic; ++i )
+		file << "// DYNAMIC: \"D"sv << i << "\" \"0..1\"\n"sv;
+	file << "float4 main() : COLOR\n{\n\tfloat4 c = 0;\n"sv;
+	for ( int i = 0; i < nStatic; ++i )
+		file << "#if S"sv << i << "\n\tc.r += "sv << i << ";\n#endif\n"sv;
+	for ( int i = 0; i < nDynamic; ++i )
+		file << "#if D"sv << i << "\n\tc.g += "sv << i << ";\n#endif\n"sv;
+	file << "\treturn c;\n}\n"sv;
+	return fileName;
+}
+
+// Runs ShaderCompile over the files and returns the wall time in seconds, its busy and lock reports are printed
+static double Run( const fs::path& root, uint32_t nThreads, const std::string& args, const std::vector<std::string>& files )
+{
+	std::error_code c;
+	fs::remove_all( root / "shaders", c );
+	fs::remove_all( root / "include", c );
+
+	const fs::path log = root / "bench.log";
+	std::string command = "\""s + SHADERCOMPILE_EXE + "\" -ver 30 -shaderpath \""s + root.string() + "\" -compiler mock -mocklatency 0 -nodedup -lockstats -threads "s
+						+ std::to_string( nThreads ) + " "s + args;
+	for ( const std::string& file : files )
+		command += " "s + file;
+	command += " > \""s + log.string() + "\" 2>&1"s;
+#ifdef _WIN32
+	// cmd drops the outer quotes
+	command = "\""s + command + "\""s;
+#endif
+
+	const auto start  = std::chrono::steady_clock::now();
+	const int nResult = std::system( command.c_str() );
+	const double fSeconds = std::chrono::duration<double>( std::chrono::steady_clock::now() - start ).count();
+	if ( nResult )
+		std::cout << clr::red << "ShaderCompile failed with "sv << nResult << ", see "sv << log.string() << clr::reset << std::endl;
+
+	std::ifstream output( log );
+	for ( std::string line; std::getline( output, line ); )
+	{
+		// Progress is rewound in place, only the last part of a line is what was left on the screen
+		if ( const size_t nRewind = line.rfind( '\r' ); nRewind != std::string::npos )
+			line.erase( 0, nRewind + 1 );
+		if ( line.starts_with( "Busy:"sv ) || line.starts_with( "Locks:"sv ) || line.starts_with( "    "sv ) || line.find( "finalized in"sv ) != std::string::npos )
+			std::cout << "    "sv << line << std::endl;
+	}
+	return fSeconds;
+}
+
+// Thread startup and the tail of every shader, the compiles themselves take no time
+static void BenchTiny( const fs::path& root )
+{
+	static constexpr int SHADERS = 200;
+	std::vector<std::string> files;
+	for ( int i = 0; i < SHADERS; ++i )
+		files.emplace_back( WriteShader( root, "tiny"s + std::to_string( i ), 2, 2 ) );
+
+	for ( const uint32_t nThreads : THREAD_COUNTS )
+	{
+		const double fSeconds = Run( root, nThreads, {}, files );
+		std::cout << SHADERS << " tiny shaders on "sv << nThreads << " threads: "sv << clr::green << fSeconds << clr::reset << " s, "sv << fSeconds * 1e3 / SHADERS << " ms per shader"sv << std::endl;
+	}
+}
+
+// Every thread takes commands and hands results over as fast as it can, what is left is waiting on each other
+static void BenchContention( const fs::path& root )
+{
+	static constexpr int STATIC = 4;
+	static constexpr int DYNAMIC = 14;
+	static constexpr uint64_t COMBOS = 1ull << ( STATIC + DYNAMIC );
+	const std::vector<std::string> files { WriteShader( root, "contention"s, STATIC, DYNAMIC ) };
+
+	for ( const uint32_t nThreads : THREAD_COUNTS )
+	{
+		const double fSeconds = Run( root, nThreads, "-mocksize 64"s, files );
+		std::cout << COMBOS << " combos on "sv << nThreads << " threads: "sv << clr::green << fSeconds << clr::reset << " s, "sv << static_cast<uint64_t>( COMBOS / fSeconds ) << " combos/s"sv << std::endl;
+	}
+}
+
+// Sorting, deduplicating and writing the static combos of one shader when its vcs file is finalized
+static void BenchStaticCombos( const fs::path& root )
+{
+	static constexpr int STATIC = 20;
+	const std::vector<std::string> files { WriteShader( root, "static"s, STATIC, 0 ) };
+
+	const double fSeconds = Run( root, THREAD_COUNTS[0], "-mocksize 64 -compress fast -verbose"s, files );
+	std::cout << ( 1u << STATIC ) << " static combos on "sv << THREAD_COUNTS[0] << " threads: "sv << clr::green << fSeconds << clr::reset << " s for the whole run"sv << std::endl;
+}
+
+int main( int argc, const char* argv[] )
+{
+	const std::string_view bench = argc > 1 ? argv[1] : ""sv;
+
+	std::error_code c;
+	const fs::path root = fs::temp_directory_path( c ) / "ShaderCompileBench";
+	fs::remove_all( root, c );
+	fs::create_directories( root, c );
+
+	if ( bench.empty() || bench == "tiny"sv )
+		BenchTiny( root );
+	if ( bench.empty() || bench == "contention"sv )
+		BenchContention( root );
+	if ( bench.empty() || bench == "static"sv )
+		BenchStaticCombos( root );
+	return 0;
+}
@@ -8,6 +8,7 @@
 
 #include "utlbuffer.h"
 
+#include <algorithm>
 #include <cctype>
 #include <climits>
 #include <cstdarg>